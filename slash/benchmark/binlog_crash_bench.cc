@@ -0,0 +1,166 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+// Crash a Binlog through FaultInjectionEnv and measure the recovery under
+// sync policies:
+//   binlog_crash_bench [dir] [records] [record size] [sync latency us]
+// The Binlog never syncs by itself, so a policy syncs all its open files
+// every N appends with FaultInjectionEnv::SyncAll, N = 0 never syncs.
+// After the appends the Binlog is deleted and the unsynced data dropped,
+// then the time to reopen it and replay the records left is printed,
+// with the records lost and the records left beyond the producer
+// position, which the recovered Binlog overwrites.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "slash/include/env.h"
+#include "slash/include/fault_injection_env.h"
+#include "slash/include/slash_binlog.h"
+
+using namespace slash;
+
+// Where a record is written, offsets in the binlog file filenum
+struct Position {
+  uint32_t filenum;
+  uint64_t begin;
+  uint64_t end;
+};
+
+static std::string Record(int i, size_t size) {
+  std::string record = std::to_string(i) + ":";
+  record.resize(std::max(size, record.size()), 'x');
+  return record;
+}
+
+static uint64_t FileSize(const std::string& fname) {
+  struct stat st;
+  return stat(fname.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+static void Run(const std::string& dir, int sync_every, int records,
+                size_t record_size, uint64_t sync_latency) {
+  char name[32];
+  snprintf(name, sizeof(name), sync_every == 0 ? "never" : "every %d",
+           sync_every);
+  DeleteDirIfExist(dir);
+  FaultInjectionEnv env;
+  env.SetLatency(FaultInjectionEnv::kFaultSync, sync_latency);
+
+  Binlog* log;
+  Status s = Binlog::Open(dir, &log, &env);
+  if (!s.ok()) {
+    printf("%-10s open failed %s\n", name, s.ToString().c_str());
+    return;
+  }
+  std::vector<Position> positions;
+  uint32_t filenum;
+  uint64_t offset;
+  log->GetProducerStatus(&filenum, &offset);
+  uint64_t start = NowMicros();
+  for (int i = 0; i < records && s.ok(); i++) {
+    uint32_t prev_filenum = filenum;
+    uint64_t prev_offset = offset;
+    s = log->Append(Record(i, record_size));
+    log->GetProducerStatus(&filenum, &offset);
+    Position pos = { filenum, filenum == prev_filenum ? prev_offset : 0,
+                     offset };
+    positions.push_back(pos);
+    if (s.ok() && sync_every > 0 && (i + 1) % sync_every == 0) {
+      s = env.SyncAll();
+    }
+  }
+  uint64_t append_us = std::max<uint64_t>(NowMicros() - start, 1);
+  if (!s.ok()) {
+    printf("%-10s append failed %s\n", name, s.ToString().c_str());
+    delete log;
+    return;
+  }
+
+  // Crash
+  delete log;
+  uint64_t dropped;
+  s = env.DropUnsyncedData(&dropped);
+  if (!s.ok()) {
+    printf("%-10s drop failed %s\n", name, s.ToString().c_str());
+    return;
+  }
+
+  start = NowMicros();
+  s = Binlog::Open(dir, &log, &env);
+  if (!s.ok()) {
+    printf("%-10s recover failed %s\n", name, s.ToString().c_str());
+    return;
+  }
+  uint64_t open_us = NowMicros() - start;
+  log->GetProducerStatus(&filenum, &offset);
+
+  // The records whose data survived, replayable if before the producer
+  int intact = 0;
+  int replayable = 0;
+  for (size_t i = 0; i < positions.size(); i++) {
+    const Position& pos = positions[i];
+    std::string fname = dir + "/binlog" + std::to_string(pos.filenum);
+    if (FileSize(fname) < pos.end) {
+      continue;
+    }
+    intact++;
+    if (pos.filenum < filenum
+        || (pos.filenum == filenum && pos.end <= offset)) {
+      replayable++;
+    }
+  }
+  bool ahead = FileSize(dir + "/binlog" + std::to_string(filenum)) < offset;
+
+  int replayed = 0;
+  int mismatched = 0;
+  BinlogReader* reader = log->NewBinlogReader(positions[0].filenum, 0);
+  if (reader != NULL && !ahead) {
+    std::string record;
+    while (replayed < replayable && reader->ReadRecord(record).ok()) {
+      int seq = atoi(record.c_str());
+      if (record != Record(seq, record_size)) {
+        mismatched++;
+      }
+      replayed++;
+    }
+  }
+  uint64_t recover_us = NowMicros() - start;
+  delete reader;
+  delete log;
+
+  printf("%-10s append %7.1f rec/s  recover %6.1f ms (open %6.1f ms)"
+         "  lost %6d rec %9lu bytes  orphan %6d  replayed %6d%s%s\n",
+         name, records * 1000000.0 / append_us, recover_us / 1000.0,
+         open_us / 1000.0, records - intact, dropped, intact - replayable,
+         replayed, mismatched > 0 ? "  MISMATCH" : "",
+         ahead ? "  MANIFEST AHEAD OF DATA" : "");
+  DeleteDirIfExist(dir);
+}
+
+int main(int argc, char* argv[]) {
+  std::string dir = argc > 1 ? argv[1] : "./binlog_crash_bench";
+  int records = argc > 2 ? atoi(argv[2]) : 2000;
+  size_t record_size = argc > 3 ? atoi(argv[3]) : 100;
+  uint64_t sync_latency = argc > 4 ? atoll(argv[4]) : 0;
+  if (records <= 0) {
+    records = 1;
+  }
+
+  CreatePath(dir);
+  printf("%d records of %lu bytes, sync latency %lu us\n",
+         records, record_size, sync_latency);
+  int policies[] = { 0, 1000, 100, 10, 1 };
+  for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+    Run(dir + "/binlog", policies[i], records, record_size, sync_latency);
+  }
+  DeleteDir(dir);
+  return 0;
+}
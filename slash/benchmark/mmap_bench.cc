@@ -0,0 +1,100 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+// Compare the region sizing and prefaulting of the mmap WritableFile:
+//   mmap_bench [dir] [total MB] [record size] [max region MB]
+// Prints the throughput, the page faults of the process and the munmap
+// calls per GB written.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <string>
+
+#include "slash/include/env.h"
+#include "slash/include/io_stats.h"
+
+using namespace slash;
+
+static uint64_t PageFaults() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt + usage.ru_majflt;
+}
+
+static void Run(const char* name, const std::string& fname,
+                const EnvOptions& options, uint64_t total,
+                size_t record_size) {
+  WritableFile* file;
+  Status s = NewWritableFile(fname, &file, options);
+  if (!s.ok()) {
+    printf("%s: open failed %s\n", name, s.ToString().c_str());
+    return;
+  }
+
+  std::string record(record_size, 'x');
+  uint64_t count = total / record_size;
+  IOStatsContext* ctx = GetIOStatsContext();
+  ctx->Reset();
+  SetIOStatsLevel(kIOStatsEnableTime);
+  uint64_t faults = PageFaults();
+  uint64_t start = NowMicros();
+  for (uint64_t i = 0; i < count && s.ok(); i++) {
+    s = file->Append(record);
+  }
+  if (s.ok()) {
+    s = file->Close();
+  }
+  uint64_t elapsed = std::max<uint64_t>(NowMicros() - start, 1);
+  faults = PageFaults() - faults;
+  SetIOStatsLevel(kIOStatsDisable);
+  delete file;
+  DeleteFile(fname);
+  if (!s.ok()) {
+    printf("%s: write failed %s\n", name, s.ToString().c_str());
+    return;
+  }
+
+  double gb = count * record_size / (1024.0 * 1024 * 1024);
+  printf("%-16s %8.1f MB/s  faults/GB %8.0f  munmap/GB %6.0f"
+         "  mmap+munmap %6lu us\n",
+         name, (count * record_size) / (elapsed * 1.0),
+         faults / gb, ctx->munmap_count / gb, ctx->mmap_nanos / 1000);
+}
+
+int main(int argc, char* argv[]) {
+  std::string dir = argc > 1 ? argv[1] : "./mmap_bench";
+  uint64_t total = (argc > 2 ? atoll(argv[2]) : 1024) << 20;
+  size_t record_size = argc > 3 ? atoi(argv[3]) : 4096;
+  size_t max_size = (argc > 4 ? atoll(argv[4]) : 256) << 20;
+  if (record_size == 0) {
+    record_size = 1;
+  }
+
+  CreatePath(dir);
+  printf("%lu MB, record %lu bytes, max region %lu MB\n",
+         total >> 20, record_size, max_size >> 20);
+
+  EnvOptions options;
+  Run("default", dir + "/file", options, total, record_size);
+
+  options.mmap_max_size = max_size;
+  Run("grow", dir + "/file", options, total, record_size);
+
+  options.mmap_prefault = EnvOptions::kMmapPrefaultPopulate;
+  Run("grow+populate", dir + "/file", options, total, record_size);
+
+  options.mmap_prefault = EnvOptions::kMmapPrefaultBackground;
+  Run("grow+background", dir + "/file", options, total, record_size);
+
+  options.mmap_prefault = EnvOptions::kMmapPrefaultNone;
+  options.mmap_huge_pages = true;
+  Run("grow+hugepage", dir + "/file", options, total, record_size);
+
+  DeleteDir(dir);
+  return 0;
+}
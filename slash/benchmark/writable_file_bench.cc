@@ -0,0 +1,93 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+// Compare the mmap and buffered WritableFile with binlog-like appends:
+//   writable_file_bench [dir] [total MB] [record size] [sync every N records]
+// Prints the throughput and the latency distribution of Append + Flush.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "slash/include/env.h"
+
+using namespace slash;
+
+static void Run(const char* name, const std::string& fname,
+                const EnvOptions& options, uint64_t total,
+                size_t record_size, int sync_every) {
+  WritableFile* file;
+  Status s = NewWritableFile(fname, &file, options);
+  if (!s.ok()) {
+    printf("%s: open failed %s\n", name, s.ToString().c_str());
+    return;
+  }
+
+  std::string record(record_size, 'x');
+  uint64_t count = total / record_size;
+  std::vector<uint64_t> latency;
+  latency.reserve(count);
+
+  uint64_t start = NowMicros();
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t begin = NowMicros();
+    s = file->Append(record);
+    if (s.ok()) {
+      s = file->Flush();
+    }
+    if (s.ok() && sync_every > 0 && (i + 1) % sync_every == 0) {
+      s = file->Sync();
+    }
+    if (!s.ok()) {
+      printf("%s: write failed %s\n", name, s.ToString().c_str());
+      break;
+    }
+    latency.push_back(NowMicros() - begin);
+  }
+  file->Close();
+  uint64_t elapsed = std::max<uint64_t>(NowMicros() - start, 1);
+  delete file;
+  DeleteFile(fname);
+
+  if (latency.empty()) {
+    return;
+  }
+  std::sort(latency.begin(), latency.end());
+  printf("%-10s %8.1f MB/s  p50 %4lu us  p99 %4lu us  p99.9 %5lu us  max %6lu us\n",
+         name, (latency.size() * record_size) / (elapsed * 1.0),
+         latency[latency.size() / 2],
+         latency[latency.size() * 99 / 100],
+         latency[latency.size() * 999 / 1000],
+         latency.back());
+}
+
+int main(int argc, char* argv[]) {
+  std::string dir = argc > 1 ? argv[1] : "./writable_file_bench";
+  uint64_t total = (argc > 2 ? atoll(argv[2]) : 512) << 20;
+  size_t record_size = argc > 3 ? atoi(argv[3]) : 256;
+  int sync_every = argc > 4 ? atoi(argv[4]) : 0;
+  if (record_size == 0) {
+    record_size = 1;
+  }
+
+  CreatePath(dir);
+  printf("%lu MB, record %lu bytes, sync every %d records\n",
+         total >> 20, record_size, sync_every);
+
+  EnvOptions mmap_options;
+  mmap_options.use_mmap_writes = true;
+  Run("mmap", dir + "/mmap", mmap_options, total, record_size, sync_every);
+
+  EnvOptions buffered_options;
+  buffered_options.use_mmap_writes = false;
+  Run("buffered", dir + "/buffered", buffered_options, total, record_size,
+      sync_every);
+
+  DeleteDir(dir);
+  return 0;
+}
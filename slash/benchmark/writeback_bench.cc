@@ -0,0 +1,126 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+// Measure the write latency jitter of WritableFile with and without
+// EnvOptions::bytes_per_sync:
+//   writeback_bench [dir] [total MB] [record size] [sync every MB]
+//                   [bytes_per_sync KB]
+// Appends are paced at 64MB/s so the page cache holds dirty data between
+// the periodic Sync, then the latency of Append + Flush and of Sync are
+// printed separately.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "slash/include/env.h"
+
+using namespace slash;
+
+// Pace of the appends, in bytes per second
+const uint64_t kWriteRate = 64 << 20;
+
+static void Print(const char* name, const char* op,
+                  std::vector<uint64_t>* latency) {
+  if (latency->empty()) {
+    return;
+  }
+  std::sort(latency->begin(), latency->end());
+  uint64_t sum = 0;
+  for (size_t i = 0; i < latency->size(); i++) {
+    sum += (*latency)[i];
+  }
+  printf("%-16s %-6s avg %6lu us  p50 %6lu us  p99 %6lu us  p99.9 %6lu us"
+         "  max %7lu us\n",
+         name, op, sum / latency->size(),
+         (*latency)[latency->size() / 2],
+         (*latency)[latency->size() * 99 / 100],
+         (*latency)[latency->size() * 999 / 1000],
+         latency->back());
+}
+
+static void Run(const char* name, const std::string& fname,
+                const EnvOptions& options, uint64_t total,
+                size_t record_size, uint64_t sync_bytes) {
+  WritableFile* file;
+  Status s = NewWritableFile(fname, &file, options);
+  if (!s.ok()) {
+    printf("%s: open failed %s\n", name, s.ToString().c_str());
+    return;
+  }
+
+  std::string record(record_size, 'x');
+  uint64_t count = total / record_size;
+  std::vector<uint64_t> append_latency;
+  std::vector<uint64_t> sync_latency;
+  append_latency.reserve(count);
+
+  uint64_t start = NowMicros();
+  uint64_t unsynced = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t begin = NowMicros();
+    s = file->Append(record);
+    if (s.ok()) {
+      s = file->Flush();
+    }
+    uint64_t end = NowMicros();
+    append_latency.push_back(end - begin);
+    unsynced += record_size;
+    if (s.ok() && sync_bytes > 0 && unsynced >= sync_bytes) {
+      s = file->Sync();
+      sync_latency.push_back(NowMicros() - end);
+      unsynced = 0;
+    }
+    if (!s.ok()) {
+      printf("%s: write failed %s\n", name, s.ToString().c_str());
+      break;
+    }
+    uint64_t due = start + (i + 1) * record_size * 1000000 / kWriteRate;
+    uint64_t now = NowMicros();
+    if (due > now) {
+      SleepForMicroseconds(due - now);
+    }
+  }
+  file->Close();
+  delete file;
+  DeleteFile(fname);
+
+  Print(name, "append", &append_latency);
+  Print(name, "sync", &sync_latency);
+}
+
+int main(int argc, char* argv[]) {
+  std::string dir = argc > 1 ? argv[1] : "./writeback_bench";
+  uint64_t total = (argc > 2 ? atoll(argv[2]) : 512) << 20;
+  size_t record_size = argc > 3 ? atoi(argv[3]) : 4096;
+  uint64_t sync_bytes = (argc > 4 ? atoll(argv[4]) : 64) << 20;
+  uint64_t bytes_per_sync = (argc > 5 ? atoll(argv[5]) : 1024) << 10;
+  if (record_size == 0) {
+    record_size = 1;
+  }
+
+  CreatePath(dir);
+  printf("%lu MB, record %lu bytes, sync every %lu MB, bytes_per_sync %lu KB\n",
+         total >> 20, record_size, sync_bytes >> 20, bytes_per_sync >> 10);
+
+  EnvOptions options;
+  options.use_mmap_writes = true;
+  Run("mmap", dir + "/mmap", options, total, record_size, sync_bytes);
+  options.bytes_per_sync = bytes_per_sync;
+  Run("mmap+range", dir + "/mmap", options, total, record_size, sync_bytes);
+
+  options.use_mmap_writes = false;
+  options.bytes_per_sync = 0;
+  Run("buffered", dir + "/buffered", options, total, record_size, sync_bytes);
+  options.bytes_per_sync = bytes_per_sync;
+  Run("buffered+range", dir + "/buffered", options, total, record_size,
+      sync_bytes);
+
+  DeleteDir(dir);
+  return 0;
+}
@@ -0,0 +1,111 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef SLASH_ASYNC_IO_H_
+#define SLASH_ASYNC_IO_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "slash/include/env.h"
+#include "slash/include/slash_mutex.h"
+#include "slash/include/slash_slice.h"
+#include "slash/include/slash_status.h"
+
+namespace slash {
+
+/*
+ * AsyncIO runs blocking file operations on a pool of I/O threads, so the
+ * I/O parallelism of a device is bounded by one knob instead of by the
+ * number of callers. Operations are queued by IOPriority:
+ * kIOPriorityHigh for the foreground work is picked first, while
+ * kIOPriorityLow, such as purge, dump or snapshot, runs on at most
+ * max_background threads so foreground always finds a free thread.
+ *
+ * The callback of an operation runs on the I/O thread once it is done,
+ * it should not block. The writes and syncs of the same WritableFile run
+ * in submission order, other operations may run in any order.
+ * Files, buffers and data must be alive until the callback is called.
+ */
+class AsyncIO {
+ public:
+  typedef std::function<void(const Status& s)> Callback;
+  typedef std::function<void(const Status& s, const Slice& result)>
+    ReadCallback;
+
+  // env is used for DeleteAsync and RenameAsync, not owned.
+  // max_background 0 means num_threads
+  AsyncIO(int num_threads, int max_background = 0,
+          Env* env = Env::Default());
+  // Run the operations queued, then stop the threads
+  ~AsyncIO();
+
+  // Start the threads, operations could be queued before
+  Status Start();
+
+  // Read n bytes at offset of file into scratch
+  void ReadAsync(RandomAccessFile* file, uint64_t offset, size_t n,
+                 char* scratch, const ReadCallback& callback,
+                 IOPriority pri = kIOPriorityHigh);
+  // Append data to file
+  void WriteAsync(WritableFile* file, const Slice& data,
+                  const Callback& callback, IOPriority pri = kIOPriorityHigh);
+  void SyncAsync(WritableFile* file, const Callback& callback,
+                 IOPriority pri = kIOPriorityHigh);
+  void DeleteAsync(const std::string& fname, const Callback& callback,
+                   IOPriority pri = kIOPriorityLow);
+  void RenameAsync(const std::string& src, const std::string& dst,
+                   const Callback& callback, IOPriority pri = kIOPriorityLow);
+
+  // Wait until all operations queued are done
+  void WaitForIdle();
+
+  // Number of the operations queued or running
+  uint64_t Pending();
+
+ private:
+  struct Op {
+    std::function<void()> func;
+    IOPriority pri;
+    // Operations of the same key run one at a time in order, NULL for none
+    const void* key;
+  };
+
+  static void* IOThread(void* arg);
+  void Run();
+  void Schedule(const Op& op);
+  // Pick the next operation, mu_ should be held
+  bool Pick(Op* op);
+
+  int num_threads_;
+  int max_background_;
+  Env* env_;
+
+  Mutex mu_;
+  CondVar cv_;
+  std::deque<Op> queues_[kIOPriorityTotal];
+  // Operations waiting for the running one of the same key
+  std::map<const void*, std::deque<Op> > serialized_;
+  int background_running_;
+  uint64_t pending_;
+  uint64_t picks_;
+  bool stop_;
+
+  std::vector<pthread_t> threads_;
+
+  // No copying allowed
+  AsyncIO(const AsyncIO&);
+  void operator=(const AsyncIO&);
+};
+
+}  // namespace slash
+
+#endif  // SLASH_ASYNC_IO_H_
@@ -16,9 +16,13 @@
 
 namespace slash {
 
+class Env;
+
 class BaseConf {
  public:
   explicit BaseConf(const std::string &path);
+  // The conf file is accessed through env
+  BaseConf(const std::string &path, Env* env);
   virtual ~BaseConf();
 
   int LoadConf();
@@ -0,0 +1,88 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef SLASH_DELETE_SCHEDULER_H_
+#define SLASH_DELETE_SCHEDULER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <deque>
+#include <string>
+
+#include "slash/include/slash_mutex.h"
+#include "slash/include/slash_status.h"
+
+namespace slash {
+
+/*
+ * DeleteScheduler deletes files and directories without stalling the disk:
+ * the target is renamed into the trash directory at once, then a
+ * background thread reclaims the space at no more than bytes_per_second,
+ * truncating large files gradually before unlinking them.
+ * Whatever is left in the trash directory is deleted after restart.
+ */
+class DeleteScheduler {
+ public:
+  // trash_dir should be on the same file system as the paths deleted,
+  // bytes_per_second 0 means no limit
+  DeleteScheduler(const std::string& trash_dir, uint64_t bytes_per_second);
+  // Stop the background thread, the trash left is deleted by next Start
+  ~DeleteScheduler();
+
+  // Create the trash directory, queue its contents and start the thread
+  Status Start();
+
+  /*
+   * Move the file or directory into trash to be deleted in background.
+   * Delete it in place if it could not be moved, such as across file
+   * systems. If truncate is false, the files are unlinked without being
+   * truncated first, only the rate is kept, for the files which may still
+   * be open, whose data stays readable until closed
+   */
+  Status Delete(const std::string& path, bool truncate = true);
+
+  void SetRateBytesPerSecond(uint64_t bytes_per_second);
+
+  // Wait until everything queued is deleted
+  void WaitForEmptyTrash();
+
+  const std::string& trash_dir() const {
+    return trash_dir_;
+  }
+
+ private:
+  struct Trash {
+    std::string path;
+    bool truncate;
+  };
+
+  static void* BackgroundThread(void* arg);
+  void Run();
+  // Delete one trash file and wait for its share of the rate
+  void DeleteTrashFile(const std::string& fname, bool truncate);
+  void Throttle(uint64_t bytes);
+
+  std::string trash_dir_;
+
+  Mutex mu_;
+  CondVar cv_;
+  uint64_t bytes_per_second_;
+  std::deque<Trash> queue_;
+  bool deleting_;
+  bool stop_;
+  uint64_t seq_;
+
+  bool started_;
+  pthread_t thread_;
+
+  // No copying allowed
+  DeleteScheduler(const DeleteScheduler&);
+  void operator=(const DeleteScheduler&);
+};
+
+}  // namespace slash
+
+#endif  // SLASH_DELETE_SCHEDULER_H_
@@ -1,6 +1,7 @@
 #ifndef SLASH_ENV_H_
 #define SLASH_ENV_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 #include <unistd.h>
@@ -13,6 +14,19 @@ class WritableFile;
 class SequentialFile;
 class RWFile;
 class RandomRWFile;
+class RandomAccessFile;
+class Env;
+class DeleteScheduler;
+class DirSyncBatcher;
+class RateLimiter;
+struct IORequest;
+
+// Priority of the I/O passed through a RateLimiter
+enum IOPriority {
+  kIOPriorityLow = 0,
+  kIOPriorityHigh = 1,
+  kIOPriorityTotal = 2
+};
 
 /*
  *  Set the resource limits of a process
@@ -33,6 +47,8 @@ extern const size_t kPageSize;
 int IsDir(const std::string& path);
 int DeleteDir(const std::string& path);
 bool DeleteDirIfExist(const std::string& path);
+// Delete in background through scheduler if it is not NULL
+bool DeleteDirIfExist(const std::string& path, DeleteScheduler* scheduler);
 int CreateDir(const std::string& path);
 int CreatePath(const std::string& path, mode_t mode = 0755);
 uint64_t Du(const std::string& path);
@@ -47,6 +63,42 @@ Status DeleteFile(const std::string& fname);
 
 int RenameFile(const std::string& oldname, const std::string& newname);
 
+struct CopyOptions {
+  // Hard link the source instead of copying it when link_if returns true
+  // for its path, only safe for files never written again, such as the
+  // completed binlogs. Null to always copy
+  std::function<bool(const std::string& src)> link_if;
+  // fdatasync the copies before returning
+  bool sync;
+
+  CopyOptions() : sync(false) { }
+};
+
+// How CopyFile made the copy
+enum CopyMethod {
+  kCopyLink,       // Hard link
+  kCopyClone,      // Reflink sharing the extents, ioctl(FICLONE)
+  kCopyRange,      // copy_file_range in kernel
+  kCopyBuffered    // read and write through a user space buffer
+};
+
+/*
+ * Copy src to dst, replacing dst. The cheapest method supported by the
+ * file system is used, in the order of CopyMethod, and returned in
+ * method if it is not NULL.
+ */
+Status CopyFile(const std::string& src, const std::string& dst,
+                const CopyOptions& options = CopyOptions(),
+                CopyMethod* method = NULL);
+
+/*
+ * Copy the directory tree src into dst, which is created if missing.
+ * Files are copied by CopyFile in parallel, symbolic links are copied
+ * as links.
+ */
+Status CloneDir(const std::string& src, const std::string& dst,
+                const CopyOptions& options = CopyOptions());
+
 class FileLock {
   public:
     FileLock() { }
@@ -68,22 +120,358 @@ Status UnlockFile(FileLock* l);
 int GetChildren(const std::string& dir, std::vector<std::string>& result);
 bool GetDescendant(const std::string& dir, std::vector<std::string>& result);
 
+/*
+ * DuCache returns the same size as Du(root), but keeps the sizes of every
+ * directory and rescans only the directories whose mtime changed, which
+ * happens when entries are created, deleted or renamed in them.
+ * Files changed in place don't change the mtime of their directory, call
+ * Invalidate with the directory, relative to root, to rescan it.
+ */
+class DuCache {
+ public:
+  explicit DuCache(const std::string& root);
+  ~DuCache();
+
+  uint64_t Du();
+  void Invalidate(const std::string& path);
+
+ private:
+  struct Rep;
+  Rep* rep_;
+
+  // No copying allowed
+  DuCache(const DuCache&);
+  void operator=(const DuCache&);
+};
+
+
+/*
+ * DirWatcher notifies the changes of the entries in a directory, such as
+ * files created, deleted or renamed. It is backed by inotify and one
+ * watcher thread, and falls back to polling if inotify is unavailable.
+ * It is safe to be shared by many threads.
+ */
+class DirWatcher {
+ public:
+  // env is used to check file existence when polling
+  explicit DirWatcher(const std::string& dir, Env* env = NULL);
+  ~DirWatcher();
+
+  Status Start();
+
+  /*
+   * Wait until the file name under dir exists,
+   * timeout is millisecond, return false if timeout
+   */
+  bool WaitForFile(const std::string& name, uint32_t timeout);
+
+  /*
+   * Generation is increased by every change in dir,
+   * WaitForChange returns false if still no change since generation
+   * after timeout millisecond
+   */
+  uint64_t generation();
+  bool WaitForChange(uint64_t generation, uint32_t timeout);
+
+ private:
+  struct Rep;
+  Rep* rep_;
+
+  static void* WatchThread(void* arg);
+
+  // No copying allowed
+  DirWatcher(const DirWatcher&);
+  void operator=(const DirWatcher&);
+};
+
+/*
+ * DirSyncBatcher makes the entries created or renamed in a directory
+ * durable with fsync of the directory, shared by the concurrent callers:
+ * while one fsync is running, the callers arriving wait and are covered
+ * together by the next one. window_us delays every fsync to gather more
+ * callers. It is safe to be shared by many threads.
+ */
+class DirSyncBatcher {
+ public:
+  explicit DirSyncBatcher(uint64_t window_us = 0);
+  ~DirSyncBatcher();
+
+  // Return once the changes made in dir before the call are durable
+  Status Sync(const std::string& dir);
+
+  // Number of fsync issued
+  uint64_t syncs();
+
+ private:
+  struct Rep;
+  Rep* rep_;
+
+  // No copying allowed
+  DirSyncBatcher(const DirSyncBatcher&);
+  void operator=(const DirSyncBatcher&);
+};
 
+/*
+ * Replace fname with data atomically: data is written to fname.tmp,
+ * fdatasync, renamed to fname, then the directory is synced, through
+ * batcher if it is not NULL. A crash leaves either the old or the new
+ * content. Concurrent writers of the same fname are not supported.
+ */
+Status WriteFileAtomic(const std::string& fname, const Slice& data,
+                       DirSyncBatcher* batcher = NULL);
+
+// Wall clock, it jumps with settimeofday and NTP, use it for timestamps
 uint64_t NowMicros();
 void SleepForMicroseconds(int micros);
 
-Status NewSequentialFile(const std::string& fname, SequentialFile** result);
+/*
+ * Monotonic clock, from CLOCK_MONOTONIC, which never goes back and is
+ * not adjusted by settimeofday, use it for durations and deadlines.
+ * Built with -DSLASH_TSC_CLOCK on x86_64 with an invariant TSC, it is
+ * read from rdtsc at a rate calibrated against CLOCK_MONOTONIC at the
+ * first call, which takes 10ms. Both come from the same clock, its
+ * origin is unspecified so only differences are meaningful
+ */
+uint64_t NowNanos();
+uint64_t MonotonicMicros();
+
+/*
+ * StopWatch measures the time elapsed since its construction or last
+ * Reset on the monotonic clock
+ */
+class StopWatch {
+ public:
+  StopWatch() : start_(NowNanos()) { }
+
+  void Reset() {
+    start_ = NowNanos();
+  }
+
+  uint64_t ElapsedNanos() const {
+    return NowNanos() - start_;
+  }
 
-Status NewWritableFile(const std::string& fname, WritableFile** result);
+  uint64_t ElapsedMicros() const {
+    return ElapsedNanos() / 1000;
+  }
 
-Status NewRWFile(const std::string& fname, RWFile** result);
+  // Elapsed time, then Reset, to measure consecutive laps
+  uint64_t LapNanos() {
+    uint64_t now = NowNanos();
+    uint64_t elapsed = now - start_;
+    start_ = now;
+    return elapsed;
+  }
+
+ private:
+  uint64_t start_;
+};
+
+/*
+ * Coarse wall clock, read from CLOCK_REALTIME_COARSE through vDSO.
+ * Its resolution is the kernel tick (1~4ms), but it is much cheaper than
+ * NowMicros, use it for timestamps on hot paths.
+ */
+uint64_t NowCoarseMicros();
+uint64_t NowCoarseSeconds();
+
+/*
+ * Options of the files created by the factories below
+ */
+struct EnvOptions {
+  // WritableFile writes through mmap if true, otherwise it buffers the
+  // data in user space and writes it out with pwrite
+  bool use_mmap_writes;
+
+  // Size of the user space buffer of non-mmap WritableFile
+  size_t writable_file_buffer_size;
+
+  // Bypass the page cache with O_DIRECT, take precedence over
+  // use_mmap_writes. Fall back to buffered I/O if the file system
+  // rejects O_DIRECT
+  bool use_direct_writes;
+  bool use_direct_reads;
+
+  // Size of the aligned buffer of O_DIRECT files, rounded up to
+  // kDirectIOAlignment
+  size_t direct_io_buffer_size;
+
+  // Size of the read buffer of SequentialFile through the page cache,
+  // rounded up to kDirectIOAlignment. Larger reads bypass the buffer
+  size_t sequential_read_buffer_size;
+
+  // SequentialFile keeps the next readahead_size bytes after its buffer
+  // requested with posix_fadvise(WILLNEED), 0 leaves it to the kernel.
+  // With background_readahead they are read into the page cache by a
+  // helper thread instead, which suits large sequential scans
+  size_t readahead_size;
+  bool background_readahead;
+
+  // WritableFile submits full buffers through an IOEngine and keeps
+  // filling the next one, take precedence over use_mmap_writes.
+  // async_write_depth buffers of writable_file_buffer_size are used
+  bool use_async_writes;
+  uint32_t async_write_depth;
+
+  // RandomAccessFile maps the whole file and returns the data without
+  // copy, otherwise it reads with pread
+  bool use_mmap_reads;
+
+  // Prefault the mapping of RandomAccessFile with MAP_POPULATE
+  bool populate_mmap_reads;
+
+  // Hint of RandomAccessFile, passed to madvise or posix_fadvise
+  enum AccessPattern {
+    kNormal,
+    kRandom,
+    kSequential,
+    kWillNeed
+  };
+  AccessPattern access_pattern;
+
+  // Size of the first region mapped by the mmap WritableFile, 0 for the
+  // size set by SetMmapBoundSize. Each next region doubles the previous
+  // one up to mmap_max_size, fewer regions mean fewer munmap and TLB
+  // shootdowns, while the space preallocated past the data is larger
+  size_t mmap_initial_size;
+  size_t mmap_max_size;
+
+  // How the pages of a new region are faulted in before being written:
+  // kMmapPrefaultPopulate maps it with MAP_POPULATE, kMmapPrefaultBackground
+  // lets a helper thread fault it in ahead of the writer
+  enum MmapPrefault {
+    kMmapPrefaultNone,
+    kMmapPrefaultPopulate,
+    kMmapPrefaultBackground
+  };
+  MmapPrefault mmap_prefault;
+
+  // madvise(MADV_HUGEPAGE) on the regions, which are then 2MB aligned.
+  // Only effective on the file systems supporting huge pages in page cache
+  // such as tmpfs mounted with huge=advise
+  bool mmap_huge_pages;
+
+  // The page cache WritableFile, mmap or buffered, starts asynchronous
+  // writeback with sync_file_range every bytes_per_sync bytes behind the
+  // write position, so that Sync finds little dirty data. 0 disables it
+  uint64_t bytes_per_sync;
+
+  // Address space reserved for RWFile to grow in place, it costs no
+  // memory until mapped
+  uint64_t rw_file_reserved_size;
+
+  // WritableFile and SequentialFile request the bytes they write or read
+  // from rate_limiter at rate_limiter_priority if it is not NULL. Not owned
+  RateLimiter* rate_limiter;
+  IOPriority rate_limiter_priority;
+
+  EnvOptions()
+    : use_mmap_writes(true),
+      writable_file_buffer_size(64 * 1024),
+      use_direct_writes(false),
+      use_direct_reads(false),
+      direct_io_buffer_size(1024 * 1024),
+      sequential_read_buffer_size(64 * 1024),
+      readahead_size(1024 * 1024),
+      background_readahead(false),
+      use_async_writes(false),
+      async_write_depth(4),
+      use_mmap_reads(false),
+      populate_mmap_reads(false),
+      access_pattern(kNormal),
+      mmap_initial_size(0),
+      mmap_max_size(1024 * 1024),
+      mmap_prefault(kMmapPrefaultNone),
+      mmap_huge_pages(false),
+      bytes_per_sync(0),
+      rw_file_reserved_size(64 * 1024 * 1024),
+      rate_limiter(NULL),
+      rate_limiter_priority(kIOPriorityLow) {
+  }
+};
+
+// Alignment of the offset, length and buffer address of O_DIRECT I/O
+extern const size_t kDirectIOAlignment;
+
+Status NewSequentialFile(const std::string& fname, SequentialFile** result,
+                         const EnvOptions& options = EnvOptions());
+
+Status NewWritableFile(const std::string& fname, WritableFile** result,
+                       const EnvOptions& options = EnvOptions());
+
+Status NewRWFile(const std::string& fname, RWFile** result,
+                 const EnvOptions& options = EnvOptions());
 
 Status AppendSequentialFile(const std::string& fname, SequentialFile** result);
 
-Status AppendWritableFile(const std::string& fname, WritableFile** result, uint64_t write_len = 0);
+Status AppendWritableFile(const std::string& fname, WritableFile** result,
+                          uint64_t write_len = 0,
+                          const EnvOptions& options = EnvOptions());
 
 Status NewRandomRWFile(const std::string& fname, RandomRWFile** result);
 
+Status NewRandomAccessFile(const std::string& fname, RandomAccessFile** result,
+                           const EnvOptions& options = EnvOptions());
+
+/*
+ * Env owns the file factories and the file system operations, so that
+ * users such as Binlog and BaseConf could run on another implementation.
+ * The free functions above are the POSIX implementation.
+ */
+class Env {
+ public:
+  Env() { }
+  virtual ~Env();
+
+  // Return the default POSIX environment, which should not be deleted
+  static Env* Default();
+
+  virtual Status NewSequentialFile(const std::string& fname,
+                                   SequentialFile** result,
+                                   const EnvOptions& options = EnvOptions()) = 0;
+  virtual Status NewWritableFile(const std::string& fname,
+                                 WritableFile** result,
+                                 const EnvOptions& options = EnvOptions()) = 0;
+  virtual Status NewRWFile(const std::string& fname, RWFile** result,
+                           const EnvOptions& options = EnvOptions()) = 0;
+  virtual Status AppendWritableFile(const std::string& fname,
+                                    WritableFile** result,
+                                    uint64_t write_len = 0,
+                                    const EnvOptions& options = EnvOptions()) = 0;
+  virtual Status NewRandomRWFile(const std::string& fname,
+                                 RandomRWFile** result) = 0;
+  virtual Status NewRandomAccessFile(
+      const std::string& fname, RandomAccessFile** result,
+      const EnvOptions& options = EnvOptions()) = 0;
+
+  virtual bool FileExists(const std::string& path) = 0;
+  virtual int GetChildren(const std::string& dir,
+                          std::vector<std::string>& result) = 0;
+  virtual Status DeleteFile(const std::string& fname) = 0;
+  virtual int RenameFile(const std::string& oldname,
+                         const std::string& newname) = 0;
+  virtual int CreateDir(const std::string& path) = 0;
+
+  // Replace fname with data atomically, see the free function. The
+  // default is built on the methods above and ignores batcher
+  virtual Status WriteFileAtomic(const std::string& fname, const Slice& data,
+                                 DirSyncBatcher* batcher = NULL);
+
+  virtual uint64_t NowMicros() = 0;
+
+ private:
+  // No copying allowed
+  Env(const Env&);
+  void operator=(const Env&);
+};
+
+/*
+ * Return a new Env which keeps all files in memory, the directories are
+ * only names. Useful to run benchmarks and tests without disk I/O.
+ * Caller should delete it after all files are deleted.
+ */
+Env* NewMemEnv();
+
 // A file abstraction for sequential writing.  The implementation
 // must provide buffering since callers may append small fragments
 // at a time to the file.
@@ -115,20 +503,81 @@ class SequentialFile {
   virtual Status Skip(uint64_t n) = 0;
   //virtual Status Close() = 0;
   virtual char *ReadLine(char *buf, int n) = 0;
+
+  // Forget the data buffered ahead of the read position, so the next read
+  // gets what was written to the file since, e.g. when tailing a file
+  virtual void DropBuffer() {
+  }
 };
 
+/*
+ * A file mapped into memory at GetData, to keep small structures such as
+ * cursors and counters persistent by writing them in place.
+ * The address of the data never changes, so pointers into it stay valid
+ * across Resize
+ */
 class RWFile {
 public:
   RWFile() { }
   virtual ~RWFile();
   virtual char* GetData() = 0;
 
+  // Size of the file, which is all mapped at GetData
+  virtual uint64_t Size() = 0;
+
+  // Grow or shrink the file, up to EnvOptions::rw_file_reserved_size.
+  // The data beyond size must not be accessed after shrinking
+  virtual Status Resize(uint64_t size) = 0;
+
+  // Write [offset, offset + len) of the data back to disk
+  virtual Status Sync(uint64_t offset, uint64_t len) = 0;
+
 private:
   // No copying allowed
   RWFile(const RWFile&);
   void operator=(const RWFile&);
 };
 
+/*
+ * One range of RandomAccessFile::MultiRead,
+ * result and status are set by MultiRead
+ */
+struct ReadRequest {
+  uint64_t offset;
+  size_t len;
+  char* scratch;
+
+  Slice result;
+  Status status;
+
+  ReadRequest() : offset(0), len(0), scratch(NULL) { }
+};
+
+// A file abstraction for reading at random offsets, the file size is
+// fixed when opened for the mmap implementation.
+class RandomAccessFile {
+ public:
+  RandomAccessFile() { }
+  virtual ~RandomAccessFile();
+
+  // Read up to "n" bytes from the file starting at "offset", fewer bytes
+  // are returned at the end of the file. "*result" may point into
+  // "scratch[0..n-1]", or into the file mapping without copying.
+  //
+  // Safe for concurrent use by multiple threads.
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const = 0;
+
+  // Read a batch of ranges, the implementation may sort and coalesce
+  // them into fewer I/Os. Return the first error if any.
+  virtual Status MultiRead(ReadRequest* reqs, size_t num) const;
+
+ private:
+  // No copying allowed
+  RandomAccessFile(const RandomAccessFile&);
+  void operator=(const RandomAccessFile&);
+};
+
 // A file abstraction for random reading and writing.
 class RandomRWFile {
  public:
@@ -166,7 +615,9 @@ class RandomRWFile {
   }
 
   /*
-   * Pre-allocate space for a file.
+   * Pre-allocate space for [offset, offset + len) without changing the
+   * file size, so later writes in the range neither allocate blocks nor
+   * update the metadata.
    */
   virtual Status Allocate(off_t offset, off_t len) {
     (void)offset;
@@ -174,6 +625,41 @@ class RandomRWFile {
     return Status::OK();
   }
 
+  // Hint that [offset, offset + len) will be read soon, it is read into
+  // the page cache in background
+  virtual Status Prefetch(uint64_t offset, uint64_t len) {
+    return Status::OK();
+  }
+
+  // Free the blocks of [offset, offset + len), which then reads as zeros.
+  // The file size is unchanged
+  virtual Status PunchHole(uint64_t offset, uint64_t len) {
+    return Status::NotSupported("PunchHole");
+  }
+
+  // Write back the data of [offset, offset + len) and wait for it, the
+  // metadata such as the file size is not synced
+  virtual Status RangeSync(uint64_t offset, uint64_t len) {
+    return Sync();
+  }
+
+  /*
+   * Fill req to run the I/O through an IOEngine (see io_engine.h), the
+   * buffer is not copied and should be alive until the completion.
+   * Return NotSupported if the file could not.
+   */
+  virtual Status PrepareRead(uint64_t offset, size_t n, char* scratch,
+                             IORequest* req) const {
+    return Status::NotSupported("PrepareRead");
+  }
+  virtual Status PrepareWrite(uint64_t offset, const Slice& data,
+                              IORequest* req) {
+    return Status::NotSupported("PrepareWrite");
+  }
+  virtual Status PrepareSync(IORequest* req) {
+    return Status::NotSupported("PrepareSync");
+  }
+
  private:
   // No copying allowed
   RandomRWFile(const RandomRWFile&);
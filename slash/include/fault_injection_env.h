@@ -0,0 +1,130 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef SLASH_FAULT_INJECTION_ENV_H_
+#define SLASH_FAULT_INJECTION_ENV_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "slash/include/env.h"
+#include "slash/include/slash_mutex.h"
+#include "slash/include/slash_status.h"
+
+namespace slash {
+
+/*
+ * FaultInjectionEnv wraps the files of base to test and measure the
+ * behavior under failures:
+ *   - the reads, writes and syncs fail with IOError at a probability,
+ *     and are delayed by a latency, set per kind of operation
+ *   - the data not synced is tracked, so DropUnsyncedData rolls the files
+ *     back to what would be left on disk after a power loss
+ *
+ * To simulate a crash, delete every user of the env, such as the Binlog,
+ * then call DropUnsyncedData and reopen them.
+ * WritableFile is durable up to its last Sync, RWFile keeps its content
+ * when first opened updated by the ranges of Sync(offset, len). Directory
+ * entries are assumed durable at once, RandomRWFile is not tracked.
+ * The rollback works on the local file system, base should be POSIX.
+ */
+class FaultInjectionEnv : public Env {
+ public:
+  enum FaultOp {
+    kFaultRead = 0,
+    kFaultWrite = 1,
+    kFaultSync = 2,
+    kFaultOpTotal = 3
+  };
+
+  // base is not owned
+  explicit FaultInjectionEnv(Env* base = Env::Default());
+  virtual ~FaultInjectionEnv();
+
+  // Fail op with IOError at probability, in [0, 1]
+  void SetFailureProbability(FaultOp op, double probability);
+  // Sleep before every op
+  void SetLatency(FaultOp op, uint64_t micros);
+
+  // Sync all the files open, the WritableFiles before the RWFiles, as a
+  // writer syncing its data before the metadata pointing to it
+  Status SyncAll();
+
+  // Roll back every file to its synced content, only after all files
+  // are closed. bytes_dropped is the bytes of data lost if not NULL
+  Status DropUnsyncedData(uint64_t* bytes_dropped = NULL);
+
+  virtual Status NewSequentialFile(const std::string& fname,
+                                   SequentialFile** result,
+                                   const EnvOptions& options) override;
+  virtual Status NewWritableFile(const std::string& fname,
+                                 WritableFile** result,
+                                 const EnvOptions& options) override;
+  virtual Status NewRWFile(const std::string& fname, RWFile** result,
+                           const EnvOptions& options) override;
+  virtual Status AppendWritableFile(const std::string& fname,
+                                    WritableFile** result,
+                                    uint64_t write_len,
+                                    const EnvOptions& options) override;
+  virtual Status NewRandomRWFile(const std::string& fname,
+                                 RandomRWFile** result) override;
+  virtual Status NewRandomAccessFile(const std::string& fname,
+                                     RandomAccessFile** result,
+                                     const EnvOptions& options) override;
+
+  virtual bool FileExists(const std::string& path) override;
+  virtual int GetChildren(const std::string& dir,
+                          std::vector<std::string>& result) override;
+  virtual Status DeleteFile(const std::string& fname) override;
+  virtual int RenameFile(const std::string& oldname,
+                         const std::string& newname) override;
+  virtual int CreateDir(const std::string& path) override;
+
+  virtual uint64_t NowMicros() override;
+
+ private:
+  friend class FaultWritableFile;
+  friend class FaultRWFile;
+  friend class FaultSequentialFile;
+  friend class FaultRandomAccessFile;
+
+  // Durable state of a file
+  struct FileState {
+    bool rw;
+    uint64_t synced_size;  // Of WritableFile
+    std::string synced;    // Content of RWFile
+
+    FileState() : rw(false), synced_size(0) { }
+  };
+
+  // Sleep and fail as set for op
+  Status Inject(FaultOp op, const std::string& fname);
+  void Synced(const std::string& fname, uint64_t size);
+  void Synced(const std::string& fname, uint64_t size, uint64_t offset,
+              const Slice& data);
+  void Closed(WritableFile* file);
+  void Closed(RWFile* file);
+
+  Env* base_;
+
+  Mutex mu_;
+  double probability_[kFaultOpTotal];
+  uint64_t latency_[kFaultOpTotal];
+  unsigned int seed_;
+  std::map<std::string, FileState> files_;
+  std::set<WritableFile*> writable_files_;
+  std::set<RWFile*> rw_files_;
+
+  // No copying allowed
+  FaultInjectionEnv(const FaultInjectionEnv&);
+  void operator=(const FaultInjectionEnv&);
+};
+
+}  // namespace slash
+
+#endif  // SLASH_FAULT_INJECTION_ENV_H_
@@ -0,0 +1,82 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef SLASH_FILE_CACHE_H_
+#define SLASH_FILE_CACHE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "slash/include/env.h"
+#include "slash/include/slash_status.h"
+
+namespace slash {
+
+/*
+ * FileCache keeps the files opened for read, so the readers of the same
+ * path share one RandomAccessFile instead of opening it every time.
+ * At most capacity files are open, the idle ones are closed in LRU order
+ * to make room, and Lookup fails with Incomplete if all of them are in
+ * use. The cache is split into shards by path to reduce lock contention.
+ *
+ *   FileCache::Handle* handle;
+ *   Status s = cache->Lookup(fname, &handle);
+ *   if (s.ok()) {
+ *     s = cache->Value(handle)->Read(offset, n, &result, scratch);
+ *     cache->Release(handle);
+ *   }
+ */
+class FileCache {
+ public:
+  struct Handle;
+
+  // env and options are used to open the files, env is not owned
+  FileCache(size_t capacity, int num_shard_bits = 4,
+            Env* env = Env::Default(),
+            const EnvOptions& options = EnvOptions());
+  // All handles must be released before
+  ~FileCache();
+
+  // Return the file of fname, opened if it is not cached.
+  // The handle must be released by Release
+  Status Lookup(const std::string& fname, Handle** handle);
+
+  // Shared by the threads, only const methods could be called
+  RandomAccessFile* Value(Handle* handle);
+
+  void Release(Handle* handle);
+
+  // Drop fname from the cache, such as after it is deleted or rewritten.
+  // It is closed once the handles in use are released
+  void Evict(const std::string& fname);
+
+  // Number of open files, in use or idle
+  size_t TotalOpen() const;
+
+ private:
+  struct Shard;
+
+  Shard* GetShard(const std::string& fname);
+  // Close one idle file of the shards, starting from shard
+  bool EvictOne(Shard* shard);
+  void Unref(Shard* shard, Handle* handle);
+
+  const size_t capacity_;
+  const int num_shard_bits_;
+  Env* env_;
+  const EnvOptions options_;
+  Shard* shards_;
+  std::atomic<size_t> open_;
+
+  // No copying allowed
+  FileCache(const FileCache&);
+  void operator=(const FileCache&);
+};
+
+}  // namespace slash
+
+#endif  // SLASH_FILE_CACHE_H_
@@ -0,0 +1,119 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef SLASH_IO_ENGINE_H_
+#define SLASH_IO_ENGINE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+#include "slash/include/slash_status.h"
+
+namespace slash {
+
+/*
+ * One asynchronous I/O, filled by the caller or RandomRWFile::PrepareXXX,
+ * and returned by IOEngine::Reap once completed.
+ * The request and its buffer must be alive until then.
+ */
+struct IORequest {
+  enum Op {
+    kRead,
+    kWrite,
+    kFsync,
+    kFdatasync,
+    kFallocate
+  };
+
+  Op op;
+  int fd;
+  uint64_t offset;
+  char* buf;
+  size_t len;           // Length of buf, or of the range to fallocate
+  int mode;             // Mode of fallocate
+  int buf_index;        // Index of the registered buffer buf lies in, or -1
+  void* user_data;
+
+  // Bytes transferred, or -errno on failure
+  ssize_t result;
+
+  IORequest()
+    : op(kRead), fd(-1), offset(0), buf(NULL), len(0), mode(0),
+      buf_index(-1), user_data(NULL), result(0) {
+  }
+};
+
+/*
+ * IOEngine keeps many I/Os in flight from one thread:
+ *   Prepare the requests, Submit them in one batch, then Reap the
+ * completions, which may come in any order.
+ * It runs on io_uring through raw syscalls if the kernel supports it,
+ * otherwise on a fallback which executes the requests synchronously on
+ * Submit. Both signal eventfd() on completions, so the engine could be
+ * driven by epoll.
+ * An engine is not thread safe, it should be owned by one thread.
+ */
+class IOEngine {
+ public:
+  /*
+   * Create an engine which holds at most queue_depth requests in flight.
+   * force_fallback skips io_uring, mainly for testing
+   */
+  static Status Open(uint32_t queue_depth, IOEngine** engine,
+                     bool force_fallback = false);
+
+  IOEngine() { }
+  virtual ~IOEngine();
+
+  // Whether the engine runs on io_uring
+  virtual bool IsUring() const = 0;
+
+  // Readable if there are completions to reap
+  virtual int eventfd() const = 0;
+
+  /*
+   * Register the buffers so that requests within them skip mapping the
+   * pages on every I/O, set IORequest::buf_index to use them.
+   * Replace the previously registered buffers.
+   */
+  virtual Status RegisterBuffers(const std::vector<struct iovec>& buffers) = 0;
+
+  /*
+   * Queue req to be submitted by the next Submit,
+   * return Incomplete if the queue is full
+   */
+  virtual Status Prepare(IORequest* req) = 0;
+
+  // Submit the prepared requests, return the number submitted
+  virtual Status Submit(int* submitted) = 0;
+
+  /*
+   * Wait until at least min_complete requests complete, then return up to
+   * max of them in done. count is set to the number returned
+   */
+  virtual Status Reap(IORequest** done, int max, int min_complete,
+                      int* count) = 0;
+
+  // Number of the requests prepared or submitted but not reaped
+  virtual uint32_t inflight() const = 0;
+
+  /*
+   * Run req and wait for it, only on an idle engine,
+   * return InvalidArgument if there are requests in flight
+   */
+  Status Execute(IORequest* req);
+
+ private:
+  // No copying allowed
+  IOEngine(const IOEngine&);
+  void operator=(const IOEngine&);
+};
+
+}  // namespace slash
+
+#endif  // SLASH_IO_ENGINE_H_
@@ -0,0 +1,188 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef SLASH_IO_STATS_H_
+#define SLASH_IO_STATS_H_
+
+#include <stdint.h>
+
+#include <string>
+
+namespace slash {
+
+/*
+ * Statistics of the I/O issued by the files of env.cc, kept per thread in
+ * IOStatsContext and aggregated per file type over all threads.
+ * Nothing is recorded unless the level of the thread is raised, and
+ * building with -DSLASH_NIOSTATS removes the recording altogether.
+ */
+enum IOStatsLevel {
+  kIOStatsDisable = 0,
+  // Bytes, syscalls and the counters of file types
+  kIOStatsEnableCount = 1,
+  // Also the time spent in syscalls
+  kIOStatsEnableTime = 2,
+  // Also the page faults of mmap regions, which costs two getrusage calls
+  kIOStatsEnableAll = 3
+};
+
+enum IOFileType {
+  kIOFileBinlog = 0,
+  kIOFileManifest,
+  kIOFileConf,
+  kIOFileOther,
+  kIOFileTypeCount
+};
+
+// Type of the file by its name: binlogN, manifest or *.conf
+IOFileType GetIOFileType(const std::string& fname);
+const char* IOFileTypeName(IOFileType type);
+
+struct IOStatsContext {
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t syscalls;
+
+  uint64_t pread_nanos;
+  uint64_t pwrite_nanos;
+  // posix_fadvise of the SequentialFile readahead and Prefetch
+  uint64_t readahead_nanos;
+  uint64_t msync_nanos;
+  // fdatasync and fsync
+  uint64_t fdatasync_nanos;
+  uint64_t range_sync_nanos;
+  uint64_t fallocate_nanos;
+  // mmap and munmap
+  uint64_t mmap_nanos;
+  uint64_t mmap_count;
+  uint64_t munmap_count;
+
+  // Minor and major faults taken while accessing mmap regions
+  uint64_t page_faults;
+
+  void Reset();
+  std::string ToString() const;
+};
+
+struct FileTypeIOStats {
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t syscalls;
+  uint64_t nanos;
+};
+
+// Level of the calling thread, kIOStatsDisable by default
+void SetIOStatsLevel(IOStatsLevel level);
+
+// Context of the calling thread
+IOStatsContext* GetIOStatsContext();
+
+// Counters of type over all threads
+void GetFileTypeIOStats(IOFileType type, FileTypeIOStats* stats);
+void ResetFileTypeIOStats();
+
+#ifdef SLASH_NIOSTATS
+inline IOStatsLevel GetIOStatsLevel() {
+  return kIOStatsDisable;
+}
+#else
+extern __thread IOStatsLevel iostats_level;
+inline IOStatsLevel GetIOStatsLevel() {
+  return iostats_level;
+}
+#endif
+
+void RecordIOStatsBytes(IOFileType type, uint64_t read, uint64_t written);
+
+// Add the bytes moved through mmap regions, which take no syscall
+inline void IOStatsAddBytes(IOFileType type, uint64_t read, uint64_t written) {
+  if (GetIOStatsLevel() != kIOStatsDisable) {
+    RecordIOStatsBytes(type, read, written);
+  }
+}
+
+// Add n to a counter of the context
+inline void IOStatsAdd(uint64_t IOStatsContext::* counter, uint64_t n) {
+  if (GetIOStatsLevel() != kIOStatsDisable) {
+    GetIOStatsContext()->*counter += n;
+  }
+}
+
+/*
+ * Record one syscall on a file of type into the context of the thread,
+ * with its time added to the timer of the context if nanos is not NULL.
+ * Only a load of the thread level is paid when disabled
+ */
+class IOStatsRecorder {
+ public:
+  IOStatsRecorder(IOFileType type, uint64_t IOStatsContext::* nanos)
+    : level_(GetIOStatsLevel()), type_(type), nanos_(nanos),
+      start_(0), read_(0), written_(0) {
+    if (level_ >= kIOStatsEnableTime && nanos_ != NULL) {
+      start_ = Now();
+    }
+  }
+
+  ~IOStatsRecorder() {
+    if (level_ != kIOStatsDisable) {
+      Record();
+    }
+  }
+
+  void AddRead(uint64_t n) {
+    read_ += n;
+  }
+
+  void AddWritten(uint64_t n) {
+    written_ += n;
+  }
+
+ private:
+  static uint64_t Now();
+  void Record();
+
+  const IOStatsLevel level_;
+  const IOFileType type_;
+  uint64_t IOStatsContext::* const nanos_;
+  uint64_t start_;
+  uint64_t read_;
+  uint64_t written_;
+
+  // No copying allowed
+  IOStatsRecorder(const IOStatsRecorder&);
+  void operator=(const IOStatsRecorder&);
+};
+
+// Add the page faults taken by the thread during its lifetime to the
+// context, only at kIOStatsEnableAll
+class IOStatsFaultCounter {
+ public:
+  IOStatsFaultCounter()
+    : enabled_(GetIOStatsLevel() >= kIOStatsEnableAll), start_(0) {
+    if (enabled_) {
+      start_ = Faults();
+    }
+  }
+
+  ~IOStatsFaultCounter() {
+    if (enabled_) {
+      GetIOStatsContext()->page_faults += Faults() - start_;
+    }
+  }
+
+ private:
+  static uint64_t Faults();
+
+  const bool enabled_;
+  uint64_t start_;
+
+  // No copying allowed
+  IOStatsFaultCounter(const IOStatsFaultCounter&);
+  void operator=(const IOStatsFaultCounter&);
+};
+
+}  // namespace slash
+
+#endif  // SLASH_IO_STATS_H_
@@ -0,0 +1,89 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef SLASH_RATE_LIMITER_H_
+#define SLASH_RATE_LIMITER_H_
+
+#include <stdint.h>
+
+#include <deque>
+
+#include "slash/include/env.h"
+#include "slash/include/slash_mutex.h"
+
+namespace slash {
+
+/*
+ * Token bucket shared by the I/O of background and foreground work.
+ * Tokens are refilled every refill period, the waiting requests of high
+ * priority are granted first, while the low priority ones go first once
+ * every fairness refills so they never starve.
+ * With auto_tuned, the rate moves between 1/20 of bytes_per_second and
+ * bytes_per_second following the demand.
+ */
+class RateLimiter {
+ public:
+  RateLimiter(int64_t bytes_per_second,
+              int64_t refill_period_us = 100 * 1000,
+              int32_t fairness = 10,
+              bool auto_tuned = false);
+  // Grant the waiting requests and wait for them to return, no request
+  // should be made after it is called
+  ~RateLimiter();
+
+  // Change the rate, which is the upper bound if auto tuned
+  void SetBytesPerSecond(int64_t bytes_per_second);
+  int64_t GetBytesPerSecond();
+
+  // Block until bytes are granted, requests larger than one refill are
+  // granted over several refills
+  void Request(int64_t bytes, IOPriority priority);
+
+  // Max bytes granted in one refill period
+  int64_t GetSingleBurstBytes();
+
+  // Bytes and requests through the limiter of priority
+  int64_t GetTotalBytesThrough(IOPriority priority);
+  int64_t GetTotalRequests(IOPriority priority);
+
+ private:
+  struct Req;
+
+  void Refill(uint64_t now);
+  void Tune();
+  int64_t RefillBytes() const;
+
+  Mutex mu_;
+  CondVar cv_;
+
+  const int64_t refill_period_us_;
+  const int32_t fairness_;
+  const bool auto_tuned_;
+  int64_t max_bytes_per_second_;
+  int64_t bytes_per_second_;
+
+  int64_t available_bytes_;
+  uint64_t next_refill_us_;
+  uint64_t refills_;
+  std::deque<Req*> queues_[kIOPriorityTotal];
+  // Requests blocked in Request
+  int64_t waiters_;
+  bool stop_;
+
+  int64_t total_bytes_[kIOPriorityTotal];
+  int64_t total_requests_[kIOPriorityTotal];
+
+  // Refills with requests left waiting since last tuning
+  int64_t drained_refills_;
+  int64_t tune_refills_;
+
+  // No copying allowed
+  RateLimiter(const RateLimiter&);
+  void operator=(const RateLimiter&);
+};
+
+}  // namespace slash
+
+#endif  // SLASH_RATE_LIMITER_H_
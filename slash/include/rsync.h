@@ -4,6 +4,8 @@
 #include <string>
 
 namespace slash {
+class RateLimiter;
+
 const std::string kRsyncConfFile = "slash_rsync.conf";
 const std::string kRsyncLogFile = "slash_rsync.log";
 const std::string kRsyncPidFile = "slash_rsync.pid";
@@ -21,10 +23,12 @@ struct RsyncRemote {
 
 int StartRsync(const std::string& rsync_path, const std::string& module, const std::string& ip, const int port);
 int StopRsync(const std::string& path);
+// If rate_limiter is not NULL, rsync is started with the current rate of
+// it as --bwlimit, bounded by remote.kbps if that is positive
 int RsyncSendFile(const std::string& local_file_path, const std::string& remote_file_path,
-    const RsyncRemote& remote);
+    const RsyncRemote& remote, RateLimiter* rate_limiter = NULL);
 int RsyncSendClearTarget(const std::string& local_dir_path, const std::string& remote_dir_path,
-    const RsyncRemote& remote);
+    const RsyncRemote& remote, RateLimiter* rate_limiter = NULL);
 
 }
 #endif
@@ -8,7 +8,10 @@
 
 #include <assert.h>
 #include <string>
+#include <vector>
+#include <functional>
 
+#include "slash/include/env.h"
 #include "slash/include/slash_status.h"
 #include "slash/include/xdebug.h"
 //#include "slash_mutex.h"
@@ -19,9 +22,27 @@ namespace slash {
 
 class BinlogReader;
 
+// KeyOf extracts the key of a binlog record for compaction, records sharing
+// the same key overwrite each other.
+// Return false if the record has no key, such records are always kept.
+typedef std::function<bool(const Slice& record, std::string* key)> KeyOf;
+
+// Compact the closed binlog files [begin, end] under path into a single
+// segment which keeps only the last record of every key, in binlog order.
+// It only reads closed files, so it can run offline or on a background thread.
+Status CompactBinlog(const std::string& path, uint32_t begin, uint32_t end,
+                     const KeyOf& key_of, Env* env = Env::Default());
+
 class Binlog {
  public:
-  static Status Open(const std::string& path, Binlog** logptr);
+  // All files are accessed through env.
+  // If rate_limiter is not NULL, the reads of the readers and the blank
+  // filler written by SetProducerStatus request their bytes from it at
+  // kIOPriorityLow, Append is never throttled. rate_limiter is not owned,
+  // and should outlive the binlog and its readers
+  static Status Open(const std::string& path, Binlog** logptr,
+                     Env* env = Env::Default(),
+                     RateLimiter* rate_limiter = NULL);
 
   Binlog() { }
   virtual ~Binlog() { }
@@ -39,6 +60,39 @@ class Binlog {
   virtual Status GetProducerStatus(uint32_t* filenum, uint64_t* pro_offset) = 0;
   virtual Status SetProducerStatus(uint32_t filenum, uint64_t pro_offset) = 0;
 
+  //
+  // Compaction API
+  //
+  // Compact the binlog files [begin, end], end should be less than the
+  // producer filenum.
+  virtual Status Compact(uint32_t begin, uint32_t end, const KeyOf& key_of) = 0;
+  // Return a reader which replays the compacted segment ended at end first,
+  // then switches to the live binlog files from end + 1.
+  // Return NULL if the segment is not found.
+  virtual BinlogReader* NewCompactedReader(uint32_t end) = 0;
+
+  //
+  // Consumer API
+  //
+  // Return a reader which resumes from the position saved for name, the
+  // position is saved every few records and when the reader is deleted.
+  // A new consumer starts from the current producer position.
+  // Return NULL if name is invalid or being used by another reader.
+  virtual BinlogReader* OpenConsumer(const std::string& name) = 0;
+  virtual Status RemoveConsumer(const std::string& name) = 0;
+  // Get the minimum saved position of all consumers, any binlog file before
+  // it is no longer needed. Return NotFound if there is no consumer.
+  virtual Status GetMinConsumerStatus(uint32_t* filenum, uint64_t* offset) = 0;
+
+  // Delete the binlog files before filenum, which should be no greater
+  // than the producer and the consumer filenums. The files are deleted in
+  // background if scheduler is not NULL, it works on the local file system
+  // only, so it is ignored unless the binlog uses the default Env. The
+  // files are unlinked without truncation, so a reader still on one of
+  // them reads on until it closes the file.
+  virtual Status PurgeLogs(uint32_t filenum,
+                           DeleteScheduler* scheduler = NULL) = 0;
+
  private:
 
   // No copying allowed
@@ -61,6 +115,48 @@ class BinlogReader {
   void operator=(const BinlogReader&);
 };
 
+class PartitionBinlogReader;
+
+// PartitionBinlog is one binlog shared by many partitions, every record
+// carries its partition id. A partition bitmap is kept for every block,
+// so readers subscribed to some partitions skip the blocks without them.
+class PartitionBinlog {
+ public:
+  static Status Open(const std::string& path, PartitionBinlog** logptr,
+                     Env* env = Env::Default());
+
+  PartitionBinlog() { }
+  virtual ~PartitionBinlog() { }
+
+  virtual Status Append(uint32_t partition, const std::string &item) = 0;
+  // Only the records of partitions will be read
+  virtual PartitionBinlogReader* NewPartitionReader(
+      uint32_t filenum, uint64_t offset,
+      const std::vector<uint32_t>& partitions) = 0;
+
+  virtual Status GetProducerStatus(uint32_t* filenum, uint64_t* pro_offset) = 0;
+
+ private:
+
+  // No copying allowed
+  PartitionBinlog(const PartitionBinlog&);
+  void operator=(const PartitionBinlog&);
+};
+
+class PartitionBinlogReader {
+ public:
+  PartitionBinlogReader() { }
+  virtual ~PartitionBinlogReader() { }
+
+  virtual Status ReadRecord(uint32_t* partition, std::string &record) = 0;
+
+ private:
+
+  // No copying allowed;
+  PartitionBinlogReader(const PartitionBinlogReader&);
+  void operator=(const PartitionBinlogReader&);
+};
+
 }   // namespace slash
 
 
@@ -0,0 +1,224 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "slash/include/async_io.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace slash {
+
+// One in every kFairness picks prefers kIOPriorityLow, so the background
+// operations are not starved by a busy foreground
+const uint64_t kFairness = 10;
+
+AsyncIO::AsyncIO(int num_threads, int max_background, Env* env)
+  : num_threads_(std::max(num_threads, 1)),
+    max_background_(max_background > 0 ? max_background : num_threads_),
+    env_(env),
+    cv_(&mu_),
+    background_running_(0),
+    pending_(0),
+    picks_(0),
+    stop_(false) {
+}
+
+AsyncIO::~AsyncIO() {
+  mu_.Lock();
+  stop_ = true;
+  cv_.SignalAll();
+  mu_.Unlock();
+  if (threads_.empty()) {
+    // Never started, run what is queued here
+    Run();
+  }
+  for (size_t i = 0; i < threads_.size(); i++) {
+    pthread_join(threads_[i], NULL);
+  }
+}
+
+Status AsyncIO::Start() {
+  MutexLock l(&mu_);
+  while (threads_.size() < static_cast<size_t>(num_threads_)) {
+    pthread_t tid;
+    int ret = pthread_create(&tid, NULL, &IOThread, this);
+    if (ret != 0) {
+      return Status::Corruption("create io thread failed", strerror(ret));
+    }
+    threads_.push_back(tid);
+  }
+  return Status::OK();
+}
+
+void* AsyncIO::IOThread(void* arg) {
+  reinterpret_cast<AsyncIO*>(arg)->Run();
+  return NULL;
+}
+
+bool AsyncIO::Pick(Op* op) {
+  std::deque<Op>* high = &queues_[kIOPriorityHigh];
+  std::deque<Op>* low = &queues_[kIOPriorityLow];
+  bool low_allowed = !low->empty() && background_running_ < max_background_;
+  std::deque<Op>* queue = NULL;
+  if (low_allowed && (high->empty() || picks_ % kFairness == 0)) {
+    queue = low;
+  } else if (!high->empty()) {
+    queue = high;
+  } else {
+    return false;
+  }
+  picks_++;
+  *op = queue->front();
+  queue->pop_front();
+  return true;
+}
+
+void AsyncIO::Run() {
+  MutexLock l(&mu_);
+  while (true) {
+    Op op;
+    while (!Pick(&op)) {
+      if (stop_ && pending_ == 0) {
+        cv_.SignalAll();
+        return;
+      }
+      cv_.Wait();
+    }
+    bool background = op.pri == kIOPriorityLow;
+    if (background) {
+      background_running_++;
+    }
+    mu_.Unlock();
+    op.func();
+    mu_.Lock();
+    if (background) {
+      background_running_--;
+    }
+    if (op.key != NULL) {
+      // Let the next operation of the same key run
+      std::map<const void*, std::deque<Op> >::iterator it =
+        serialized_.find(op.key);
+      if (it->second.empty()) {
+        serialized_.erase(it);
+      } else {
+        Op& next = it->second.front();
+        queues_[next.pri].push_back(next);
+        it->second.pop_front();
+      }
+    }
+    pending_--;
+    cv_.SignalAll();
+  }
+}
+
+void AsyncIO::Schedule(const Op& op) {
+  MutexLock l(&mu_);
+  pending_++;
+  if (op.key != NULL) {
+    std::map<const void*, std::deque<Op> >::iterator it =
+      serialized_.find(op.key);
+    if (it != serialized_.end()) {
+      // One of the same key is queued or running
+      it->second.push_back(op);
+      return;
+    }
+    serialized_[op.key];
+  }
+  queues_[op.pri].push_back(op);
+  cv_.Signal();
+}
+
+void AsyncIO::ReadAsync(RandomAccessFile* file, uint64_t offset, size_t n,
+                        char* scratch, const ReadCallback& callback,
+                        IOPriority pri) {
+  Op op;
+  op.func = [file, offset, n, scratch, callback]() {
+    Slice result;
+    Status s = file->Read(offset, n, &result, scratch);
+    if (callback) {
+      callback(s, result);
+    }
+  };
+  op.pri = pri;
+  op.key = NULL;
+  Schedule(op);
+}
+
+void AsyncIO::WriteAsync(WritableFile* file, const Slice& data,
+                         const Callback& callback, IOPriority pri) {
+  Op op;
+  op.func = [file, data, callback]() {
+    Status s = file->Append(data);
+    if (callback) {
+      callback(s);
+    }
+  };
+  op.pri = pri;
+  op.key = file;
+  Schedule(op);
+}
+
+void AsyncIO::SyncAsync(WritableFile* file, const Callback& callback,
+                        IOPriority pri) {
+  Op op;
+  op.func = [file, callback]() {
+    Status s = file->Sync();
+    if (callback) {
+      callback(s);
+    }
+  };
+  op.pri = pri;
+  op.key = file;
+  Schedule(op);
+}
+
+void AsyncIO::DeleteAsync(const std::string& fname, const Callback& callback,
+                          IOPriority pri) {
+  Env* env = env_;
+  Op op;
+  op.func = [env, fname, callback]() {
+    Status s = env->DeleteFile(fname);
+    if (callback) {
+      callback(s);
+    }
+  };
+  op.pri = pri;
+  op.key = NULL;
+  Schedule(op);
+}
+
+void AsyncIO::RenameAsync(const std::string& src, const std::string& dst,
+                          const Callback& callback, IOPriority pri) {
+  Env* env = env_;
+  Op op;
+  op.func = [env, src, dst, callback]() {
+    Status s;
+    if (env->RenameFile(src, dst) != 0) {
+      s = Status::IOError(src, strerror(errno));
+    }
+    if (callback) {
+      callback(s);
+    }
+  };
+  op.pri = pri;
+  op.key = NULL;
+  Schedule(op);
+}
+
+void AsyncIO::WaitForIdle() {
+  MutexLock l(&mu_);
+  while (pending_ > 0) {
+    cv_.Wait();
+  }
+}
+
+uint64_t AsyncIO::Pending() {
+  MutexLock l(&mu_);
+  return pending_;
+}
+
+}  // namespace slash
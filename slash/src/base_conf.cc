@@ -18,6 +18,7 @@ static const int kConfItemLen = 1024*1024;
 
 struct BaseConf::Rep {
   std::string path;
+  Env* env;
   enum ConfType {
     kConf = 0,
 
@@ -40,14 +41,19 @@ struct BaseConf::Rep {
     {}
   };
 
-  explicit Rep(const std::string &p)
-    : path(p) {
+  Rep(const std::string &p, Env* e)
+    : path(p),
+      env(e) {
     }
   std::vector<ConfItem> item;
 };
 
 BaseConf::BaseConf(const std::string &path)
-  : rep_(new Rep(path)) {
+  : rep_(new Rep(path, Env::Default())) {
+}
+
+BaseConf::BaseConf(const std::string &path, Env* env)
+  : rep_(new Rep(path, env)) {
 }
 
 BaseConf::~BaseConf() {
@@ -55,11 +61,13 @@ BaseConf::~BaseConf() {
 }
 
 int BaseConf::LoadConf() {
-  if (!FileExists(rep_->path)) {
+  if (!rep_->env->FileExists(rep_->path)) {
     return -1;
   }
   SequentialFile *sequential_file;
-  NewSequentialFile(rep_->path, &sequential_file);
+  if (!rep_->env->NewSequentialFile(rep_->path, &sequential_file).ok()) {
+    return -1;
+  }
 
   // read conf items
 
@@ -115,7 +123,7 @@ int BaseConf::LoadConf() {
 
 int BaseConf::ReloadConf() {
   Rep* rep = rep_;
-  rep_ = new Rep(rep->path);
+  rep_ = new Rep(rep->path, rep->env);
   if (LoadConf() == -1) {
     delete rep_;
     rep_ = rep;
@@ -275,29 +283,27 @@ void BaseConf::DumpConf() const {
 }
 
 bool BaseConf::WriteBack() {
-  WritableFile *write_file;
-  std::string tmp_path = rep_->path + ".tmp";
-  Status ret = NewWritableFile(tmp_path, &write_file);
-  log_info("ret %s", ret.ToString().c_str());
-  std::string tmp;
+  std::string data;
   for (size_t i = 0; i < rep_->item.size(); i++) {
     if (rep_->item[i].type == Rep::kConf) {
-      tmp = rep_->item[i].name + " : " + rep_->item[i].value + "\n";
-      write_file->Append(tmp);
+      data += rep_->item[i].name + " : " + rep_->item[i].value + "\n";
     } else {
-      write_file->Append(rep_->item[i].value);
+      data += rep_->item[i].value;
     }
   }
-  DeleteFile(rep_->path);
-  RenameFile(tmp_path, rep_->path);
-  delete write_file;
+  Status s = rep_->env->WriteFileAtomic(rep_->path, data);
+  if (!s.ok()) {
+    log_warn("write back %s failed: %s", rep_->path.c_str(),
+             s.ToString().c_str());
+    return false;
+  }
   return true;
 }
 
 void BaseConf::WriteSampleConf() const {
   WritableFile *write_file;
   std::string sample_path = rep_->path + ".sample";
-  Status ret = NewWritableFile(sample_path, &write_file);
+  Status ret = rep_->env->NewWritableFile(sample_path, &write_file);
   std::string tmp;
   for (size_t i = 0; i < rep_->item.size(); i++) {
     if (rep_->item[i].type == Rep::kConf) {
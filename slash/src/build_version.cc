@@ -0,0 +1,4 @@
+#include "slash/include/version.h"
+const char* slash_build_git_sha = "slash_build_git_sha:00c357723cf565d458258ae3566a7aa05356e802";
+const char* slash_build_git_date = "slash_build_git_date:2026-10-19";
+const char* slash_build_compile_date = __DATE__;
@@ -6,7 +6,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <time.h>
 
 #include "slash/include/xdebug.h"
 
@@ -21,9 +21,17 @@ static void PthreadCall(const char* label, int result) {
 
 CondLock::CondLock() {
   PthreadCall("init condlock", pthread_mutex_init(&mutex_, NULL));
+  // Timed on CLOCK_MONOTONIC, not affected by the wall clock adjustments
+  pthread_condattr_t attr;
+  PthreadCall("init condlock attr", pthread_condattr_init(&attr));
+  PthreadCall("set condlock clock",
+              pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+  PthreadCall("init condlock cond", pthread_cond_init(&cond_, &attr));
+  PthreadCall("destroy condlock attr", pthread_condattr_destroy(&attr));
 }
 
 CondLock::~CondLock() {
+  PthreadCall("destroy condlock cond", pthread_cond_destroy(&cond_));
   PthreadCall("destroy condlock", pthread_mutex_unlock(&mutex_));
 }
 
@@ -42,15 +50,14 @@ void CondLock::Wait() {
 void CondLock::TimedWait(uint32_t timeout) {
   /*
    * pthread_cond_timedwait api use absolute API
-   * so we need gettimeofday + timeout
+   * so we need CLOCK_MONOTONIC now + timeout
    */
-  struct timeval now;
-  gettimeofday(&now, NULL);
   struct timespec tsp;
+  clock_gettime(CLOCK_MONOTONIC, &tsp);
 
-  int64_t usec = now.tv_usec + timeout * 1000LL;
-  tsp.tv_sec = now.tv_sec + usec / 1000000;
-  tsp.tv_nsec = (usec % 1000000) * 1000;
+  int64_t nsec = tsp.tv_nsec + timeout * 1000000LL;
+  tsp.tv_sec += nsec / 1000000000;
+  tsp.tv_nsec = nsec % 1000000000;
 
   pthread_cond_timedwait(&cond_, &mutex_, &tsp);
 }
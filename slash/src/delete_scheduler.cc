@@ -0,0 +1,230 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "slash/include/delete_scheduler.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "slash/include/env.h"
+#include "slash/include/xdebug.h"
+
+namespace slash {
+
+// Large files are truncated by this size at a time
+const uint64_t kTruncateChunkSize = 64 << 20;
+// Suffix of the entries in trash
+const std::string kTrashSuffix = ".trash";
+
+// List the files under dir recursively, symbolic links are listed as
+// files and never followed
+static void ListFiles(const std::string& dir, std::vector<std::string>* files) {
+  DIR* d = opendir(dir.c_str());
+  if (d == NULL) {
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0) {
+      continue;
+    }
+    std::string fname = dir + "/" + entry->d_name;
+    struct stat st;
+    if (lstat(fname.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+      ListFiles(fname, files);
+    } else {
+      files->push_back(fname);
+    }
+  }
+  closedir(d);
+}
+
+DeleteScheduler::DeleteScheduler(const std::string& trash_dir,
+                                 uint64_t bytes_per_second)
+  : trash_dir_(trash_dir),
+    cv_(&mu_),
+    bytes_per_second_(bytes_per_second),
+    deleting_(false),
+    stop_(false),
+    seq_(0),
+    started_(false) {
+  while (trash_dir_.size() > 1 && trash_dir_.back() == '/') {
+    trash_dir_.pop_back();
+  }
+}
+
+DeleteScheduler::~DeleteScheduler() {
+  if (started_) {
+    mu_.Lock();
+    stop_ = true;
+    cv_.SignalAll();
+    mu_.Unlock();
+    pthread_join(thread_, NULL);
+  }
+}
+
+Status DeleteScheduler::Start() {
+  if (started_) {
+    return Status::OK();
+  }
+  if (!FileExists(trash_dir_) && CreatePath(trash_dir_) != 0) {
+    return Status::IOError(trash_dir_, strerror(errno));
+  }
+  // Sweep what is left before restart
+  std::vector<std::string> children;
+  if (GetChildren(trash_dir_, children) != 0) {
+    return Status::IOError(trash_dir_, strerror(errno));
+  }
+  {
+    MutexLock l(&mu_);
+    // No one opens the files in trash after restart, truncate them
+    for (size_t i = 0; i < children.size(); i++) {
+      Trash trash = { trash_dir_ + "/" + children[i], true };
+      queue_.push_back(trash);
+    }
+  }
+  if (pthread_create(&thread_, NULL, &BackgroundThread, this) != 0) {
+    return Status::IOError("start delete scheduler", strerror(errno));
+  }
+  started_ = true;
+  return Status::OK();
+}
+
+Status DeleteScheduler::Delete(const std::string& path, bool truncate) {
+  std::string name = path;
+  while (name.size() > 1 && name.back() == '/') {
+    name.pop_back();
+  }
+  size_t pos = name.rfind('/');
+  if (pos != std::string::npos) {
+    name = name.substr(pos + 1);
+  }
+
+  // The trash left before restart may use the same names
+  std::string trash;
+  do {
+    MutexLock l(&mu_);
+    trash = trash_dir_ + "/" + name + "." + std::to_string(seq_++)
+      + kTrashSuffix;
+  } while (FileExists(trash));
+  if (RenameFile(path, trash) != 0) {
+    if (!FileExists(path)) {
+      return Status::NotFound(path);
+    }
+    log_warn("move %s to trash failed, delete it in place", path.c_str());
+    if (IsDir(path) == 0) {
+      return DeleteDir(path) == 0 ? Status::OK()
+        : Status::IOError(path, "delete dir failed");
+    }
+    return DeleteFile(path);
+  }
+
+  MutexLock l(&mu_);
+  Trash entry = { trash, truncate };
+  queue_.push_back(entry);
+  cv_.SignalAll();
+  return Status::OK();
+}
+
+void DeleteScheduler::SetRateBytesPerSecond(uint64_t bytes_per_second) {
+  MutexLock l(&mu_);
+  bytes_per_second_ = bytes_per_second;
+  cv_.SignalAll();
+}
+
+void DeleteScheduler::WaitForEmptyTrash() {
+  MutexLock l(&mu_);
+  while (started_ && (!queue_.empty() || deleting_) && !stop_) {
+    cv_.Wait();
+  }
+}
+
+void* DeleteScheduler::BackgroundThread(void* arg) {
+  reinterpret_cast<DeleteScheduler*>(arg)->Run();
+  return NULL;
+}
+
+void DeleteScheduler::Run() {
+  while (true) {
+    Trash trash;
+    {
+      MutexLock l(&mu_);
+      deleting_ = false;
+      cv_.SignalAll();
+      while (queue_.empty() && !stop_) {
+        cv_.Wait();
+      }
+      if (stop_) {
+        return;
+      }
+      trash = queue_.front();
+      queue_.pop_front();
+      deleting_ = true;
+    }
+
+    struct stat st;
+    if (lstat(trash.path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+      DeleteTrashFile(trash.path, trash.truncate);
+      continue;
+    }
+    std::vector<std::string> files;
+    ListFiles(trash.path, &files);
+    for (size_t i = 0; i < files.size(); i++) {
+      DeleteTrashFile(files[i], trash.truncate);
+      MutexLock l(&mu_);
+      if (stop_) {
+        return;
+      }
+    }
+    // Only the empty directories are left
+    DeleteDir(trash.path);
+  }
+}
+
+void DeleteScheduler::DeleteTrashFile(const std::string& fname,
+                                      bool truncate) {
+  struct stat st;
+  if (lstat(fname.c_str(), &st) != 0) {
+    return;
+  }
+  uint64_t size = st.st_size;
+  // Truncating a file with other hard links would destroy their data
+  if (truncate && S_ISREG(st.st_mode) && st.st_nlink == 1) {
+    while (size > kTruncateChunkSize) {
+      size -= kTruncateChunkSize;
+      if (::truncate(fname.c_str(), size) != 0) {
+        log_warn("truncate %s failed: %s", fname.c_str(), strerror(errno));
+        break;
+      }
+      Throttle(kTruncateChunkSize);
+    }
+  } else {
+    size = 0;
+  }
+  if (unlink(fname.c_str()) != 0 && errno != ENOENT) {
+    log_warn("delete %s failed: %s", fname.c_str(), strerror(errno));
+  }
+  Throttle(size);
+}
+
+void DeleteScheduler::Throttle(uint64_t bytes) {
+  MutexLock l(&mu_);
+  if (bytes_per_second_ == 0 || bytes == 0) {
+    return;
+  }
+  uint64_t deadline = MonotonicMicros() + bytes * 1000000 / bytes_per_second_;
+  uint64_t now;
+  while (!stop_ && (now = MonotonicMicros()) < deadline) {
+    cv_.TimedWait(std::max<uint64_t>((deadline - now) / 1000, 1));
+  }
+}
+
+}  // namespace slash
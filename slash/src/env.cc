@@ -3,15 +3,38 @@
 #include <assert.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/resource.h>
-
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#if defined(SLASH_TSC_CLOCK) && defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <new>
 #include <vector>
 #include <fstream>
 #include <sstream>
 
+#include "slash/include/delete_scheduler.h"
+#include "slash/include/io_engine.h"
+#include "slash/include/io_stats.h"
+#include "slash/include/rate_limiter.h"
+#include "slash/include/slash_mutex.h"
 #include "slash/include/xdebug.h"
 
 namespace slash {
@@ -189,28 +212,162 @@ int GetChildren(const std::string& dir, std::vector<std::string>& result) {
   return res;
 }
 
-bool GetDescendant(const std::string& dir, std::vector<std::string>& result) {
-  DIR* d = opendir(dir.c_str());
-  if (d == NULL) {
+// Call func for every entry of the directory fd except "." and "..",
+// read with getdents64 so d_type comes without stat
+static bool ForEachEntry(
+    int fd, const std::function<void(const char*, unsigned char)>& func) {
+  struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+  char buf[32 * 1024] __attribute__((aligned(8)));
+  while (true) {
+    long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (n == 0) {
+      return true;
+    }
+    for (long pos = 0; pos < n; ) {
+      struct linux_dirent64* d =
+        reinterpret_cast<struct linux_dirent64*>(buf + pos);
+      pos += d->d_reclen;
+      const char* name = d->d_name;
+      if (name[0] == '.'
+          && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      func(name, d->d_type);
+    }
+  }
+}
+
+// Whether the entry is a directory, following symbolic links
+static bool EntryIsDir(int dirfd, const char* name, unsigned char type) {
+  if (type == DT_DIR) {
+    return true;
+  }
+  if (type != DT_LNK && type != DT_UNKNOWN) {
     return false;
   }
-  struct dirent* entry;
-  std::string fname;
-  while ((entry = readdir(d)) != NULL) {
-    if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0) {
-      continue;
+  struct stat st;
+  return fstatat(dirfd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Walk a directory tree, calling the visitor with every directory and its
+ * open fd, the visitor appends the subdirectories to descend into.
+ * Directories are processed by the calling thread, and by up to
+ * kWalkThreads - 1 helper threads started once more than one directory is
+ * waiting, so small trees are walked without any thread.
+ * The visitor should be thread safe.
+ */
+class DirWalker {
+ public:
+  typedef std::function<void(const std::string& dir, int fd,
+                             std::vector<std::string>* subdirs)> Visitor;
+
+  explicit DirWalker(const Visitor& visitor)
+    : visitor_(visitor),
+      cv_(&mu_),
+      active_(0),
+      failed_(false) {
+  }
+
+  // Return false if any directory could not be opened or read
+  bool Run(const std::string& root) {
+    mu_.Lock();
+    queue_.push_back(root);
+    mu_.Unlock();
+    Work();
+    for (size_t i = 0; i < threads_.size(); i++) {
+      pthread_join(threads_[i], NULL);
     }
-    fname = dir + "/" + entry->d_name;
-    if (0 == IsDir(fname)) {
-      if (!GetDescendant(fname, result)) {
-        return false;
+    return !failed_;
+  }
+
+ private:
+  static const size_t kWalkThreads = 4;
+
+  static void* WorkThread(void* arg) {
+    reinterpret_cast<DirWalker*>(arg)->Work();
+    return NULL;
+  }
+
+  void Work() {
+    MutexLock l(&mu_);
+    std::vector<std::string> subdirs;
+    while (true) {
+      while (queue_.empty() && active_ > 0) {
+        cv_.Wait();
       }
-    } else {
-      result.push_back(fname);
+      if (queue_.empty()) {
+        // Nothing left and nobody could add more
+        cv_.SignalAll();
+        return;
+      }
+      std::string dir = queue_.front();
+      queue_.pop_front();
+      active_++;
+      mu_.Unlock();
+
+      subdirs.clear();
+      bool ok = false;
+      int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd >= 0) {
+        visitor_(dir, fd, &subdirs);
+        ok = true;
+        close(fd);
+      }
+
+      mu_.Lock();
+      active_--;
+      failed_ = failed_ || !ok;
+      queue_.insert(queue_.end(), subdirs.begin(), subdirs.end());
+      if (queue_.size() > 1 && threads_.size() < kWalkThreads - 1) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, &WorkThread, this) == 0) {
+          threads_.push_back(tid);
+        }
+      }
+      cv_.SignalAll();
     }
   }
-  closedir(d);
-  return true;
+
+  Visitor visitor_;
+  Mutex mu_;
+  CondVar cv_;
+  std::deque<std::string> queue_;
+  int active_;
+  bool failed_;
+  std::vector<pthread_t> threads_;
+};
+
+bool GetDescendant(const std::string& dir, std::vector<std::string>& result) {
+  Mutex mu;
+  bool read_ok = true;
+  DirWalker walker([&](const std::string& path, int fd,
+                       std::vector<std::string>* subdirs) {
+    std::vector<std::string> files;
+    bool ok = ForEachEntry(fd, [&](const char* name, unsigned char type) {
+      if (EntryIsDir(fd, name, type)) {
+        subdirs->push_back(path + "/" + name);
+      } else {
+        files.push_back(path + "/" + name);
+      }
+    });
+    MutexLock l(&mu);
+    read_ok = read_ok && ok;
+    result.insert(result.end(), files.begin(), files.end());
+  });
+  return walker.Run(dir) && read_ok;
 }
 
 int RenameFile(const std::string& oldname, const std::string& newname) {
@@ -221,7 +378,7 @@ int IsDir(const std::string& path) {
   struct stat buf;
   int ret = stat(path.c_str(), &buf);
   if (0 == ret) {
-    if (buf.st_mode & S_IFDIR) {
+    if (S_ISDIR(buf.st_mode)) {
       //folder
       return 0;
     } else {
@@ -232,47 +389,52 @@ int IsDir(const std::string& path) {
   return -1;
 }
 
+static size_t PathDepth(const std::string& path) {
+  return std::count(path.begin(), path.end(), '/');
+}
+
+/*
+ * Unlink the files of all directories in parallel, then remove the
+ * directories from the deepest. Symbolic links are removed, never
+ * followed.
+ */
 int DeleteDir(const std::string& path)
 {
-  char chBuf[256];
-  DIR * dir = NULL;
-  struct dirent *ptr;
-  int ret = 0;
-  dir = opendir(path.c_str());
-  if (NULL == dir) {
-    return -1;
-  }
-  while((ptr = readdir(dir)) != NULL) {
-    ret = strcmp(ptr->d_name, ".");
-    if (0 == ret) {
-      continue;
-    }
-    ret = strcmp(ptr->d_name, "..");
-    if (0 == ret) {
-      continue;
-    }
-    snprintf(chBuf, 256, "%s/%s", path.c_str(), ptr->d_name);
-    ret = IsDir(chBuf);
-    if (0 == ret) {
-      //is dir
-      ret = DeleteDir(chBuf);
-      if (0 != ret) {
-        return -1;
+  Mutex mu;
+  bool ok = true;
+  std::vector<std::string> dirs;
+  DirWalker walker([&](const std::string& dir, int fd,
+                       std::vector<std::string>* subdirs) {
+    bool dir_ok = ForEachEntry(fd, [&](const char* name, unsigned char type) {
+      bool is_dir = type == DT_DIR;
+      if (type == DT_UNKNOWN) {
+        struct stat st;
+        is_dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0
+          && S_ISDIR(st.st_mode);
       }
-    }
-    else if (1 == ret) {
-      //is file
-      ret = remove(chBuf);
-      if(0 != ret) {
-        return -1;
+      if (is_dir) {
+        subdirs->push_back(dir + "/" + name);
+      } else if (unlinkat(fd, name, 0) != 0) {
+        dir_ok = false;
       }
-    }
-  }
-  (void)closedir(dir);
-  ret = remove(path.c_str());
-  if (0 != ret) {
+    });
+    MutexLock l(&mu);
+    ok = ok && dir_ok;
+    dirs.push_back(dir);
+  });
+  if (!walker.Run(path) || !ok) {
     return -1;
   }
+
+  std::stable_sort(dirs.begin(), dirs.end(),
+                   [](const std::string& a, const std::string& b) {
+                     return PathDepth(a) > PathDepth(b);
+                   });
+  for (size_t i = 0; i < dirs.size(); i++) {
+    if (rmdir(dirs[i].c_str()) != 0) {
+      return -1;
+    }
+  }
   return 0;
 }
 
@@ -283,374 +445,2439 @@ bool DeleteDirIfExist(const std::string& path) {
   return true;
 }
 
-uint64_t Du(const std::string& filename) {
-  struct stat statbuf;
-  uint64_t sum;
-  if (lstat(filename.c_str(), &statbuf) != 0) {
-    return 0;
+bool DeleteDirIfExist(const std::string& path, DeleteScheduler* scheduler) {
+  if (scheduler == NULL) {
+    return DeleteDirIfExist(path);
   }
-  if (S_ISLNK(statbuf.st_mode) && stat(filename.c_str(), &statbuf) != 0) {
-    return 0;
+  if (IsDir(path) == 0 && !scheduler->Delete(path).ok()) {
+    return false;
   }
-  sum = statbuf.st_size;
-  if (S_ISDIR(statbuf.st_mode)) {
-    DIR *dir = NULL;
-    struct dirent *entry;
-    std::string newfile;
+  return true;
+}
 
-    dir = opendir(filename.c_str());
-    if (!dir) {
-      return sum;
-    }
-    while ((entry = readdir(dir))) {
-      if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0) {
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// Buffer size of the buffered copy
+static const size_t kCopyBufferSize = 1 << 20;
+// Threads copying the files of CloneDir
+static const size_t kCopyThreads = 4;
+
+// Whether the errno means the method is not supported between the files
+static bool CopyNotSupported(int err) {
+  return err == EXDEV || err == ENOSYS || err == EINVAL || err == EOPNOTSUPP
+    || err == ENOTTY || err == EPERM || err == EMLINK;
+}
+
+/*
+ * Copy the rest of in to out by copy_file_range, from the current offsets.
+ * Return 1 if copied, 0 if it is not supported and nothing was copied,
+ * -1 on other errors with errno set.
+ */
+static int CopyRange(int in, int out, uint64_t size) {
+#ifdef __NR_copy_file_range
+  uint64_t copied = 0;
+  while (copied < size) {
+    ssize_t n = syscall(__NR_copy_file_range, in, NULL, out, NULL,
+                        size - copied, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
         continue;
       }
-      newfile = filename + "/" + entry->d_name;
-      sum += Du(newfile);
+      return copied == 0 && CopyNotSupported(errno) ? 0 : -1;
     }
-    closedir(dir);
+    if (n == 0) {
+      // src is shorter than its stat
+      break;
+    }
+    copied += n;
   }
-  return sum;
-}
-
-uint64_t NowMicros() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
-}
-
-void SleepForMicroseconds(int micros) {
-  usleep(micros);
+  return 1;
+#else
+  return 0;
+#endif
 }
 
-SequentialFile::~SequentialFile() {
+// Copy the rest of in to out through a buffer, return -1 with errno on error
+static int CopyBuffered(int in, int out, IOFileType type) {
+  char* buf = new char[kCopyBufferSize];
+  int ret = 0;
+  while (true) {
+    ssize_t n = read(in, buf, kCopyBufferSize);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ret = -1;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    ssize_t done = 0;
+    while (done < n) {
+      ssize_t w = write(out, buf + done, n - done);
+      if (w < 0 && errno != EINTR) {
+        ret = -1;
+        break;
+      }
+      done += std::max<ssize_t>(w, 0);
+    }
+    if (ret != 0) {
+      break;
+    }
+    IOStatsAddBytes(type, n, n);
+  }
+  delete[] buf;
+  return ret;
 }
 
-class PosixSequentialFile: public SequentialFile {
- private:
-  std::string filename_;
-  FILE* file_;
+Status CopyFile(const std::string& src, const std::string& dst,
+                const CopyOptions& options, CopyMethod* method) {
+  // dst is unlinked before it is replaced, which must not delete src
+  struct stat src_st;
+  struct stat dst_st;
+  bool same = stat(src.c_str(), &src_st) == 0
+    && stat(dst.c_str(), &dst_st) == 0 && dst_st.st_dev == src_st.st_dev
+    && dst_st.st_ino == src_st.st_ino;
+  if (same && src_st.st_nlink == 1) {
+    return Status::InvalidArgument("copy to itself", src);
+  }
 
- public:
-  virtual void setUnBuffer() {
-    setbuf(file_, NULL);
+  if (options.link_if && options.link_if(src)) {
+    if (same) {
+      // Already a link of src, or src itself under another name
+      if (method != NULL) {
+        *method = kCopyLink;
+      }
+      return Status::OK();
+    }
+    unlink(dst.c_str());
+    if (link(src.c_str(), dst.c_str()) == 0) {
+      if (method != NULL) {
+        *method = kCopyLink;
+      }
+      return Status::OK();
+    }
+    if (!CopyNotSupported(errno)) {
+      return IOError("link " + src, errno);
+    }
   }
 
-  PosixSequentialFile(const std::string& fname, FILE* f)
-      : filename_(fname), file_(f) { setbuf(file_, NULL); }
+  int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return IOError(src, errno);
+  }
+  struct stat st;
+  if (fstat(in, &st) != 0) {
+    int err = errno;
+    close(in);
+    return IOError(src, err);
+  }
+  // Replace dst instead of truncating it, which may be a link of src
+  unlink(dst.c_str());
+  int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                 st.st_mode & 07777);
+  if (out < 0) {
+    int err = errno;
+    close(in);
+    return IOError(dst, err);
+  }
 
-  virtual ~PosixSequentialFile() {
-    if (file_) {
-      fclose(file_);
+  Status s;
+  CopyMethod used = kCopyClone;
+  if (ioctl(out, FICLONE, in) != 0) {
+    used = kCopyRange;
+    int ret = CopyRange(in, out, st.st_size);
+    if (ret == 0) {
+      used = kCopyBuffered;
+      ret = CopyBuffered(in, out, GetIOFileType(dst));
+    }
+    if (ret < 0) {
+      s = IOError("copy " + src + " to " + dst, errno);
     }
   }
+  if (s.ok() && options.sync && fdatasync(out) != 0) {
+    s = IOError(dst, errno);
+  }
+  close(in);
+  if (close(out) != 0 && s.ok()) {
+    s = IOError(dst, errno);
+  }
+  if (s.ok() && method != NULL) {
+    *method = used;
+  }
+  return s;
+}
 
-  virtual Status Read(size_t n, Slice* result, char* scratch) override {
-    Status s;
-    size_t r = fread_unlocked(scratch, 1, n, file_);
-
-    *result = Slice(scratch, r);
+Status CloneDir(const std::string& src, const std::string& dst,
+                const CopyOptions& options) {
+  if (CreatePath(dst) != 0 && IsDir(dst) != 0) {
+    return IOError(dst, errno);
+  }
 
-    if (r < n) {
-      if (feof(file_)) {
-        s = Status::EndFile(filename_, "end file");
-        // We leave status as ok if we hit the end of the file
-      } else {
-        // A partial read with an error: return a non-ok status
-        s = IOError(filename_, errno);
+  // Create the directories and links while walking, and copy the files
+  // by kCopyThreads threads after
+  Mutex mu;
+  Status s;
+  std::vector<std::string> files;
+  size_t prefix = src.size();
+  DirWalker walker([&](const std::string& dir, int fd,
+                       std::vector<std::string>* subdirs) {
+    std::string target = dst + dir.substr(prefix);
+    Status dir_s;
+    bool ok = ForEachEntry(fd, [&](const char* name, unsigned char type) {
+      std::string path = dir + "/" + name;
+      struct stat st;
+      if (type == DT_UNKNOWN
+          && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        type = S_ISDIR(st.st_mode) ? DT_DIR
+          : S_ISLNK(st.st_mode) ? DT_LNK
+          : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
       }
+      if (type == DT_DIR) {
+        if (mkdir((target + "/" + name).c_str(), 0755) != 0
+            && errno != EEXIST) {
+          dir_s = IOError(target + "/" + name, errno);
+          return;
+        }
+        subdirs->push_back(path);
+      } else if (type == DT_LNK) {
+        char link_target[PATH_MAX];
+        ssize_t n = readlinkat(fd, name, link_target, sizeof(link_target) - 1);
+        if (n < 0) {
+          dir_s = IOError(path, errno);
+          return;
+        }
+        link_target[n] = '\0';
+        std::string link_name = target + "/" + name;
+        unlink(link_name.c_str());
+        if (symlink(link_target, link_name.c_str()) != 0) {
+          dir_s = IOError(link_name, errno);
+        }
+      } else if (type == DT_REG) {
+        MutexLock l(&mu);
+        files.push_back(dir.substr(prefix) + "/" + name);
+      }
+    });
+    MutexLock l(&mu);
+    if (s.ok() && !dir_s.ok()) {
+      s = dir_s;
+    } else if (s.ok() && !ok) {
+      s = Status::IOError("read dir failed", dir);
     }
+  });
+  if (!walker.Run(src) && s.ok()) {
+    s = Status::IOError("walk dir failed", src);
+  }
+  if (!s.ok()) {
     return s;
   }
 
-  virtual Status Skip(uint64_t n) override {
-    if (fseek(file_, n, SEEK_CUR)) {
-      return IOError(filename_, errno);
+  std::atomic<size_t> next(0);
+  std::function<void()> copy = [&]() {
+    size_t i;
+    while ((i = next++) < files.size()) {
+      Status copy_s = CopyFile(src + files[i], dst + files[i], options);
+      if (!copy_s.ok()) {
+        MutexLock l(&mu);
+        if (s.ok()) {
+          s = copy_s;
+        }
+        next = files.size();
+      }
+    }
+  };
+  std::vector<pthread_t> threads;
+  size_t num_threads = std::min(kCopyThreads, files.size());
+  for (size_t i = 1; i < num_threads; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, [](void* arg) -> void* {
+          (*reinterpret_cast<std::function<void()>*>(arg))();
+          return NULL;
+        }, &copy) == 0) {
+      threads.push_back(tid);
     }
-    return Status::OK();
   }
-
-  virtual char *ReadLine(char* buf, int n) override {
-    return fgets(buf, n, file_);
+  copy();
+  for (size_t i = 0; i < threads.size(); i++) {
+    pthread_join(threads[i], NULL);
   }
+  return s;
+}
 
-  virtual Status Close() {
-    if (fclose(file_) != 0) {
-      return IOError(filename_, errno);
-    }
-    file_ = NULL;
-    return Status::OK();
+uint64_t Du(const std::string& filename) {
+  struct stat statbuf;
+  if (lstat(filename.c_str(), &statbuf) != 0) {
+    return 0;
+  }
+  if (S_ISLNK(statbuf.st_mode) && stat(filename.c_str(), &statbuf) != 0) {
+    return 0;
+  }
+  if (!S_ISDIR(statbuf.st_mode)) {
+    return statbuf.st_size;
   }
-};
 
-WritableFile::~WritableFile() {
+  std::atomic<uint64_t> sum(statbuf.st_size);
+  DirWalker walker([&](const std::string& dir, int fd,
+                       std::vector<std::string>* subdirs) {
+    uint64_t size = 0;
+    ForEachEntry(fd, [&](const char* name, unsigned char type) {
+      struct stat st;
+      // Follow symbolic links, the same as the size of the path
+      if (fstatat(fd, name, &st, 0) != 0) {
+        return;
+      }
+      size += st.st_size;
+      if (S_ISDIR(st.st_mode)) {
+        subdirs->push_back(dir + "/" + name);
+      }
+    });
+    sum += size;
+  });
+  walker.Run(filename);
+  return sum;
 }
 
-// We preallocate up to an extra megabyte and use memcpy to append new
-// data to the file.  This is safe since we either properly close the
-// file before reading from it, or for log files, the reading code
-// knows enough to skip zero suffixes.
-class PosixMmapFile : public WritableFile
-{
- private:
-  std::string filename_;
-  int fd_;
-  size_t page_size_;
-  size_t map_size_;       // How much extra memory to map at a time
-  char* base_;            // The mapped region
-  char* limit_;           // Limit of the mapped region
-  char* dst_;             // Where to write next  (in range [base_,limit_])
-  char* last_sync_;       // Where have we synced up to
-  uint64_t file_offset_;  // Offset of base_ in file
-  uint64_t write_len_;    // The data that written in the file
-
-
-  // Have we done an munmap of unsynced data?
-  bool pending_sync_;
+// Cached sizes of one directory of DuCache
+struct DuNode {
+  struct timespec mtime;
+  bool invalid;         // Rescan on next Du
+  uint64_t self_size;   // Size of the directory itself
+  uint64_t files_size;  // Size of the entries other than directories
+  std::map<std::string, DuNode*> children;
 
-  // Roundup x to a multiple of y
-  static size_t Roundup(size_t x, size_t y) {
-    return ((x + y - 1) / y) * y;
+  DuNode() : invalid(true), self_size(0), files_size(0) {
+    mtime.tv_sec = mtime.tv_nsec = 0;
   }
 
-  static size_t TrimDown(size_t x, size_t y) {
-    return (x / y) * y;
-  }
-  size_t TruncateToPageBoundary(size_t s) {
-    s -= (s & (page_size_ - 1));
-    assert((s % page_size_) == 0);
-    return s;
+  ~DuNode() {
+    for (std::map<std::string, DuNode*>::iterator it = children.begin();
+         it != children.end(); ++it) {
+      delete it->second;
+    }
   }
+};
 
-  bool UnmapCurrentRegion() {
-    bool result = true;
-    if (base_ != NULL) {
-      if (last_sync_ < limit_) {
-        // Defer syncing this data until next Sync() call, if any
-        pending_sync_ = true;
+static uint64_t RefreshDu(int fd, DuNode* node, uint64_t now) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return 0;
+  }
+  if (node->invalid
+      || st.st_mtim.tv_sec != node->mtime.tv_sec
+      || st.st_mtim.tv_nsec != node->mtime.tv_nsec) {
+    node->mtime = st.st_mtim;
+    node->self_size = st.st_size;
+    node->files_size = 0;
+    // A change in the same timestamp tick is not visible from mtime,
+    // rescan the recently modified directory again next time
+    node->invalid = static_cast<uint64_t>(st.st_mtim.tv_sec) + 1 >= now;
+
+    std::map<std::string, DuNode*> children;
+    ForEachEntry(fd, [&](const char* name, unsigned char type) {
+      struct stat est;
+      if (fstatat(fd, name, &est, 0) != 0) {
+        return;
       }
-      if (munmap(base_, limit_ - base_) != 0) {
-        result = false;
+      if (!S_ISDIR(est.st_mode)) {
+        node->files_size += est.st_size;
+        return;
       }
-      file_offset_ += limit_ - base_;
-      base_ = NULL;
-      limit_ = NULL;
-      last_sync_ = NULL;
-      dst_ = NULL;
-
-      // Increase the amount we map the next time, but capped at 1MB
-      if (map_size_ < (1<<20)) {
-        map_size_ *= 2;
+      std::map<std::string, DuNode*>::iterator it = node->children.find(name);
+      if (it != node->children.end()) {
+        children[name] = it->second;
+        node->children.erase(it);
+      } else {
+        children[name] = new DuNode;
       }
+    });
+    // Drop the subtrees removed
+    for (std::map<std::string, DuNode*>::iterator it = node->children.begin();
+         it != node->children.end(); ++it) {
+      delete it->second;
     }
-    return result;
+    node->children.swap(children);
   }
 
-  bool MapNewRegion() {
-    assert(base_ == NULL);
-    if (posix_fallocate(fd_, file_offset_, map_size_) != 0) {
-      log_warn("ftruncate error");
-      return false;
-    }
-    //log_info("map_size %d fileoffset %llu", map_size_, file_offset_);
-    void* ptr = mmap(NULL, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
-                     fd_, file_offset_);
-    if (ptr == MAP_FAILED) {
-      log_warn("mmap failed");
-      return false;
+  uint64_t sum = node->self_size + node->files_size;
+  for (std::map<std::string, DuNode*>::iterator it = node->children.begin();
+       it != node->children.end(); ++it) {
+    int child = openat(fd, it->first.c_str(),
+                       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (child >= 0) {
+      sum += RefreshDu(child, it->second, now);
+      close(child);
     }
-    base_ = reinterpret_cast<char*>(ptr);
-    limit_ = base_ + map_size_;
-    dst_ = base_ + write_len_;
-    write_len_ = 0;
-    last_sync_ = base_;
-    return true;
   }
+  return sum;
+}
 
- public:
-  PosixMmapFile(const std::string& fname, int fd, size_t page_size, uint64_t write_len = 0)
-      : filename_(fname),
-      fd_(fd),
-      page_size_(page_size),
-      map_size_(Roundup(kMmapBoundSize, page_size)),
-      base_(NULL),
-      limit_(NULL),
-      dst_(NULL),
-      last_sync_(NULL),
-      file_offset_(0),
-      write_len_(write_len),
-      pending_sync_(false) {
-        if (write_len_ != 0) {
-          while (map_size_ < write_len_) {
-            map_size_ += (1024 * 1024);
-          }
-        }
-        assert((page_size & (page_size - 1)) == 0);
-      }
-
+struct DuCache::Rep {
+  Mutex mu;
+  std::string root;
+  DuNode* node;
 
-  ~PosixMmapFile() {
-    if (fd_ >= 0) {
-      PosixMmapFile::Close();
+  explicit Rep(const std::string& r) : root(r), node(new DuNode) {
+    while (root.size() > 1 && root.back() == '/') {
+      root.pop_back();
+    }
+  }
+
+  ~Rep() {
+    delete node;
+  }
+};
+
+DuCache::DuCache(const std::string& root)
+  : rep_(new Rep(root)) {
+}
+
+DuCache::~DuCache() {
+  delete rep_;
+}
+
+uint64_t DuCache::Du() {
+  MutexLock l(&rep_->mu);
+  int fd = open(rep_->root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    // Not a directory, nothing to cache
+    delete rep_->node;
+    rep_->node = new DuNode;
+    return slash::Du(rep_->root);
+  }
+  uint64_t sum = RefreshDu(fd, rep_->node, NowCoarseSeconds());
+  close(fd);
+  return sum;
+}
+
+void DuCache::Invalidate(const std::string& path) {
+  MutexLock l(&rep_->mu);
+  DuNode* node = rep_->node;
+  node->invalid = true;
+  size_t pos = 0;
+  while (node != NULL && pos < path.size()) {
+    size_t next = path.find('/', pos);
+    if (next == std::string::npos) {
+      next = path.size();
+    }
+    if (next > pos) {
+      std::map<std::string, DuNode*>::iterator it =
+        node->children.find(path.substr(pos, next - pos));
+      node = it != node->children.end() ? it->second : NULL;
+      if (node != NULL) {
+        node->invalid = true;
+      }
+    }
+    pos = next + 1;
+  }
+}
+
+struct DirWatcher::Rep {
+  std::string dir;
+  Env* env;
+  int inotify_fd;
+  int pipe_fds[2];   // Wake up the watch thread to exit
+  bool started;
+  pthread_t thread;
+
+  Mutex mu;
+  CondVar cv;
+  uint64_t generation;
+
+  Rep(const std::string& d, Env* e)
+    : dir(d),
+      env(e != NULL ? e : Env::Default()),
+      inotify_fd(-1),
+      started(false),
+      cv(&mu),
+      generation(0) {
+    pipe_fds[0] = pipe_fds[1] = -1;
+    if (dir.back() != '/') {
+      dir.push_back('/');
+    }
+  }
+};
+
+DirWatcher::DirWatcher(const std::string& dir, Env* env)
+  : rep_(new Rep(dir, env)) {
+}
+
+DirWatcher::~DirWatcher() {
+  if (rep_->started) {
+    ssize_t ret = write(rep_->pipe_fds[1], "x", 1);
+    (void)ret;
+    pthread_join(rep_->thread, NULL);
+  }
+  if (rep_->inotify_fd >= 0) {
+    close(rep_->inotify_fd);
+  }
+  if (rep_->pipe_fds[0] >= 0) {
+    close(rep_->pipe_fds[0]);
+    close(rep_->pipe_fds[1]);
+  }
+  delete rep_;
+}
+
+Status DirWatcher::Start() {
+  rep_->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (rep_->inotify_fd < 0) {
+    log_warn("inotify init failed, fall back to polling");
+    return Status::OK();
+  }
+  uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+    | IN_CLOSE_WRITE;
+  if (inotify_add_watch(rep_->inotify_fd, rep_->dir.c_str(), mask) < 0) {
+    // Such as a directory of other Env
+    log_warn("inotify watch %s failed, fall back to polling", rep_->dir.c_str());
+    return Status::OK();
+  }
+  if (pipe2(rep_->pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+    return IOError(rep_->dir, errno);
+  }
+  if (pthread_create(&rep_->thread, NULL, &DirWatcher::WatchThread, rep_) != 0) {
+    return Status::IOError(rep_->dir, "create watch thread failed");
+  }
+  rep_->started = true;
+  return Status::OK();
+}
+
+void* DirWatcher::WatchThread(void* arg) {
+  Rep* rep = reinterpret_cast<Rep*>(arg);
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2];
+  fds[0].fd = rep->inotify_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = rep->pipe_fds[0];
+  fds[1].events = POLLIN;
+
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    bool changed = false;
+    while (read(rep->inotify_fd, buf, sizeof(buf)) > 0) {
+      changed = true;
+    }
+    if (changed) {
+      MutexLock l(&rep->mu);
+      rep->generation++;
+      rep->cv.SignalAll();
+    }
+  }
+  return NULL;
+}
+
+uint64_t DirWatcher::generation() {
+  MutexLock l(&rep_->mu);
+  return rep_->generation;
+}
+
+bool DirWatcher::WaitForChange(uint64_t generation, uint32_t timeout) {
+  if (!rep_->started) {
+    // Polling, every wait is regarded as a change
+    SleepForMicroseconds(std::min(timeout, 10U) * 1000);
+    return true;
+  }
+  MutexLock l(&rep_->mu);
+  if (rep_->generation == generation) {
+    rep_->cv.TimedWait(timeout);
+  }
+  return rep_->generation != generation;
+}
+
+bool DirWatcher::WaitForFile(const std::string& name, uint32_t timeout) {
+  std::string fname = rep_->dir + name;
+  uint64_t deadline = MonotonicMicros() + timeout * 1000ULL;
+  while (true) {
+    // Take the generation first, so no creation is missed after the check
+    uint64_t gen = generation();
+    if (rep_->env->FileExists(fname)) {
+      return true;
+    }
+    uint64_t now = MonotonicMicros();
+    if (now >= deadline) {
+      return false;
+    }
+    WaitForChange(gen, (deadline - now + 999) / 1000);
+  }
+}
+
+uint64_t NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static uint64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(SLASH_TSC_CLOCK) && defined(__x86_64__)
+/*
+ * The TSC is only used when invariant, constant_tsc and nonstop_tsc in
+ * /proc/cpuinfo, so it ticks at one rate on all cores and power states.
+ * nanos = base_nanos + (tsc - base_tsc) * mult >> kTscShift
+ */
+class TscClock {
+ public:
+  TscClock() : usable_(false), base_tsc_(0), base_nanos_(0), mult_(0) {
+    if (Invariant()) {
+      Calibrate();
+    }
+  }
+
+  bool usable() const {
+    return usable_;
+  }
+
+  uint64_t Nanos() const {
+    int64_t ticks = static_cast<int64_t>(__rdtsc() - base_tsc_);
+    if (ticks <= 0) {
+      // rdtsc is not ordered, a read racing the calibration is behind
+      return base_nanos_;
+    }
+    return base_nanos_ + static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(ticks) * mult_) >> kTscShift);
+  }
+
+ private:
+  static const int kTscShift = 32;
+
+  static bool Invariant() {
+    std::ifstream in("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.compare(0, 5, "flags") == 0) {
+        line += " ";
+        return line.find(" constant_tsc ") != std::string::npos
+          && line.find(" nonstop_tsc ") != std::string::npos;
+      }
+    }
+    return false;
+  }
+
+  void Calibrate() {
+    uint64_t nanos0 = MonotonicNanos();
+    uint64_t tsc0 = __rdtsc();
+    SleepForMicroseconds(10000);
+    uint64_t nanos1 = MonotonicNanos();
+    uint64_t tsc1 = __rdtsc();
+    if (tsc1 <= tsc0 || nanos1 <= nanos0) {
+      return;
+    }
+    mult_ = ((nanos1 - nanos0) << kTscShift) / (tsc1 - tsc0);
+    base_tsc_ = tsc1;
+    base_nanos_ = nanos1;
+    usable_ = mult_ > 0;
+  }
+
+  bool usable_;
+  uint64_t base_tsc_;
+  uint64_t base_nanos_;
+  uint64_t mult_;
+};
+
+uint64_t NowNanos() {
+  static TscClock* tsc = new TscClock;
+  return tsc->usable() ? tsc->Nanos() : MonotonicNanos();
+}
+#else
+uint64_t NowNanos() {
+  return MonotonicNanos();
+}
+#endif
+
+uint64_t MonotonicMicros() {
+  return NowNanos() / 1000;
+}
+
+static void CoarseTime(struct timespec* ts) {
+#ifdef CLOCK_REALTIME_COARSE
+  if (clock_gettime(CLOCK_REALTIME_COARSE, ts) == 0) {
+    return;
+  }
+#endif
+  clock_gettime(CLOCK_REALTIME, ts);
+}
+
+uint64_t NowCoarseMicros() {
+  struct timespec ts;
+  CoarseTime(&ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t NowCoarseSeconds() {
+  struct timespec ts;
+  CoarseTime(&ts);
+  return static_cast<uint64_t>(ts.tv_sec);
+}
+
+void SleepForMicroseconds(int micros) {
+  usleep(micros);
+}
+
+SequentialFile::~SequentialFile() {
+}
+
+// The syscalls of the files below, recorded into the IOStatsContext of
+// the thread and the counters of the file type
+static ssize_t StatsPread(IOFileType type, int fd, void* buf, size_t n,
+                          uint64_t offset) {
+  IOStatsRecorder stats(type, &IOStatsContext::pread_nanos);
+  ssize_t r = pread(fd, buf, n, offset);
+  if (r > 0) {
+    stats.AddRead(r);
+  }
+  return r;
+}
+
+static ssize_t StatsPwrite(IOFileType type, int fd, const void* buf, size_t n,
+                           uint64_t offset) {
+  IOStatsRecorder stats(type, &IOStatsContext::pwrite_nanos);
+  ssize_t r = pwrite(fd, buf, n, offset);
+  if (r > 0) {
+    stats.AddWritten(r);
+  }
+  return r;
+}
+
+static ssize_t StatsPwritev(IOFileType type, int fd, const struct iovec* iov,
+                            int count, uint64_t offset) {
+  IOStatsRecorder stats(type, &IOStatsContext::pwrite_nanos);
+  ssize_t r = pwritev(fd, iov, count, offset);
+  if (r > 0) {
+    stats.AddWritten(r);
+  }
+  return r;
+}
+
+static int StatsFadvise(IOFileType type, int fd, uint64_t offset,
+                        uint64_t len, int advice) {
+  IOStatsRecorder stats(type, &IOStatsContext::readahead_nanos);
+  return posix_fadvise(fd, offset, len, advice);
+}
+
+static int StatsMsync(IOFileType type, void* addr, size_t len, int flags) {
+  IOStatsRecorder stats(type, &IOStatsContext::msync_nanos);
+  return msync(addr, len, flags);
+}
+
+static int StatsFdatasync(IOFileType type, int fd) {
+  IOStatsRecorder stats(type, &IOStatsContext::fdatasync_nanos);
+  return fdatasync(fd);
+}
+
+static int StatsFsync(IOFileType type, int fd) {
+  IOStatsRecorder stats(type, &IOStatsContext::fdatasync_nanos);
+  return fsync(fd);
+}
+
+static int StatsSyncFileRange(IOFileType type, int fd, off_t offset,
+                              off_t len, unsigned int flags) {
+  IOStatsRecorder stats(type, &IOStatsContext::range_sync_nanos);
+  return sync_file_range(fd, offset, len, flags);
+}
+
+static int StatsFallocate(IOFileType type, int fd, off_t offset, off_t len) {
+  IOStatsRecorder stats(type, &IOStatsContext::fallocate_nanos);
+  return posix_fallocate(fd, offset, len);
+}
+
+static int StatsFallocateMode(IOFileType type, int fd, int mode, off_t offset,
+                              off_t len) {
+  IOStatsRecorder stats(type, &IOStatsContext::fallocate_nanos);
+  return fallocate(fd, mode, offset, len);
+}
+
+// The faults of MAP_POPULATE are taken inside mmap
+static void* StatsMmap(IOFileType type, void* addr, size_t len, int prot,
+                       int flags, int fd, off_t offset) {
+  IOStatsAdd(&IOStatsContext::mmap_count, 1);
+  IOStatsRecorder stats(type, &IOStatsContext::mmap_nanos);
+  IOStatsFaultCounter faults;
+  return mmap(addr, len, prot, flags, fd, offset);
+}
+
+static int StatsMunmap(IOFileType type, void* addr, size_t len) {
+  IOStatsAdd(&IOStatsContext::munmap_count, 1);
+  IOStatsRecorder stats(type, &IOStatsContext::mmap_nanos);
+  return munmap(addr, len);
+}
+
+// Start asynchronous writeback of the full pages in [*synced, offset) once
+// bytes_per_sync bytes are written after *synced. It is only a hint, the
+// range is taken as synced even if it fails
+static void MaybeRangeSync(IOFileType type, int fd, uint64_t offset,
+                           uint64_t bytes_per_sync, uint64_t* synced) {
+  uint64_t end = offset & ~static_cast<uint64_t>(kPageSize - 1);
+  if (bytes_per_sync == 0 || end < *synced + bytes_per_sync) {
+    return;
+  }
+  if (StatsSyncFileRange(type, fd, *synced, end - *synced,
+                         SYNC_FILE_RANGE_WRITE) != 0) {
+    log_warn("sync_file_range %d failed: %s", fd, strerror(errno));
+  }
+  *synced = end;
+}
+
+struct DirSyncBatcher::Rep {
+  // Sync state of one directory, requests are numbered in arrival order
+  struct Dir {
+    uint64_t requested;
+    uint64_t synced;      // Requests up to it are durable
+    bool syncing;
+
+    Dir() : requested(0), synced(0), syncing(false) { }
+  };
+
+  uint64_t window_us;
+  Mutex mu;
+  CondVar cv;
+  std::map<std::string, Dir> dirs;
+  uint64_t syncs;
+
+  explicit Rep(uint64_t window)
+    : window_us(window), cv(&mu), syncs(0) {
+  }
+};
+
+DirSyncBatcher::DirSyncBatcher(uint64_t window_us)
+  : rep_(new Rep(window_us)) {
+}
+
+DirSyncBatcher::~DirSyncBatcher() {
+  delete rep_;
+}
+
+static Status SyncDir(const std::string& dir) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return IOError(dir, errno);
+  }
+  Status s;
+  if (StatsFsync(GetIOFileType(dir), fd) != 0) {
+    s = IOError(dir, errno);
+  }
+  close(fd);
+  return s;
+}
+
+Status DirSyncBatcher::Sync(const std::string& dir) {
+  MutexLock l(&rep_->mu);
+  Rep::Dir* d = &rep_->dirs[dir];
+  uint64_t seq = ++d->requested;
+  while (d->synced < seq) {
+    if (d->syncing) {
+      rep_->cv.Wait();
+      continue;
+    }
+    // Lead the next fsync, which covers every request arrived before it
+    d->syncing = true;
+    rep_->mu.Unlock();
+    if (rep_->window_us > 0) {
+      SleepForMicroseconds(rep_->window_us);
+    }
+    rep_->mu.Lock();
+    uint64_t target = d->requested;
+    rep_->syncs++;
+    rep_->mu.Unlock();
+    Status s = SyncDir(dir);
+    rep_->mu.Lock();
+    d->syncing = false;
+    rep_->cv.SignalAll();
+    if (!s.ok()) {
+      // The waiters retry by themselves
+      return s;
+    }
+    d->synced = std::max(d->synced, target);
+  }
+  return Status::OK();
+}
+
+uint64_t DirSyncBatcher::syncs() {
+  MutexLock l(&rep_->mu);
+  return rep_->syncs;
+}
+
+static std::string DirName(const std::string& fname) {
+  size_t pos = fname.rfind('/');
+  if (pos == std::string::npos) {
+    return ".";
+  }
+  return pos == 0 ? "/" : fname.substr(0, pos);
+}
+
+Status WriteFileAtomic(const std::string& fname, const Slice& data,
+                       DirSyncBatcher* batcher) {
+  std::string tmp = fname + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return IOError(tmp, errno);
+  }
+  IOFileType type = GetIOFileType(fname);
+  Status s;
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n = StatsPwrite(type, fd, data.data() + done, data.size() - done,
+                            done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      s = IOError(tmp, errno);
+      break;
+    }
+    done += n;
+  }
+  if (s.ok() && StatsFdatasync(type, fd) != 0) {
+    s = IOError(tmp, errno);
+  }
+  if (close(fd) != 0 && s.ok()) {
+    s = IOError(tmp, errno);
+  }
+  if (s.ok() && rename(tmp.c_str(), fname.c_str()) != 0) {
+    s = IOError(fname, errno);
+  }
+  if (!s.ok()) {
+    unlink(tmp.c_str());
+    return s;
+  }
+  std::string dir = DirName(fname);
+  return batcher != NULL ? batcher->Sync(dir) : SyncDir(dir);
+}
+
+WritableFile::~WritableFile() {
+}
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+// Regions of the mmap WritableFile are aligned to it with mmap_huge_pages
+const size_t kHugePageSize = 2 * 1024 * 1024;
+// Bytes faulted in or read ahead by Prefetcher at a time
+const size_t kPrefaultChunkSize = 1024 * 1024;
+
+// A range to be brought into memory by Prefetcher, owned by the file:
+// the mapped region [base, base + len) if fd is -1, otherwise
+// [offset, offset + len) of fd read into the page cache
+struct PrefetchTask {
+  char* base;
+  int fd;
+  uint64_t offset;
+  size_t len;
+  size_t done;    // Bytes prefetched
+  bool queued;
+  bool running;
+
+  PrefetchTask()
+    : base(NULL), fd(-1), offset(0), len(0), done(0), queued(false),
+      running(false) {
+  }
+};
+
+// One helper thread shared by all the files faults in the new regions of
+// the mmap files ahead of the writers, and reads ahead the windows of the
+// sequential files ahead of the readers. Tasks are processed chunk by
+// chunk, so Cancel waits for one chunk at most before the region could be
+// unmapped or the fd closed
+class Prefetcher {
+ public:
+  static Prefetcher* Instance() {
+    static Prefetcher* prefetcher = new Prefetcher;
+    return prefetcher;
+  }
+
+  void Schedule(PrefetchTask* task) {
+    MutexLock l(&mu_);
+    if (!started_) {
+      pthread_t tid;
+      if (pthread_create(&tid, NULL, &Thread, this) != 0) {
+        return;
+      }
+      pthread_detach(tid);
+      started_ = true;
+    }
+    task->done = 0;
+    task->queued = true;
+    queue_.push_back(task);
+    cv_.SignalAll();
+  }
+
+  // Whether task is neither queued nor running, so it could be changed
+  // and scheduled again
+  bool Idle(PrefetchTask* task) {
+    MutexLock l(&mu_);
+    return !task->queued && !task->running;
+  }
+
+  // The range is not touched any more once it returns
+  void Cancel(PrefetchTask* task) {
+    MutexLock l(&mu_);
+    if (task->queued) {
+      queue_.erase(std::find(queue_.begin(), queue_.end(), task));
+      task->queued = false;
+    }
+    while (task->running) {
+      cancelled_ = task;
+      cv_.Wait();
+    }
+  }
+
+ private:
+  Prefetcher()
+    : cv_(&mu_), started_(false), cancelled_(NULL), populate_read_(true) {
+  }
+
+  static void* Thread(void* arg) {
+    reinterpret_cast<Prefetcher*>(arg)->Run();
+    return NULL;
+  }
+
+  void Run() {
+    MutexLock l(&mu_);
+    while (true) {
+      while (queue_.empty()) {
+        cv_.Wait();
+      }
+      PrefetchTask* task = queue_.front();
+      queue_.pop_front();
+      task->queued = false;
+      task->running = true;
+      while (task->done < task->len && cancelled_ != task) {
+        size_t n = std::min(kPrefaultChunkSize, task->len - task->done);
+        if (task->fd < 0) {
+          char* start = task->base + task->done;
+          mu_.Unlock();
+          Prefault(start, n);
+        } else {
+          int fd = task->fd;
+          uint64_t offset = task->offset + task->done;
+          mu_.Unlock();
+          readahead(fd, offset, n);
+        }
+        mu_.Lock();
+        task->done += n;
+      }
+      task->running = false;
+      if (cancelled_ == task) {
+        cancelled_ = NULL;
+      }
+      cv_.SignalAll();
+    }
+  }
+
+  // Read fault the pages with MADV_POPULATE_READ (Linux 5.14) or by
+  // touching them, the same as MAP_POPULATE does for shared mappings.
+  // Faulting them writable would dirty the pages not written yet
+  void Prefault(char* start, size_t n) {
+    if (populate_read_) {
+      if (madvise(start, n, MADV_POPULATE_READ) == 0) {
+        return;
+      }
+      if (errno != EINVAL) {
+        return;
+      }
+      populate_read_ = false;
+    }
+    for (size_t i = 0; i < n; i += kPageSize) {
+      *static_cast<volatile char*>(start + i);
+    }
+  }
+
+  Mutex mu_;
+  CondVar cv_;
+  bool started_;
+  std::deque<PrefetchTask*> queue_;
+  PrefetchTask* cancelled_;
+  // Only used by the thread
+  bool populate_read_;
+};
+
+// We preallocate a region at a time and use memcpy to append new
+// data to the file.  This is safe since we either properly close the
+// file before reading from it, or for log files, the reading code
+// knows enough to skip zero suffixes.
+class PosixMmapFile : public WritableFile
+{
+ private:
+  std::string filename_;
+  int fd_;
+  IOFileType type_;
+  size_t page_size_;
+  size_t map_size_;       // How much extra memory to map at a time
+  size_t max_map_size_;
+  EnvOptions::MmapPrefault prefault_;
+  bool huge_pages_;
+  PrefetchTask prefault_task_;
+  char* base_;            // The mapped region
+  char* limit_;           // Limit of the mapped region
+  char* dst_;             // Where to write next  (in range [base_,limit_])
+  char* last_sync_;       // Where have we synced up to
+  uint64_t file_offset_;  // Offset of base_ in file
+  uint64_t write_len_;    // The data that written in the file
+  uint64_t bytes_per_sync_;
+  uint64_t range_synced_;  // Offset the writeback was started up to
+
+
+  // Have we done an munmap of unsynced data?
+  bool pending_sync_;
+
+  // Roundup x to a multiple of y
+  static size_t Roundup(size_t x, size_t y) {
+    return ((x + y - 1) / y) * y;
+  }
+
+  static size_t TrimDown(size_t x, size_t y) {
+    return (x / y) * y;
+  }
+  size_t TruncateToPageBoundary(size_t s) {
+    s -= (s & (page_size_ - 1));
+    assert((s % page_size_) == 0);
+    return s;
+  }
+
+  bool UnmapCurrentRegion() {
+    bool result = true;
+    if (base_ != NULL) {
+      if (last_sync_ < limit_) {
+        // Defer syncing this data until next Sync() call, if any
+        pending_sync_ = true;
+      }
+      if (prefault_ == EnvOptions::kMmapPrefaultBackground) {
+        Prefetcher::Instance()->Cancel(&prefault_task_);
+      }
+      if (StatsMunmap(type_, base_, limit_ - base_) != 0) {
+        result = false;
+      }
+      file_offset_ += limit_ - base_;
+      base_ = NULL;
+      limit_ = NULL;
+      last_sync_ = NULL;
+      dst_ = NULL;
+
+      // Increase the amount we map the next time, but capped
+      if (map_size_ < max_map_size_) {
+        map_size_ = std::min(map_size_ * 2, max_map_size_);
+      }
+    }
+    return result;
+  }
+
+  bool MapNewRegion() {
+    assert(base_ == NULL);
+    if (StatsFallocate(type_, fd_, file_offset_, map_size_) != 0) {
+      log_warn("ftruncate error");
+      return false;
+    }
+    //log_info("map_size %d fileoffset %llu", map_size_, file_offset_);
+    int flags = MAP_SHARED;
+    if (prefault_ == EnvOptions::kMmapPrefaultPopulate) {
+      flags |= MAP_POPULATE;
+    }
+    void* ptr = StatsMmap(type_, NULL, map_size_, PROT_READ | PROT_WRITE,
+                          flags, fd_, file_offset_);
+    if (ptr == MAP_FAILED) {
+      log_warn("mmap failed");
+      return false;
+    }
+    // Not supported by every file system, it is only a hint
+    if (huge_pages_) {
+      madvise(ptr, map_size_, MADV_HUGEPAGE);
+    }
+    base_ = reinterpret_cast<char*>(ptr);
+    limit_ = base_ + map_size_;
+    dst_ = base_ + write_len_;
+    write_len_ = 0;
+    last_sync_ = base_;
+    if (prefault_ == EnvOptions::kMmapPrefaultBackground) {
+      size_t start = TruncateToPageBoundary(dst_ - base_);
+      prefault_task_.base = base_ + start;
+      prefault_task_.len = map_size_ - start;
+      Prefetcher::Instance()->Schedule(&prefault_task_);
+    }
+    return true;
+  }
+
+ public:
+  PosixMmapFile(const std::string& fname, int fd, size_t page_size,
+                uint64_t write_len, const EnvOptions& options)
+      : filename_(fname),
+      fd_(fd),
+      type_(GetIOFileType(fname)),
+      page_size_(page_size),
+      prefault_(options.mmap_prefault),
+      huge_pages_(options.mmap_huge_pages),
+      base_(NULL),
+      limit_(NULL),
+      dst_(NULL),
+      last_sync_(NULL),
+      file_offset_(0),
+      write_len_(write_len),
+      bytes_per_sync_(options.bytes_per_sync),
+      range_synced_(write_len),
+      pending_sync_(false) {
+        size_t align = huge_pages_ ? kHugePageSize : page_size;
+        map_size_ = Roundup(options.mmap_initial_size > 0
+                            ? options.mmap_initial_size : kMmapBoundSize,
+                            align);
+        max_map_size_ = Roundup(options.mmap_max_size, align);
+        if (write_len_ != 0) {
+          size_t step = std::max<size_t>(1024 * 1024, align);
+          while (map_size_ < write_len_) {
+            map_size_ += step;
+          }
+        }
+        assert((page_size & (page_size - 1)) == 0);
+      }
+
+
+  ~PosixMmapFile() {
+    if (fd_ >= 0) {
+      PosixMmapFile::Close();
     }
   }
 
   virtual Status Append(const Slice& data) {
+    const char* src = data.data();
+    size_t left = data.size();
+    // Written into the page cache without syscall
+    IOStatsAddBytes(type_, 0, left);
+    while (left > 0) {
+      assert(base_ <= dst_);
+      assert(dst_ <= limit_);
+      size_t avail = limit_ - dst_;
+      if (avail == 0) {
+        if (!UnmapCurrentRegion() || !MapNewRegion()) {
+          return IOError(filename_, errno);
+        }
+      }
+      size_t n = (left <= avail) ? left : avail;
+      {
+        IOStatsFaultCounter faults;
+        memcpy(dst_, src, n);
+      }
+      dst_ += n;
+      src += n;
+      left -= n;
+    }
+    MaybeRangeSync(type_, fd_, Filesize(), bytes_per_sync_, &range_synced_);
+    return Status::OK();
+  }
+
+  virtual Status Close() {
+    Status s;
+    size_t unused = limit_ - dst_;
+    if (!UnmapCurrentRegion()) {
+      s = IOError(filename_, errno);
+    } else if (unused > 0) {
+      // Trim the extra space at the end of the file
+      if (ftruncate(fd_, file_offset_ - unused) < 0) {
+        s = IOError(filename_, errno);
+      }
+    }
+
+    if (close(fd_) < 0) {
+      if (s.ok()) {
+        s = IOError(filename_, errno);
+      }
+    }
+
+    fd_ = -1;
+    base_ = NULL;
+    limit_ = NULL;
+    return s;
+  }
+
+  virtual Status Flush() {
+    return Status::OK();
+  }
+
+  virtual Status Sync() {
+    Status s;
+
+    if (pending_sync_) {
+      // Some unmapped data was not synced
+      pending_sync_ = false;
+      if (StatsFdatasync(type_, fd_) < 0) {
+        s = IOError(filename_, errno);
+      }
+    }
+
+    if (dst_ > last_sync_) {
+      // Find the beginnings of the pages that contain the first and last
+      // bytes to be synced.
+      size_t p1 = TruncateToPageBoundary(last_sync_ - base_);
+      size_t p2 = TruncateToPageBoundary(dst_ - base_ - 1);
+      last_sync_ = dst_;
+      if (StatsMsync(type_, base_ + p1, p2 - p1 + page_size_, MS_SYNC) < 0) {
+        s = IOError(filename_, errno);
+      }
+    }
+
+    return s;
+  }
+
+  virtual Status Trim(uint64_t target) {
+    if (!UnmapCurrentRegion()) {
+      return IOError(filename_, errno);
+    }
+
+    file_offset_ = target;
+    range_synced_ = std::min(range_synced_, target);
+
+    if (!MapNewRegion()) {
+      return IOError(filename_, errno);
+    }
+    return Status::OK();
+  }
+
+  virtual uint64_t Filesize() {
+    return write_len_ + file_offset_ + (dst_ - base_);
+  }
+};
+
+
+// Buffer the appended data in user space, and write it out with pwrite
+// when the buffer is full or on Flush. No space is preallocated, so the
+// file size is always the size of the data flushed.
+class PosixWritableFile : public WritableFile {
+ private:
+  std::string filename_;
+  int fd_;
+  IOFileType type_;
+  char* buf_;
+  size_t capacity_;
+  size_t pos_;            // Size of the data in buf_
+  uint64_t file_offset_;  // Offset of buf_ in file
+  uint64_t bytes_per_sync_;
+  uint64_t range_synced_;  // Offset the writeback was started up to
+
+  Status WriteRaw(const char* src, size_t left) {
+    while (left > 0) {
+      ssize_t done = StatsPwrite(type_, fd_, src, left, file_offset_);
+      if (done < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return IOError(filename_, errno);
+      }
+      left -= done;
+      src += done;
+      file_offset_ += done;
+    }
+    return Status::OK();
+  }
+
+  // Write the buffer and data with one syscall
+  Status WriteBufferAndData(const char* src, size_t n) {
+    struct iovec iov[2];
+    iov[0].iov_base = buf_;
+    iov[0].iov_len = pos_;
+    iov[1].iov_base = const_cast<char*>(src);
+    iov[1].iov_len = n;
+    ssize_t done;
+    do {
+      done = StatsPwritev(type_, fd_, iov, 2, file_offset_);
+    } while (done < 0 && errno == EINTR);
+    if (done < 0) {
+      return IOError(filename_, errno);
+    }
+    file_offset_ += done;
+    size_t total = pos_ + n;
+    if (static_cast<size_t>(done) < pos_) {
+      // Short write, fall back to write the rest one by one
+      Status s = WriteRaw(buf_ + done, pos_ - done);
+      pos_ = 0;
+      return s.ok() ? WriteRaw(src, n) : s;
+    }
+    pos_ = 0;
+    if (static_cast<size_t>(done) < total) {
+      size_t written = done - (total - n);
+      return WriteRaw(src + written, n - written);
+    }
+    return Status::OK();
+  }
+
+ public:
+  PosixWritableFile(const std::string& fname, int fd, size_t capacity,
+                    uint64_t write_len = 0, uint64_t bytes_per_sync = 0)
+      : filename_(fname),
+      fd_(fd),
+      type_(GetIOFileType(fname)),
+      buf_(new char[capacity]),
+      capacity_(capacity),
+      pos_(0),
+      file_offset_(write_len),
+      bytes_per_sync_(bytes_per_sync),
+      range_synced_(write_len) {
+  }
+
+  ~PosixWritableFile() {
+    if (fd_ >= 0) {
+      PosixWritableFile::Close();
+    }
+    delete[] buf_;
+  }
+
+  virtual Status Append(const Slice& data) override {
+    const char* src = data.data();
+    size_t left = data.size();
+    if (left <= capacity_ - pos_) {
+      memcpy(buf_ + pos_, src, left);
+      pos_ += left;
+      return Status::OK();
+    }
+    if (pos_ + left < 2 * capacity_) {
+      // Fill up the buffer, write it and keep the rest
+      size_t n = capacity_ - pos_;
+      memcpy(buf_ + pos_, src, n);
+      pos_ += n;
+      Status s = Flush();
+      if (!s.ok()) {
+        return s;
+      }
+      memcpy(buf_, src + n, left - n);
+      pos_ = left - n;
+      return Status::OK();
+    }
+    // Large write, no need to copy it into the buffer
+    Status s = WriteBufferAndData(src, left);
+    MaybeRangeSync(type_, fd_, file_offset_, bytes_per_sync_, &range_synced_);
+    return s;
+  }
+
+  virtual Status Close() override {
+    Status s = Flush();
+    // Drop the stale data after the write position, if any
+    if (ftruncate(fd_, file_offset_) < 0 && s.ok()) {
+      s = IOError(filename_, errno);
+    }
+    if (close(fd_) < 0 && s.ok()) {
+      s = IOError(filename_, errno);
+    }
+    fd_ = -1;
+    return s;
+  }
+
+  virtual Status Flush() override {
+    Status s = WriteRaw(buf_, pos_);
+    pos_ = 0;
+    MaybeRangeSync(type_, fd_, file_offset_, bytes_per_sync_, &range_synced_);
+    return s;
+  }
+
+  virtual Status Sync() override {
+    Status s = Flush();
+    if (s.ok() && StatsFdatasync(type_, fd_) < 0) {
+      s = IOError(filename_, errno);
+    }
+    return s;
+  }
+
+  virtual Status Trim(uint64_t target) override {
+    Status s = Flush();
+    if (!s.ok()) {
+      return s;
+    }
+    if (ftruncate(fd_, target) < 0) {
+      return IOError(filename_, errno);
+    }
+    file_offset_ = target;
+    range_synced_ = std::min(range_synced_, target);
+    return Status::OK();
+  }
+
+  virtual uint64_t Filesize() override {
+    return file_offset_ + pos_;
+  }
+};
+
+// Append into a ring of buffers. A full buffer is submitted to the
+// IOEngine while the next one is being filled, so up to depth writes are
+// in flight. Flush waits for all of them, so the data is visible to the
+// readers after Flush, the same as the other WritableFile.
+class PosixAsyncWritableFile : public WritableFile {
+ private:
+  std::string filename_;
+  int fd_;
+  IOFileType type_;
+  IOEngine* engine_;
+  size_t capacity_;
+  std::vector<char*> bufs_;
+  std::vector<IORequest> reqs_;
+  std::vector<bool> busy_;
+  bool registered_;
+  size_t cur_;            // Index of the buffer being filled
+  size_t pos_;            // Size of the data in the current buffer
+  uint64_t file_offset_;  // Offset of the current buffer in file
+  Status bg_status_;      // Error of the writes completed
+
+  // Finish the rest of a short write synchronously
+  void WriteRest(const IORequest& req) {
+    const char* src = req.buf + req.result;
+    size_t left = req.len - req.result;
+    uint64_t offset = req.offset + req.result;
+    while (left > 0) {
+      ssize_t done = StatsPwrite(type_, fd_, src, left, offset);
+      if (done < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        bg_status_ = IOError(filename_, errno);
+        return;
+      }
+      left -= done;
+      src += done;
+      offset += done;
+    }
+  }
+
+  // Return the error of Reap, those of the writes go to bg_status_
+  Status ReapAtLeast(int min_complete) {
+    std::vector<IORequest*> done(reqs_.size());
+    int count;
+    Status s = engine_->Reap(done.data(), done.size(), min_complete, &count);
+    if (!s.ok()) {
+      // The buffers in flight can not be told free any more
+      if (bg_status_.ok()) {
+        bg_status_ = s;
+      }
+      return s;
+    }
+    for (int i = 0; i < count; i++) {
+      IORequest* req = done[i];
+      busy_[req - reqs_.data()] = false;
+      if (req->result > 0) {
+        IOStatsAddBytes(type_, 0, req->result);
+      }
+      if (req->result < 0) {
+        bg_status_ = IOError(filename_, -req->result);
+      } else if (static_cast<size_t>(req->result) < req->len) {
+        WriteRest(*req);
+      }
+    }
+    return Status::OK();
+  }
+
+  Status SubmitCurrent() {
+    IORequest* req = &reqs_[cur_];
+    req->op = IORequest::kWrite;
+    req->fd = fd_;
+    req->offset = file_offset_;
+    req->buf = bufs_[cur_];
+    req->len = pos_;
+    req->buf_index = registered_ ? cur_ : -1;
+    Status s = engine_->Prepare(req);
+    if (!s.ok()) {
+      return s;
+    }
+    // Once prepared, the request is submitted by a later Submit or Reap
+    // even if this Submit fails, so the buffer is in flight from now on
+    busy_[cur_] = true;
+    file_offset_ += pos_;
+    pos_ = 0;
+    cur_ = (cur_ + 1) % bufs_.size();
+    int submitted;
+    {
+      IOStatsRecorder stats(type_, &IOStatsContext::pwrite_nanos);
+      s = engine_->Submit(&submitted);
+    }
+    if (!s.ok()) {
+      bg_status_ = s;
+      return s;
+    }
+    // Wait for the next buffer to be written
+    while (busy_[cur_] && s.ok()) {
+      s = ReapAtLeast(1);
+    }
+    return bg_status_;
+  }
+
+  // Wait for all the writes in flight, also after a write failed, since
+  // their buffers are reused or freed afterwards
+  Status WaitAll() {
+    Status s;
+    while (engine_->inflight() > 0 && s.ok()) {
+      s = ReapAtLeast(engine_->inflight());
+    }
+    return bg_status_;
+  }
+
+ public:
+  PosixAsyncWritableFile(const std::string& fname, int fd, IOEngine* engine,
+                         size_t capacity, uint32_t depth,
+                         uint64_t write_len = 0)
+      : filename_(fname),
+      fd_(fd),
+      type_(GetIOFileType(fname)),
+      engine_(engine),
+      capacity_(std::max<size_t>(capacity, 1)),
+      bufs_(std::max<uint32_t>(depth, 1)),
+      reqs_(bufs_.size()),
+      busy_(bufs_.size(), false),
+      registered_(false),
+      cur_(0),
+      pos_(0),
+      file_offset_(write_len) {
+    std::vector<struct iovec> iov(bufs_.size());
+    for (size_t i = 0; i < bufs_.size(); i++) {
+      bufs_[i] = new char[capacity_];
+      iov[i].iov_base = bufs_[i];
+      iov[i].iov_len = capacity_;
+    }
+    // Registering may fail for RLIMIT_MEMLOCK, then write without it
+    registered_ = engine_->RegisterBuffers(iov).ok();
+  }
+
+  ~PosixAsyncWritableFile() {
+    if (fd_ >= 0) {
+      PosixAsyncWritableFile::Close();
+    }
+    WaitAll();
+    delete engine_;
+    for (size_t i = 0; i < bufs_.size(); i++) {
+      delete[] bufs_[i];
+    }
+  }
+
+  virtual Status Append(const Slice& data) override {
+    if (!bg_status_.ok()) {
+      return bg_status_;
+    }
+    const char* src = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+      size_t n = std::min(left, capacity_ - pos_);
+      memcpy(bufs_[cur_] + pos_, src, n);
+      pos_ += n;
+      src += n;
+      left -= n;
+      if (pos_ == capacity_) {
+        Status s = SubmitCurrent();
+        if (!s.ok()) {
+          return s;
+        }
+      }
+    }
+    return Status::OK();
+  }
+
+  virtual Status Close() override {
+    Status s = Flush();
+    // No write may land behind the truncation, even if Flush failed
+    Status w = WaitAll();
+    if (s.ok()) {
+      s = w;
+    }
+    if (ftruncate(fd_, file_offset_) < 0 && s.ok()) {
+      s = IOError(filename_, errno);
+    }
+    if (close(fd_) < 0 && s.ok()) {
+      s = IOError(filename_, errno);
+    }
+    fd_ = -1;
+    return s;
+  }
+
+  virtual Status Flush() override {
+    Status s = bg_status_;
+    if (s.ok() && pos_ > 0) {
+      s = SubmitCurrent();
+    }
+    if (s.ok()) {
+      s = WaitAll();
+    }
+    return s;
+  }
+
+  virtual Status Sync() override {
+    Status s = Flush();
+    if (!s.ok()) {
+      return s;
+    }
+    IORequest req;
+    req.op = IORequest::kFdatasync;
+    req.fd = fd_;
+    IOStatsRecorder stats(type_, &IOStatsContext::fdatasync_nanos);
+    return engine_->Execute(&req);
+  }
+
+  virtual Status Trim(uint64_t target) override {
+    Status s = Flush();
+    if (!s.ok()) {
+      return s;
+    }
+    if (ftruncate(fd_, target) < 0) {
+      return IOError(filename_, errno);
+    }
+    file_offset_ = target;
+    return Status::OK();
+  }
+
+  virtual uint64_t Filesize() override {
+    return file_offset_ + pos_;
+  }
+};
+
+static Status NewAsyncWritableFile(const std::string& fname, int fd,
+                                   uint64_t write_len,
+                                   const EnvOptions& options,
+                                   WritableFile** result) {
+  IOEngine* engine;
+  Status s = IOEngine::Open(options.async_write_depth, &engine);
+  if (!s.ok()) {
+    close(fd);
+    *result = NULL;
+    return s;
+  }
+  *result = new PosixAsyncWritableFile(fname, fd, engine,
+                                       options.writable_file_buffer_size,
+                                       options.async_write_depth, write_len);
+  return s;
+}
+
+const size_t kDirectIOAlignment = 4096;
+
+static inline uint64_t TruncateToAlignment(uint64_t n) {
+  return n & ~static_cast<uint64_t>(kDirectIOAlignment - 1);
+}
+
+static inline uint64_t RoundUpToAlignment(uint64_t n) {
+  return TruncateToAlignment(n + kDirectIOAlignment - 1);
+}
+
+// Keep the aligned buffers of the closed O_DIRECT files for reuse,
+// since binlog files are opened and closed frequently
+class AlignedBufferPool {
+ public:
+  static AlignedBufferPool* Instance() {
+    static AlignedBufferPool* pool = new AlignedBufferPool;
+    return pool;
+  }
+
+  char* Get(size_t size) {
+    {
+      MutexLock l(&mutex_);
+      std::multimap<size_t, char*>::iterator it = free_.find(size);
+      if (it != free_.end()) {
+        char* buf = it->second;
+        free_.erase(it);
+        return buf;
+      }
+    }
+    void* buf = NULL;
+    if (posix_memalign(&buf, kDirectIOAlignment, size) != 0) {
+      throw std::bad_alloc();
+    }
+    return static_cast<char*>(buf);
+  }
+
+  void Put(char* buf, size_t size) {
+    MutexLock l(&mutex_);
+    if (free_.size() < kMaxFreeBuffers) {
+      free_.insert(std::make_pair(size, buf));
+    } else {
+      free(buf);
+    }
+  }
+
+ private:
+  static const size_t kMaxFreeBuffers = 16;
+
+  Mutex mutex_;
+  std::multimap<size_t, char*> free_;
+};
+
+// Open with O_DIRECT, or without it if the file system rejects it
+static int OpenDirect(const std::string& fname, int flags, bool* direct) {
+  *direct = true;
+  int fd = open(fname.c_str(), flags | O_DIRECT, 0644);
+  if (fd < 0 && errno == EINVAL) {
+    log_warn("%s: O_DIRECT is not supported, use buffered I/O", fname.c_str());
+    *direct = false;
+    fd = open(fname.c_str(), flags, 0644);
+  }
+  return fd;
+}
+
+// Some file systems accept O_DIRECT on open but reject the I/O
+static bool DisableDirectIO(const std::string& fname, int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+    return false;
+  }
+  log_warn("%s: O_DIRECT I/O is rejected, use buffered I/O", fname.c_str());
+  return true;
+}
+
+// Write through O_DIRECT with an aligned buffer. Flush writes the buffer
+// padded with zeros to the alignment, and keeps the partial last block in
+// the buffer to be written again by the next Flush. Close truncates the
+// padding.
+class DirectWritableFile : public WritableFile {
+ private:
+  std::string filename_;
+  int fd_;
+  IOFileType type_;
+  bool direct_;
+  char* buf_;
+  size_t capacity_;
+  size_t pos_;           // Size of the data in buf_
+  size_t flushed_;       // Size of the data in buf_ already written
+  uint64_t buf_offset_;  // Offset of buf_ in file, aligned
+
+  Status WriteBuffer(size_t n) {
+    const char* src = buf_;
+    uint64_t offset = buf_offset_;
+    while (n > 0) {
+      ssize_t done = StatsPwrite(type_, fd_, src, n, offset);
+      if (done < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EINVAL && direct_ && DisableDirectIO(filename_, fd_)) {
+          direct_ = false;
+          continue;
+        }
+        return IOError(filename_, errno);
+      }
+      n -= done;
+      src += done;
+      offset += done;
+    }
+    return Status::OK();
+  }
+
+ public:
+  DirectWritableFile(const std::string& fname, int fd, bool direct,
+                     size_t capacity)
+      : filename_(fname),
+      fd_(fd),
+      type_(GetIOFileType(fname)),
+      direct_(direct),
+      capacity_(RoundUpToAlignment(std::max(capacity, kDirectIOAlignment))),
+      pos_(0),
+      flushed_(0),
+      buf_offset_(0) {
+    buf_ = AlignedBufferPool::Instance()->Get(capacity_);
+  }
+
+  ~DirectWritableFile() {
+    if (fd_ >= 0) {
+      DirectWritableFile::Close();
+    }
+    AlignedBufferPool::Instance()->Put(buf_, capacity_);
+  }
+
+  // Continue writing at offset, load the partial block before it
+  Status Reset(uint64_t offset) {
+    buf_offset_ = TruncateToAlignment(offset);
+    pos_ = offset - buf_offset_;
+    flushed_ = 0;
+    if (pos_ == 0) {
+      return Status::OK();
+    }
+    ssize_t r;
+    while ((r = StatsPread(type_, fd_, buf_, kDirectIOAlignment,
+                           buf_offset_)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EINVAL && direct_ && DisableDirectIO(filename_, fd_)) {
+        direct_ = false;
+        continue;
+      }
+      // Nothing to write back on close
+      flushed_ = pos_;
+      return IOError(filename_, errno);
+    }
+    if (static_cast<size_t>(r) < pos_) {
+      // File is shorter than offset, the same as the mmap file
+      memset(buf_ + r, 0, pos_ - r);
+    }
+    return Status::OK();
+  }
+
+  virtual Status Append(const Slice& data) override {
     const char* src = data.data();
     size_t left = data.size();
     while (left > 0) {
-      assert(base_ <= dst_);
-      assert(dst_ <= limit_);
-      size_t avail = limit_ - dst_;
-      if (avail == 0) {
-        if (!UnmapCurrentRegion() || !MapNewRegion()) {
-          return IOError(filename_, errno);
-        }
-      }
-      size_t n = (left <= avail) ? left : avail;
-      memcpy(dst_, src, n);
-      dst_ += n;
+      size_t n = std::min(left, capacity_ - pos_);
+      memcpy(buf_ + pos_, src, n);
+      pos_ += n;
       src += n;
       left -= n;
+      if (pos_ == capacity_) {
+        Status s = Flush();
+        if (!s.ok()) {
+          return s;
+        }
+      }
     }
     return Status::OK();
   }
 
-  virtual Status Close() {
-    Status s;
-    size_t unused = limit_ - dst_;
-    if (!UnmapCurrentRegion()) {
+  virtual Status Close() override {
+    Status s = Flush();
+    if (ftruncate(fd_, Filesize()) < 0 && s.ok()) {
       s = IOError(filename_, errno);
-    } else if (unused > 0) {
-      // Trim the extra space at the end of the file
-      if (ftruncate(fd_, file_offset_ - unused) < 0) {
-        s = IOError(filename_, errno);
+    }
+    if (close(fd_) < 0 && s.ok()) {
+      s = IOError(filename_, errno);
+    }
+    fd_ = -1;
+    return s;
+  }
+
+  virtual Status Flush() override {
+    if (pos_ == flushed_) {
+      return Status::OK();
+    }
+    size_t n = RoundUpToAlignment(pos_);
+    memset(buf_ + pos_, 0, n - pos_);
+    Status s = WriteBuffer(direct_ ? n : pos_);
+    if (!s.ok()) {
+      return s;
+    }
+    size_t keep = TruncateToAlignment(pos_);
+    memmove(buf_, buf_ + keep, pos_ - keep);
+    buf_offset_ += keep;
+    pos_ -= keep;
+    flushed_ = pos_;
+    return Status::OK();
+  }
+
+  virtual Status Sync() override {
+    Status s = Flush();
+    // O_DIRECT neither flushes the disk cache nor the file size
+    if (s.ok() && StatsFdatasync(type_, fd_) < 0) {
+      s = IOError(filename_, errno);
+    }
+    return s;
+  }
+
+  virtual Status Trim(uint64_t target) override {
+    Status s = Flush();
+    if (!s.ok()) {
+      return s;
+    }
+    if (ftruncate(fd_, target) < 0) {
+      return IOError(filename_, errno);
+    }
+    return Reset(target);
+  }
+
+  virtual uint64_t Filesize() override {
+    return buf_offset_ + pos_;
+  }
+};
+
+// Read the whole range unless end of file is reached
+static ssize_t PreadFully(IOFileType type, int fd, char* buf, size_t n,
+                          uint64_t offset) {
+  size_t done = 0;
+  while (done < n) {
+    ssize_t r = StatsPread(type, fd, buf + done, n - done, offset + done);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (r == 0) {
+      break;
+    }
+    done += r;
+  }
+  return done;
+}
+
+/*
+ * Read with pread into an aligned buffer, through O_DIRECT if direct.
+ * The buffer is refilled around the read position once it is consumed,
+ * so the data appended to a file being written is visible after EndFile,
+ * and Skip only moves the position.
+ * Through the page cache, the readahead_size bytes following the buffer
+ * are requested with posix_fadvise(WILLNEED) whenever less than half of
+ * them is left ahead, or by the Prefetcher thread with
+ * background_readahead so the reader never waits for the hint.
+ */
+class PosixSequentialFile : public SequentialFile {
+ private:
+  std::string filename_;
+  int fd_;
+  IOFileType type_;
+  bool direct_;
+  char* buf_;
+  size_t capacity_;
+  uint64_t buf_offset_;  // Offset of buf_ in file, aligned
+  size_t buf_len_;       // Size of the data in buf_ valid to serve
+  uint64_t pos_;         // Read position
+  size_t readahead_size_;
+  bool background_readahead_;
+  uint64_t readahead_end_;  // End of the range requested to read ahead
+  PrefetchTask readahead_task_;
+
+  bool Buffered() const {
+    return pos_ >= buf_offset_ && pos_ < buf_offset_ + buf_len_;
+  }
+
+  Status Fill() {
+    buf_offset_ = TruncateToAlignment(pos_);
+    buf_len_ = 0;
+    ssize_t r;
+    while ((r = StatsPread(type_, fd_, buf_, capacity_, buf_offset_)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EINVAL && direct_ && DisableDirectIO(filename_, fd_)) {
+        direct_ = false;
+        continue;
+      }
+      return IOError(filename_, errno);
+    }
+    buf_len_ = r;
+    Readahead(buf_offset_ + buf_len_);
+    return Status::OK();
+  }
+
+  // Read ahead of end, which is where the reader is about to read
+  void Readahead(uint64_t end) {
+    if (direct_ || readahead_size_ == 0
+        || readahead_end_ >= end + readahead_size_ / 2) {
+      return;
+    }
+    uint64_t start = std::max(readahead_end_, end);
+    uint64_t len = end + readahead_size_ - start;
+    if (background_readahead_) {
+      Prefetcher* prefetcher = Prefetcher::Instance();
+      if (!prefetcher->Idle(&readahead_task_)) {
+        // Still reading the previous window, retry on the next Fill
+        return;
+      }
+      readahead_task_.fd = fd_;
+      readahead_task_.offset = start;
+      readahead_task_.len = len;
+      prefetcher->Schedule(&readahead_task_);
+    } else {
+      StatsFadvise(type_, fd_, start, len, POSIX_FADV_WILLNEED);
+    }
+    readahead_end_ = start + len;
+  }
+
+ public:
+  PosixSequentialFile(const std::string& fname, int fd, bool direct,
+                      const EnvOptions& options)
+      : filename_(fname),
+      fd_(fd),
+      type_(GetIOFileType(fname)),
+      direct_(direct),
+      capacity_(RoundUpToAlignment(std::max(
+            direct ? options.direct_io_buffer_size
+                   : options.sequential_read_buffer_size,
+            kDirectIOAlignment))),
+      buf_offset_(0),
+      buf_len_(0),
+      pos_(0),
+      readahead_size_(options.readahead_size),
+      background_readahead_(options.background_readahead),
+      readahead_end_(0) {
+    buf_ = AlignedBufferPool::Instance()->Get(capacity_);
+    if (!direct_) {
+      posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+  }
+
+  virtual ~PosixSequentialFile() {
+    if (background_readahead_) {
+      Prefetcher::Instance()->Cancel(&readahead_task_);
+    }
+    close(fd_);
+    AlignedBufferPool::Instance()->Put(buf_, capacity_);
+  }
+
+  virtual Status Read(size_t n, Slice* result, char* scratch) override {
+    size_t copied = 0;
+    while (copied < n) {
+      if (!Buffered()) {
+        if (!direct_ && n - copied >= capacity_) {
+          // Too large to be worth buffering, read into scratch directly
+          Readahead(pos_ + n - copied);
+          ssize_t r = PreadFully(type_, fd_, scratch + copied, n - copied,
+                                 pos_);
+          if (r < 0) {
+            *result = Slice(scratch, copied);
+            return IOError(filename_, errno);
+          }
+          copied += r;
+          pos_ += r;
+          break;
+        }
+        Status s = Fill();
+        if (!s.ok()) {
+          *result = Slice(scratch, copied);
+          return s;
+        }
+        if (!Buffered()) {
+          break;
+        }
+      }
+      size_t len = std::min<uint64_t>(n - copied,
+                                      buf_offset_ + buf_len_ - pos_);
+      memcpy(scratch + copied, buf_ + (pos_ - buf_offset_), len);
+      copied += len;
+      pos_ += len;
+    }
+    *result = Slice(scratch, copied);
+    if (copied < n) {
+      return Status::EndFile(filename_, "end file");
+    }
+    return Status::OK();
+  }
+
+  virtual Status Skip(uint64_t n) override {
+    pos_ += n;
+    return Status::OK();
+  }
+
+  virtual void DropBuffer() override {
+    buf_len_ = 0;
+  }
+
+  virtual char *ReadLine(char* buf, int n) override {
+    if (n <= 0) {
+      return NULL;
+    }
+    int len = 0;
+    while (len < n - 1) {
+      if (!Buffered() && (!Fill().ok() || !Buffered())) {
+        break;
+      }
+      char c = buf_[pos_ - buf_offset_];
+      pos_++;
+      buf[len++] = c;
+      if (c == '\n') {
+        break;
+      }
+    }
+    if (len == 0) {
+      return NULL;
+    }
+    buf[len] = '\0';
+    return buf;
+  }
+};
+
+RWFile::~RWFile() {
+}
+
+RandomAccessFile::~RandomAccessFile() {
+}
+
+Status RandomAccessFile::MultiRead(ReadRequest* reqs, size_t num) const {
+  Status s;
+  for (size_t i = 0; i < num; i++) {
+    reqs[i].status = Read(reqs[i].offset, reqs[i].len, &reqs[i].result,
+                          reqs[i].scratch);
+    if (s.ok()) {
+      s = reqs[i].status;
+    }
+  }
+  return s;
+}
+
+// Ranges closer than it are read together by MultiRead
+const uint64_t kMultiReadMaxGap = 4096;
+// Upper bound of one coalesced read
+const uint64_t kMultiReadMaxSize = 1024 * 1024;
+
+class PosixRandomAccessFile : public RandomAccessFile {
+ private:
+  std::string filename_;
+  int fd_;
+  IOFileType type_;
+
+ public:
+  PosixRandomAccessFile(const std::string& fname, int fd)
+      : filename_(fname), fd_(fd), type_(GetIOFileType(fname)) {
+  }
+
+  virtual ~PosixRandomAccessFile() {
+    close(fd_);
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const override {
+    ssize_t r = PreadFully(type_, fd_, scratch, n, offset);
+    if (r < 0) {
+      *result = Slice(scratch, 0);
+      return IOError(filename_, errno);
+    }
+    *result = Slice(scratch, r);
+    return Status::OK();
+  }
+
+  // Sort the ranges by offset, and read the adjacent or overlapped ones
+  // with one pread into a temporary buffer
+  virtual Status MultiRead(ReadRequest* reqs, size_t num) const override {
+    std::vector<ReadRequest*> sorted(num);
+    for (size_t i = 0; i < num; i++) {
+      sorted[i] = &reqs[i];
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const ReadRequest* a, const ReadRequest* b) {
+                return a->offset < b->offset;
+              });
+
+    Status s;
+    std::string buf;
+    size_t i = 0;
+    while (i < num) {
+      uint64_t start = sorted[i]->offset;
+      uint64_t end = start + sorted[i]->len;
+      size_t j = i + 1;
+      while (j < num && sorted[j]->offset <= end + kMultiReadMaxGap
+             && std::max(end, sorted[j]->offset + sorted[j]->len) - start
+                <= kMultiReadMaxSize) {
+        end = std::max(end, sorted[j]->offset + sorted[j]->len);
+        j++;
+      }
+
+      if (j == i + 1) {
+        ReadRequest* req = sorted[i];
+        req->status = Read(req->offset, req->len, &req->result, req->scratch);
+        if (s.ok()) {
+          s = req->status;
+        }
+        i = j;
+        continue;
       }
+
+      buf.resize(end - start);
+      ssize_t r = PreadFully(type_, fd_, &buf[0], buf.size(), start);
+      Status group = r < 0 ? IOError(filename_, errno) : Status::OK();
+      for (; i < j; i++) {
+        ReadRequest* req = sorted[i];
+        req->status = group;
+        size_t n = 0;
+        if (r > 0 && req->offset - start < static_cast<uint64_t>(r)) {
+          n = std::min<uint64_t>(req->len, r - (req->offset - start));
+          memcpy(req->scratch, buf.data() + (req->offset - start), n);
+        }
+        req->result = Slice(req->scratch, n);
+      }
+      if (s.ok()) {
+        s = group;
+      }
+    }
+    return s;
+  }
+};
+
+// Map the whole file read only, Read returns the data in the mapping
+class PosixMmapReadableFile : public RandomAccessFile {
+ private:
+  std::string filename_;
+  IOFileType type_;
+  char* base_;
+  size_t length_;
+
+ public:
+  // base[0,length-1] contains the mmapped contents of the file
+  PosixMmapReadableFile(const std::string& fname, char* base, size_t length)
+      : filename_(fname), type_(GetIOFileType(fname)),
+        base_(base), length_(length) {
+  }
+
+  virtual ~PosixMmapReadableFile() {
+    if (base_ != NULL) {
+      StatsMunmap(type_, base_, length_);
+    }
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const override {
+    if (offset >= length_) {
+      *result = Slice(base_, 0);
+    } else {
+      *result = Slice(base_ + offset, std::min<uint64_t>(n, length_ - offset));
+    }
+    IOStatsAddBytes(type_, result->size(), 0);
+    return Status::OK();
+  }
+};
+
+static int AccessPatternAdvice(EnvOptions::AccessPattern pattern,
+                               bool madvise) {
+  switch (pattern) {
+    case EnvOptions::kRandom:
+      return madvise ? MADV_RANDOM : POSIX_FADV_RANDOM;
+    case EnvOptions::kSequential:
+      return madvise ? MADV_SEQUENTIAL : POSIX_FADV_SEQUENTIAL;
+    case EnvOptions::kWillNeed:
+      return madvise ? MADV_WILLNEED : POSIX_FADV_WILLNEED;
+    default:
+      return madvise ? MADV_NORMAL : POSIX_FADV_NORMAL;
+  }
+}
+
+// The binlog manifest and consumer files expect 64KB at least
+const uint64_t kRWFileMinSize = 65536;
+
+// Reserve the address space of rw_file_reserved_size with an inaccessible
+// anonymous mapping, and map the file over the start of it, so the file
+// grows or shrinks in place by mapping or unmapping its tail
+class MmapRWFile : public RWFile {
+ private:
+  std::string filename_;
+  int fd_;
+  IOFileType type_;
+  size_t page_size_;
+  char* base_;
+  size_t reserved_;
+  size_t mapped_;    // Size of the file mapping, page aligned
+  uint64_t size_;
+
+  static size_t Roundup(size_t x, size_t y) {
+    return ((x + y - 1) / y) * y;
+  }
+
+  // Give [offset, mapped_) back to the reservation
+  bool Unmap(size_t offset) {
+    if (offset >= mapped_) {
+      return true;
+    }
+    void* ptr = mmap(base_ + offset, mapped_ - offset, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                     -1, 0);
+    if (ptr == MAP_FAILED) {
+      return false;
     }
+    mapped_ = offset;
+    return true;
+  }
 
-    if (close(fd_) < 0) {
-      if (s.ok()) {
-        s = IOError(filename_, errno);
+  // Map the file up to size, which is allocated first so writes through
+  // the mapping never hit SIGBUS for lack of space
+  Status Map(uint64_t size) {
+    size_t end = Roundup(size, page_size_);
+    if (end > reserved_) {
+      return Status::InvalidArgument(filename_, "exceeds the reserved size");
+    }
+    if (size > size_ && StatsFallocate(type_, fd_, size_, size - size_) != 0) {
+      return IOError(filename_, errno);
+    }
+    if (end > mapped_) {
+      void* ptr = StatsMmap(type_, base_ + mapped_, end - mapped_,
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                            fd_, mapped_);
+      if (ptr == MAP_FAILED) {
+        return IOError(filename_, errno);
       }
+      mapped_ = end;
     }
-
-    fd_ = -1;
-    base_ = NULL;
-    limit_ = NULL;
-    return s;
-  }
-
-  virtual Status Flush() {
+    size_ = size;
     return Status::OK();
   }
 
-  virtual Status Sync() {
-    Status s;
+ public:
+  MmapRWFile(const std::string& fname, int fd, size_t page_size)
+    : filename_(fname),
+      fd_(fd),
+      type_(GetIOFileType(fname)),
+      page_size_(page_size),
+      base_(NULL),
+      reserved_(0),
+      mapped_(0),
+      size_(0) {
+  }
 
-    if (pending_sync_) {
-      // Some unmapped data was not synced
-      pending_sync_ = false;
-      if (fdatasync(fd_) < 0) {
-        s = IOError(filename_, errno);
-      }
+  virtual ~MmapRWFile() {
+    if (base_ != NULL) {
+      StatsMunmap(type_, base_, reserved_);
     }
+    close(fd_);
+  }
 
-    if (dst_ > last_sync_) {
-      // Find the beginnings of the pages that contain the first and last
-      // bytes to be synced.
-      size_t p1 = TruncateToPageBoundary(last_sync_ - base_);
-      size_t p2 = TruncateToPageBoundary(dst_ - base_ - 1);
-      last_sync_ = dst_;
-      if (msync(base_ + p1, p2 - p1 + page_size_, MS_SYNC) < 0) {
-        s = IOError(filename_, errno);
-      }
+  // Reserve the address space and map the file, at least min_size
+  Status Open(uint64_t min_size, uint64_t reserved_size) {
+    struct stat sbuf;
+    if (fstat(fd_, &sbuf) < 0) {
+      return IOError(filename_, errno);
+    }
+    size_ = sbuf.st_size;
+    uint64_t size = std::max<uint64_t>(size_, min_size);
+    reserved_ = Roundup(std::max(reserved_size, size), page_size_);
+    void* ptr = mmap(NULL, reserved_, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+      return IOError(filename_, errno);
     }
+    base_ = static_cast<char*>(ptr);
+    return Map(size);
+  }
 
-    return s;
+  virtual char* GetData() override {
+    return base_;
   }
 
-  virtual Status Trim(uint64_t target) {
-    if (!UnmapCurrentRegion()) {
+  virtual uint64_t Size() override {
+    return size_;
+  }
+
+  virtual Status Resize(uint64_t size) override {
+    if (size >= size_) {
+      return Map(size);
+    }
+    if (!Unmap(Roundup(size, page_size_))) {
       return IOError(filename_, errno);
     }
-
-    file_offset_ = target;
-
-    if (!MapNewRegion()) {
+    if (ftruncate(fd_, size) < 0) {
       return IOError(filename_, errno);
     }
+    size_ = size;
     return Status::OK();
   }
 
-  virtual uint64_t Filesize() {
-    return write_len_ + file_offset_ + (dst_ - base_);
+  virtual Status Sync(uint64_t offset, uint64_t len) override {
+    if (offset >= size_ || len == 0) {
+      return Status::OK();
+    }
+    uint64_t end = std::min(offset + len, size_);
+    offset -= offset % page_size_;
+    if (StatsMsync(type_, base_ + offset, end - offset, MS_SYNC) < 0) {
+      return IOError(filename_, errno);
+    }
+    return Status::OK();
   }
 };
 
-
-RWFile::~RWFile() {
-}
-
-class MmapRWFile : public RWFile
-{
- public:
-   MmapRWFile(const std::string& fname, int fd, size_t page_size)
-     : filename_(fname),
-     fd_(fd),
-     page_size_(page_size),
-     map_size_(Roundup(65536, page_size)),
-     base_(NULL) {
-       DoMapRegion();
-     }
-
-   ~MmapRWFile() {
-     if (fd_ >= 0) {
-       munmap(base_, map_size_);
-     }
-   }
-
-   bool DoMapRegion() {
-     if (posix_fallocate(fd_, 0, map_size_) != 0) {
-       return false;
-     }
-     void* ptr = mmap(NULL, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
-     if (ptr == MAP_FAILED) {
-       return false;
-     }
-     base_ = reinterpret_cast<char*>(ptr);
-     return true;
-   }
-
-   char* GetData() { return base_; }
-   char* base() { return base_; }
-
- private:
-   static size_t Roundup(size_t x, size_t y) {
-     return ((x + y - 1) / y) * y;
-   }
-   std::string filename_;
-   int fd_;
-   size_t page_size_;
-   size_t map_size_;
-   char* base_;
-};
-
 class PosixRandomRWFile : public RandomRWFile {
  private:
    const std::string filename_;
    int fd_;
+   IOFileType type_;
    bool pending_sync_;
    bool pending_fsync_;
-   //bool fallocate_with_keep_size_;
 
  public:
    PosixRandomRWFile(const std::string& fname, int fd)
      : filename_(fname),
      fd_(fd),
+     type_(GetIOFileType(fname)),
      pending_sync_(false),
      pending_fsync_(false) {
-       //fallocate_with_keep_size_ = options.fallocate_with_keep_size;
      }
 
    ~PosixRandomRWFile() {
@@ -667,7 +2894,7 @@ class PosixRandomRWFile : public RandomRWFile {
      pending_fsync_ = true;
 
      while (left != 0) {
-       ssize_t done = pwrite(fd_, src, left, offset);
+       ssize_t done = StatsPwrite(type_, fd_, src, left, offset);
        if (done < 0) {
          if (errno == EINTR) {
          continue;
@@ -690,7 +2917,7 @@ class PosixRandomRWFile : public RandomRWFile {
    size_t left = n;
    char* ptr = scratch;
    while (left > 0) {
-     r = pread(fd_, ptr, left, static_cast<off_t>(offset));
+     r = StatsPread(type_, fd_, ptr, left, offset);
      if (r <= 0) {
        if (errno == EINTR) {
          continue;
@@ -718,7 +2945,7 @@ class PosixRandomRWFile : public RandomRWFile {
  }
 
  virtual Status Sync() override {
-   if (pending_sync_ && fdatasync(fd_) < 0) {
+   if (pending_sync_ && StatsFdatasync(type_, fd_) < 0) {
      return IOError(filename_, errno);
    }
    pending_sync_ = false;
@@ -726,7 +2953,7 @@ class PosixRandomRWFile : public RandomRWFile {
  }
 
  virtual Status Fsync() override {
-   if (pending_fsync_ && fsync(fd_) < 0) {
+   if (pending_fsync_ && StatsFsync(type_, fd_) < 0) {
      return IOError(filename_, errno);
    }
    pending_fsync_ = false;
@@ -734,61 +2961,307 @@ class PosixRandomRWFile : public RandomRWFile {
    return Status::OK();
  }
 
-//  virtual Status Allocate(off_t offset, off_t len) override {
-//    TEST_KILL_RANDOM(rocksdb_kill_odds);
-//    int alloc_status = fallocate(
-//        fd_, fallocate_with_keep_size_ ? FALLOC_FL_KEEP_SIZE : 0, offset, len);
-//    if (alloc_status == 0) {
-//      return Status::OK();
-//    } else {
-//      return IOError(filename_, errno);
-//    }
-//  }
+ virtual Status PrepareRead(uint64_t offset, size_t n, char* scratch,
+                            IORequest* req) const override {
+   req->op = IORequest::kRead;
+   req->fd = fd_;
+   req->offset = offset;
+   req->buf = scratch;
+   req->len = n;
+   return Status::OK();
+ }
+
+ virtual Status PrepareWrite(uint64_t offset, const Slice& data,
+                             IORequest* req) override {
+   pending_sync_ = true;
+   pending_fsync_ = true;
+   req->op = IORequest::kWrite;
+   req->fd = fd_;
+   req->offset = offset;
+   req->buf = const_cast<char*>(data.data());
+   req->len = data.size();
+   return Status::OK();
+ }
+
+ virtual Status PrepareSync(IORequest* req) override {
+   pending_sync_ = false;
+   req->op = IORequest::kFdatasync;
+   req->fd = fd_;
+   return Status::OK();
+ }
+
+  virtual Status Allocate(off_t offset, off_t len) override {
+    if (StatsFallocateMode(type_, fd_, FALLOC_FL_KEEP_SIZE, offset,
+                           len) < 0) {
+      return FallocateError(errno);
+    }
+    return Status::OK();
+  }
+
+  virtual Status Prefetch(uint64_t offset, uint64_t len) override {
+    int ret = StatsFadvise(type_, fd_, offset, len, POSIX_FADV_WILLNEED);
+    if (ret != 0) {
+      return IOError(filename_, ret);
+    }
+    return Status::OK();
+  }
+
+  virtual Status PunchHole(uint64_t offset, uint64_t len) override {
+    if (StatsFallocateMode(type_, fd_,
+                           FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           offset, len) < 0) {
+      return FallocateError(errno);
+    }
+    return Status::OK();
+  }
+
+  virtual Status RangeSync(uint64_t offset, uint64_t len) override {
+    if (StatsSyncFileRange(type_, fd_, offset, len,
+                           SYNC_FILE_RANGE_WAIT_BEFORE
+                           | SYNC_FILE_RANGE_WRITE
+                           | SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+      return IOError(filename_, errno);
+    }
+    return Status::OK();
+  }
+
+ private:
+  Status FallocateError(int err) const {
+    if (err == EOPNOTSUPP || err == ENOSYS) {
+      return Status::NotSupported("fallocate", filename_);
+    }
+    return IOError(filename_, err);
+  }
+};
+
+/*
+ * Request the bytes written or read from the RateLimiter of the options.
+ * Writes are charged before they are issued, reads are charged what they
+ * returned so that short reads at the end of file are not overcharged
+ */
+class RateLimitedWritableFile : public WritableFile {
+ public:
+  RateLimitedWritableFile(WritableFile* file, RateLimiter* limiter,
+                          IOPriority priority)
+    : file_(file), limiter_(limiter), priority_(priority) {
+  }
+
+  virtual ~RateLimitedWritableFile() {
+    delete file_;
+  }
+
+  virtual Status Append(const Slice& data) override {
+    limiter_->Request(data.size(), priority_);
+    return file_->Append(data);
+  }
+
+  virtual Status Close() override {
+    return file_->Close();
+  }
+
+  virtual Status Flush() override {
+    return file_->Flush();
+  }
+
+  virtual Status Sync() override {
+    return file_->Sync();
+  }
+
+  virtual Status Trim(uint64_t offset) override {
+    return file_->Trim(offset);
+  }
+
+  virtual uint64_t Filesize() override {
+    return file_->Filesize();
+  }
+
+ private:
+  WritableFile* file_;
+  RateLimiter* limiter_;
+  IOPriority priority_;
+};
+
+class RateLimitedSequentialFile : public SequentialFile {
+ public:
+  RateLimitedSequentialFile(SequentialFile* file, RateLimiter* limiter,
+                            IOPriority priority)
+    : file_(file), limiter_(limiter), priority_(priority) {
+  }
+
+  virtual ~RateLimitedSequentialFile() {
+    delete file_;
+  }
+
+  virtual Status Read(size_t n, Slice* result, char* scratch) override {
+    Status s = file_->Read(n, result, scratch);
+    // The last read before EndFile also returns data
+    if (s.ok() || s.IsEndFile()) {
+      limiter_->Request(result->size(), priority_);
+    }
+    return s;
+  }
+
+  virtual Status Skip(uint64_t n) override {
+    return file_->Skip(n);
+  }
+
+  virtual void DropBuffer() override {
+    file_->DropBuffer();
+  }
+
+  virtual char* ReadLine(char* buf, int n) override {
+    char* line = file_->ReadLine(buf, n);
+    if (line != NULL) {
+      limiter_->Request(strlen(line), priority_);
+    }
+    return line;
+  }
+
+ private:
+  SequentialFile* file_;
+  RateLimiter* limiter_;
+  IOPriority priority_;
 };
 
-Status NewSequentialFile(const std::string& fname, SequentialFile** result) {
-  FILE* f = fopen(fname.c_str(), "r");
-  if (f == NULL) {
+static WritableFile* MaybeRateLimited(WritableFile* file,
+                                      const EnvOptions& options) {
+  if (file == NULL || options.rate_limiter == NULL) {
+    return file;
+  }
+  return new RateLimitedWritableFile(file, options.rate_limiter,
+                                     options.rate_limiter_priority);
+}
+
+static Status OpenSequentialFile(const std::string& fname,
+                                 SequentialFile** result,
+                                 const EnvOptions& options) {
+  if (options.use_direct_reads) {
+    bool direct;
+    int fd = OpenDirect(fname, O_RDONLY, &direct);
+    if (fd < 0) {
+      *result = NULL;
+      return IOError(fname, errno);
+    }
+    *result = new PosixSequentialFile(fname, fd, direct, options);
+    return Status::OK();
+  }
+  int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
     *result = NULL;
     return IOError(fname, errno);
-  } else {
-    *result = new PosixSequentialFile(fname, f);
-    return Status::OK();
   }
+  *result = new PosixSequentialFile(fname, fd, false, options);
+  return Status::OK();
+}
+
+Status NewSequentialFile(const std::string& fname, SequentialFile** result,
+                         const EnvOptions& options) {
+  Status s = OpenSequentialFile(fname, result, options);
+  if (s.ok() && options.rate_limiter != NULL) {
+    *result = new RateLimitedSequentialFile(*result, options.rate_limiter,
+                                            options.rate_limiter_priority);
+  }
+  return s;
 }
 
-Status NewWritableFile(const std::string& fname, WritableFile** result) {
+static Status OpenWritableFile(const std::string& fname, WritableFile** result,
+                               const EnvOptions& options) {
+  if (options.use_direct_writes) {
+    bool direct;
+    int fd = OpenDirect(fname, O_CREAT | O_RDWR | O_TRUNC, &direct);
+    if (fd < 0) {
+      *result = NULL;
+      return IOError(fname, errno);
+    }
+    *result = new DirectWritableFile(fname, fd, direct,
+                                     options.direct_io_buffer_size);
+    return Status::OK();
+  }
   Status s;
   const int fd = open(fname.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
   if (fd < 0) {
     *result = NULL;
     s = IOError(fname, errno);
+  } else if (options.use_async_writes) {
+    s = NewAsyncWritableFile(fname, fd, 0, options, result);
+  } else if (options.use_mmap_writes) {
+    *result = new PosixMmapFile(fname, fd, kPageSize, 0, options);
   } else {
-    *result = new PosixMmapFile(fname, fd, kPageSize);
+    *result = new PosixWritableFile(fname, fd,
+                                    options.writable_file_buffer_size, 0,
+                                    options.bytes_per_sync);
   }
   return s;
 }
 
-Status NewRWFile(const std::string& fname, RWFile** result) {
-  Status s;
+Status NewWritableFile(const std::string& fname, WritableFile** result,
+                       const EnvOptions& options) {
+  Status s = OpenWritableFile(fname, result, options);
+  if (s.ok()) {
+    *result = MaybeRateLimited(*result, options);
+  }
+  return s;
+}
+
+Status NewRWFile(const std::string& fname, RWFile** result,
+                 const EnvOptions& options) {
+  *result = NULL;
   const int fd = open(fname.c_str(), O_CREAT | O_RDWR, 0644);
   if (fd < 0) {
-    *result = NULL;
-    s = IOError(fname, errno);
-  } else {
-    *result = new MmapRWFile(fname, fd, kPageSize);
+    return IOError(fname, errno);
+  }
+  MmapRWFile* file = new MmapRWFile(fname, fd, kPageSize);
+  Status s = file->Open(kRWFileMinSize, options.rw_file_reserved_size);
+  if (!s.ok()) {
+    delete file;
+    return s;
   }
+  *result = file;
   return s;
 }
 
-Status AppendWritableFile(const std::string& fname, WritableFile** result, uint64_t write_len) {
+static Status OpenAppendWritableFile(const std::string& fname,
+                                    WritableFile** result, uint64_t write_len,
+                                    const EnvOptions& options) {
+  if (options.use_direct_writes) {
+    bool direct;
+    int fd = OpenDirect(fname, O_RDWR, &direct);
+    if (fd < 0) {
+      *result = NULL;
+      return IOError(fname, errno);
+    }
+    DirectWritableFile* file = new DirectWritableFile(
+        fname, fd, direct, options.direct_io_buffer_size);
+    Status s = file->Reset(write_len);
+    if (!s.ok()) {
+      delete file;
+      file = NULL;
+    }
+    *result = file;
+    return s;
+  }
   Status s;
   const int fd = open(fname.c_str(), O_RDWR, 0644);
   if (fd < 0) {
     *result = NULL;
     s = IOError(fname, errno);
+  } else if (options.use_async_writes) {
+    s = NewAsyncWritableFile(fname, fd, write_len, options, result);
+  } else if (options.use_mmap_writes) {
+    *result = new PosixMmapFile(fname, fd, kPageSize, write_len, options);
   } else {
-    *result = new PosixMmapFile(fname, fd, kPageSize, write_len);
+    *result = new PosixWritableFile(fname, fd,
+                                    options.writable_file_buffer_size,
+                                    write_len, options.bytes_per_sync);
+  }
+  return s;
+}
+
+Status AppendWritableFile(const std::string& fname, WritableFile** result,
+                          uint64_t write_len, const EnvOptions& options) {
+  Status s = OpenAppendWritableFile(fname, result, write_len, options);
+  if (s.ok()) {
+    *result = MaybeRateLimited(*result, options);
   }
   return s;
 }
@@ -805,4 +3278,162 @@ Status NewRandomRWFile(const std::string& fname, RandomRWFile** result) {
   return s;
 }
 
+Status NewRandomAccessFile(const std::string& fname, RandomAccessFile** result,
+                           const EnvOptions& options) {
+  *result = NULL;
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return IOError(fname, errno);
+  }
+  if (!options.use_mmap_reads) {
+    if (options.access_pattern != EnvOptions::kNormal) {
+      posix_fadvise(fd, 0, 0,
+                    AccessPatternAdvice(options.access_pattern, false));
+    }
+    *result = new PosixRandomAccessFile(fname, fd);
+    return Status::OK();
+  }
+
+  Status s;
+  struct stat sbuf;
+  if (fstat(fd, &sbuf) < 0) {
+    s = IOError(fname, errno);
+  } else if (sbuf.st_size == 0) {
+    // Nothing to map
+    *result = new PosixMmapReadableFile(fname, NULL, 0);
+  } else {
+    size_t size = sbuf.st_size;
+    int flags = MAP_SHARED;
+    if (options.populate_mmap_reads) {
+      flags |= MAP_POPULATE;
+    }
+    void* base = StatsMmap(GetIOFileType(fname), NULL, size, PROT_READ,
+                           flags, fd, 0);
+    if (base == MAP_FAILED) {
+      s = IOError(fname, errno);
+    } else {
+      if (options.access_pattern != EnvOptions::kNormal) {
+        madvise(base, size, AccessPatternAdvice(options.access_pattern, true));
+      }
+      *result = new PosixMmapReadableFile(fname, static_cast<char*>(base),
+                                          size);
+    }
+  }
+  // The mapping stays valid after the file is closed
+  close(fd);
+  return s;
+}
+
+Env::~Env() {
+}
+
+Status Env::WriteFileAtomic(const std::string& fname, const Slice& data,
+                            DirSyncBatcher* batcher) {
+  std::string tmp = fname + ".tmp";
+  WritableFile* file;
+  Status s = NewWritableFile(tmp, &file);
+  if (!s.ok()) {
+    return s;
+  }
+  s = file->Append(data);
+  if (s.ok()) {
+    s = file->Sync();
+  }
+  if (s.ok()) {
+    s = file->Close();
+  }
+  delete file;
+  if (s.ok() && RenameFile(tmp, fname) != 0) {
+    s = Status::IOError("rename failed", fname);
+  }
+  if (!s.ok()) {
+    DeleteFile(tmp);
+  }
+  return s;
+}
+
+class PosixEnv : public Env {
+ public:
+  PosixEnv() { }
+  virtual ~PosixEnv() { }
+
+  virtual Status NewSequentialFile(const std::string& fname,
+                                   SequentialFile** result,
+                                   const EnvOptions& options) override {
+    return slash::NewSequentialFile(fname, result, options);
+  }
+
+  virtual Status NewWritableFile(const std::string& fname,
+                                 WritableFile** result,
+                                 const EnvOptions& options) override {
+    return slash::NewWritableFile(fname, result, options);
+  }
+
+  virtual Status NewRWFile(const std::string& fname, RWFile** result,
+                           const EnvOptions& options) override {
+    return slash::NewRWFile(fname, result, options);
+  }
+
+  virtual Status AppendWritableFile(const std::string& fname,
+                                    WritableFile** result,
+                                    uint64_t write_len,
+                                    const EnvOptions& options) override {
+    return slash::AppendWritableFile(fname, result, write_len, options);
+  }
+
+  virtual Status NewRandomRWFile(const std::string& fname,
+                                 RandomRWFile** result) override {
+    return slash::NewRandomRWFile(fname, result);
+  }
+
+  virtual Status NewRandomAccessFile(const std::string& fname,
+                                     RandomAccessFile** result,
+                                     const EnvOptions& options) override {
+    return slash::NewRandomAccessFile(fname, result, options);
+  }
+
+  virtual bool FileExists(const std::string& path) override {
+    return slash::FileExists(path);
+  }
+
+  virtual int GetChildren(const std::string& dir,
+                          std::vector<std::string>& result) override {
+    return slash::GetChildren(dir, result);
+  }
+
+  virtual Status DeleteFile(const std::string& fname) override {
+    return slash::DeleteFile(fname);
+  }
+
+  virtual int RenameFile(const std::string& oldname,
+                         const std::string& newname) override {
+    return slash::RenameFile(oldname, newname);
+  }
+
+  virtual int CreateDir(const std::string& path) override {
+    return slash::CreateDir(path);
+  }
+
+  virtual Status WriteFileAtomic(const std::string& fname, const Slice& data,
+                                 DirSyncBatcher* batcher) override {
+    return slash::WriteFileAtomic(fname, data, batcher);
+  }
+
+  virtual uint64_t NowMicros() override {
+    return slash::NowMicros();
+  }
+};
+
+static Env* default_env;
+static OnceType default_env_once = PTHREAD_ONCE_INIT;
+
+static void InitDefaultEnv() {
+  default_env = new PosixEnv;
+}
+
+Env* Env::Default() {
+  InitOnce(&default_env_once, InitDefaultEnv);
+  return default_env;
+}
+
 }   // namespace slash
@@ -0,0 +1,442 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "slash/include/fault_injection_env.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace slash {
+
+class FaultWritableFile : public WritableFile {
+ public:
+  FaultWritableFile(FaultInjectionEnv* env, const std::string& fname,
+                    WritableFile* base)
+    : env_(env), fname_(fname), base_(base) {
+  }
+
+  virtual ~FaultWritableFile() {
+    env_->Closed(this);
+    delete base_;
+  }
+
+  virtual Status Append(const Slice& data) override {
+    Status s = env_->Inject(FaultInjectionEnv::kFaultWrite, fname_);
+    return s.ok() ? base_->Append(data) : s;
+  }
+
+  virtual Status Close() override {
+    return base_->Close();
+  }
+
+  virtual Status Flush() override {
+    return base_->Flush();
+  }
+
+  virtual Status Sync() override {
+    Status s = env_->Inject(FaultInjectionEnv::kFaultSync, fname_);
+    if (s.ok()) {
+      s = base_->Sync();
+    }
+    if (s.ok()) {
+      env_->Synced(fname_, base_->Filesize());
+    }
+    return s;
+  }
+
+  virtual Status Trim(uint64_t offset) override {
+    Status s = env_->Inject(FaultInjectionEnv::kFaultWrite, fname_);
+    return s.ok() ? base_->Trim(offset) : s;
+  }
+
+  virtual uint64_t Filesize() override {
+    return base_->Filesize();
+  }
+
+ private:
+  FaultInjectionEnv* env_;
+  std::string fname_;
+  WritableFile* base_;
+};
+
+class FaultRWFile : public RWFile {
+ public:
+  FaultRWFile(FaultInjectionEnv* env, const std::string& fname, RWFile* base)
+    : env_(env), fname_(fname), base_(base) {
+  }
+
+  virtual ~FaultRWFile() {
+    env_->Closed(this);
+    delete base_;
+  }
+
+  virtual char* GetData() override {
+    return base_->GetData();
+  }
+
+  virtual uint64_t Size() override {
+    return base_->Size();
+  }
+
+  virtual Status Resize(uint64_t size) override {
+    Status s = env_->Inject(FaultInjectionEnv::kFaultWrite, fname_);
+    return s.ok() ? base_->Resize(size) : s;
+  }
+
+  virtual Status Sync(uint64_t offset, uint64_t len) override {
+    Status s = env_->Inject(FaultInjectionEnv::kFaultSync, fname_);
+    if (s.ok()) {
+      s = base_->Sync(offset, len);
+    }
+    if (s.ok()) {
+      uint64_t size = base_->Size();
+      offset = std::min(offset, size);
+      len = std::min(len, size - offset);
+      env_->Synced(fname_, size, offset,
+                   Slice(base_->GetData() + offset, len));
+    }
+    return s;
+  }
+
+ private:
+  FaultInjectionEnv* env_;
+  std::string fname_;
+  RWFile* base_;
+};
+
+class FaultSequentialFile : public SequentialFile {
+ public:
+  FaultSequentialFile(FaultInjectionEnv* env, const std::string& fname,
+                      SequentialFile* base)
+    : env_(env), fname_(fname), base_(base) {
+  }
+
+  virtual ~FaultSequentialFile() {
+    delete base_;
+  }
+
+  virtual Status Read(size_t n, Slice* result, char* scratch) override {
+    Status s = env_->Inject(FaultInjectionEnv::kFaultRead, fname_);
+    if (!s.ok()) {
+      *result = Slice(scratch, 0);
+      return s;
+    }
+    return base_->Read(n, result, scratch);
+  }
+
+  virtual Status Skip(uint64_t n) override {
+    return base_->Skip(n);
+  }
+
+  virtual void DropBuffer() override {
+    base_->DropBuffer();
+  }
+
+  virtual char *ReadLine(char* buf, int n) override {
+    if (!env_->Inject(FaultInjectionEnv::kFaultRead, fname_).ok()) {
+      return NULL;
+    }
+    return base_->ReadLine(buf, n);
+  }
+
+ private:
+  FaultInjectionEnv* env_;
+  std::string fname_;
+  SequentialFile* base_;
+};
+
+class FaultRandomAccessFile : public RandomAccessFile {
+ public:
+  FaultRandomAccessFile(FaultInjectionEnv* env, const std::string& fname,
+                        RandomAccessFile* base)
+    : env_(env), fname_(fname), base_(base) {
+  }
+
+  virtual ~FaultRandomAccessFile() {
+    delete base_;
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const override {
+    Status s = env_->Inject(FaultInjectionEnv::kFaultRead, fname_);
+    if (!s.ok()) {
+      *result = Slice(scratch, 0);
+      return s;
+    }
+    return base_->Read(offset, n, result, scratch);
+  }
+
+ private:
+  FaultInjectionEnv* env_;
+  std::string fname_;
+  RandomAccessFile* base_;
+};
+
+FaultInjectionEnv::FaultInjectionEnv(Env* base)
+  : base_(base),
+    seed_(static_cast<unsigned int>(slash::NowMicros())) {
+  for (int i = 0; i < kFaultOpTotal; i++) {
+    probability_[i] = 0;
+    latency_[i] = 0;
+  }
+}
+
+FaultInjectionEnv::~FaultInjectionEnv() {
+}
+
+void FaultInjectionEnv::SetFailureProbability(FaultOp op, double probability) {
+  MutexLock l(&mu_);
+  probability_[op] = probability;
+}
+
+void FaultInjectionEnv::SetLatency(FaultOp op, uint64_t micros) {
+  MutexLock l(&mu_);
+  latency_[op] = micros;
+}
+
+Status FaultInjectionEnv::Inject(FaultOp op, const std::string& fname) {
+  uint64_t latency;
+  bool fail;
+  {
+    MutexLock l(&mu_);
+    latency = latency_[op];
+    fail = probability_[op] > 0
+      && rand_r(&seed_) < probability_[op] * (RAND_MAX + 1.0);
+  }
+  if (latency > 0) {
+    SleepForMicroseconds(latency);
+  }
+  if (fail) {
+    return Status::IOError(fname, "injected fault");
+  }
+  return Status::OK();
+}
+
+void FaultInjectionEnv::Synced(const std::string& fname, uint64_t size) {
+  MutexLock l(&mu_);
+  files_[fname].synced_size = size;
+}
+
+void FaultInjectionEnv::Synced(const std::string& fname, uint64_t size,
+                               uint64_t offset, const Slice& data) {
+  MutexLock l(&mu_);
+  std::string* synced = &files_[fname].synced;
+  synced->resize(size, '\0');
+  synced->replace(offset, data.size(), data.data(), data.size());
+}
+
+void FaultInjectionEnv::Closed(WritableFile* file) {
+  MutexLock l(&mu_);
+  writable_files_.erase(file);
+}
+
+void FaultInjectionEnv::Closed(RWFile* file) {
+  MutexLock l(&mu_);
+  rw_files_.erase(file);
+}
+
+Status FaultInjectionEnv::SyncAll() {
+  std::vector<WritableFile*> writable;
+  std::vector<RWFile*> rw;
+  {
+    MutexLock l(&mu_);
+    writable.assign(writable_files_.begin(), writable_files_.end());
+    rw.assign(rw_files_.begin(), rw_files_.end());
+  }
+  Status s;
+  for (size_t i = 0; i < writable.size() && s.ok(); i++) {
+    s = writable[i]->Sync();
+  }
+  for (size_t i = 0; i < rw.size() && s.ok(); i++) {
+    s = rw[i]->Sync(0, rw[i]->Size());
+  }
+  return s;
+}
+
+Status FaultInjectionEnv::DropUnsyncedData(uint64_t* bytes_dropped) {
+  MutexLock l(&mu_);
+  uint64_t dropped = 0;
+  std::map<std::string, FileState>::iterator it;
+  for (it = files_.begin(); it != files_.end(); ++it) {
+    const std::string& fname = it->first;
+    const FileState& state = it->second;
+    struct stat st;
+    if (stat(fname.c_str(), &st) != 0) {
+      continue;
+    }
+    if (!state.rw) {
+      if (static_cast<uint64_t>(st.st_size) > state.synced_size) {
+        dropped += st.st_size - state.synced_size;
+        if (truncate(fname.c_str(), state.synced_size) != 0) {
+          return Status::IOError(fname, strerror(errno));
+        }
+      }
+      continue;
+    }
+
+    // Count the bytes differing from the synced content
+    int fd = open(fname.c_str(), O_RDWR);
+    if (fd < 0) {
+      return Status::IOError(fname, strerror(errno));
+    }
+    std::string current(st.st_size, '\0');
+    ssize_t r = pread(fd, &current[0], current.size(), 0);
+    current.resize(std::max<ssize_t>(r, 0));
+    for (size_t i = 0; i < std::max(current.size(), state.synced.size());
+         i++) {
+      if (i >= current.size() || i >= state.synced.size()
+          || current[i] != state.synced[i]) {
+        dropped++;
+      }
+    }
+    bool ok = ftruncate(fd, state.synced.size()) == 0
+      && pwrite(fd, state.synced.data(), state.synced.size(), 0)
+        == static_cast<ssize_t>(state.synced.size());
+    int err = errno;
+    close(fd);
+    if (!ok) {
+      return Status::IOError(fname, strerror(err));
+    }
+  }
+  if (bytes_dropped != NULL) {
+    *bytes_dropped = dropped;
+  }
+  return Status::OK();
+}
+
+Status FaultInjectionEnv::NewSequentialFile(const std::string& fname,
+                                            SequentialFile** result,
+                                            const EnvOptions& options) {
+  SequentialFile* file;
+  Status s = base_->NewSequentialFile(fname, &file, options);
+  *result = s.ok() ? new FaultSequentialFile(this, fname, file) : NULL;
+  return s;
+}
+
+Status FaultInjectionEnv::NewWritableFile(const std::string& fname,
+                                          WritableFile** result,
+                                          const EnvOptions& options) {
+  WritableFile* file;
+  Status s = base_->NewWritableFile(fname, &file, options);
+  if (!s.ok()) {
+    *result = NULL;
+    return s;
+  }
+  *result = new FaultWritableFile(this, fname, file);
+  MutexLock l(&mu_);
+  FileState* state = &files_[fname];
+  state->rw = false;
+  // Truncated, which is assumed durable
+  state->synced_size = 0;
+  writable_files_.insert(*result);
+  return s;
+}
+
+Status FaultInjectionEnv::AppendWritableFile(const std::string& fname,
+                                             WritableFile** result,
+                                             uint64_t write_len,
+                                             const EnvOptions& options) {
+  WritableFile* file;
+  Status s = base_->AppendWritableFile(fname, &file, write_len, options);
+  if (!s.ok()) {
+    *result = NULL;
+    return s;
+  }
+  *result = new FaultWritableFile(this, fname, file);
+  MutexLock l(&mu_);
+  if (files_.find(fname) == files_.end()) {
+    // Existed before the env, all durable
+    FileState* state = &files_[fname];
+    state->rw = false;
+    state->synced_size = write_len;
+  }
+  writable_files_.insert(*result);
+  return s;
+}
+
+Status FaultInjectionEnv::NewRWFile(const std::string& fname, RWFile** result,
+                                    const EnvOptions& options) {
+  RWFile* file;
+  Status s = base_->NewRWFile(fname, &file, options);
+  if (!s.ok()) {
+    *result = NULL;
+    return s;
+  }
+  *result = new FaultRWFile(this, fname, file);
+  MutexLock l(&mu_);
+  if (files_.find(fname) == files_.end()) {
+    FileState* state = &files_[fname];
+    state->rw = true;
+    state->synced_size = 0;
+    state->synced.assign(file->GetData(), file->Size());
+  }
+  rw_files_.insert(*result);
+  return s;
+}
+
+Status FaultInjectionEnv::NewRandomRWFile(const std::string& fname,
+                                          RandomRWFile** result) {
+  return base_->NewRandomRWFile(fname, result);
+}
+
+Status FaultInjectionEnv::NewRandomAccessFile(const std::string& fname,
+                                              RandomAccessFile** result,
+                                              const EnvOptions& options) {
+  RandomAccessFile* file;
+  Status s = base_->NewRandomAccessFile(fname, &file, options);
+  *result = s.ok() ? new FaultRandomAccessFile(this, fname, file) : NULL;
+  return s;
+}
+
+bool FaultInjectionEnv::FileExists(const std::string& path) {
+  return base_->FileExists(path);
+}
+
+int FaultInjectionEnv::GetChildren(const std::string& dir,
+                                   std::vector<std::string>& result) {
+  return base_->GetChildren(dir, result);
+}
+
+Status FaultInjectionEnv::DeleteFile(const std::string& fname) {
+  Status s = base_->DeleteFile(fname);
+  if (s.ok()) {
+    MutexLock l(&mu_);
+    files_.erase(fname);
+  }
+  return s;
+}
+
+int FaultInjectionEnv::RenameFile(const std::string& oldname,
+                                  const std::string& newname) {
+  int ret = base_->RenameFile(oldname, newname);
+  if (ret == 0) {
+    MutexLock l(&mu_);
+    std::map<std::string, FileState>::iterator it = files_.find(oldname);
+    if (it != files_.end()) {
+      files_[newname] = it->second;
+      files_.erase(it);
+    } else {
+      files_.erase(newname);
+    }
+  }
+  return ret;
+}
+
+int FaultInjectionEnv::CreateDir(const std::string& path) {
+  return base_->CreateDir(path);
+}
+
+uint64_t FaultInjectionEnv::NowMicros() {
+  return base_->NowMicros();
+}
+
+}  // namespace slash
@@ -0,0 +1,215 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "slash/include/file_cache.h"
+
+#include <assert.h>
+
+#include <functional>
+#include <unordered_map>
+
+#include "slash/include/slash_mutex.h"
+
+namespace slash {
+
+struct FileCache::Handle {
+  std::string fname;
+  RandomAccessFile* file;
+  Shard* shard;
+  // Guarded by the mutex of shard
+  uint32_t refs;
+  bool in_cache;
+  Handle* prev;   // LRU list of the idle handles
+  Handle* next;
+};
+
+struct FileCache::Shard {
+  Mutex mu;
+  std::unordered_map<std::string, Handle*> table;
+  // Dummy head of the LRU list, lru.next is the least recently used
+  Handle lru;
+
+  Shard() {
+    lru.prev = &lru;
+    lru.next = &lru;
+  }
+
+  void LRURemove(Handle* h) {
+    h->prev->next = h->next;
+    h->next->prev = h->prev;
+  }
+
+  void LRUAppend(Handle* h) {
+    h->next = &lru;
+    h->prev = lru.prev;
+    h->prev->next = h;
+    h->next->prev = h;
+  }
+};
+
+FileCache::FileCache(size_t capacity, int num_shard_bits, Env* env,
+                     const EnvOptions& options)
+  : capacity_(capacity),
+    num_shard_bits_(num_shard_bits),
+    env_(env),
+    options_(options),
+    shards_(new Shard[1 << num_shard_bits]),
+    open_(0) {
+}
+
+FileCache::~FileCache() {
+  for (int i = 0; i < (1 << num_shard_bits_); i++) {
+    std::unordered_map<std::string, Handle*>::iterator it;
+    for (it = shards_[i].table.begin(); it != shards_[i].table.end(); ++it) {
+      assert(it->second->refs == 0);
+      delete it->second->file;
+      delete it->second;
+    }
+  }
+  delete[] shards_;
+}
+
+FileCache::Shard* FileCache::GetShard(const std::string& fname) {
+  size_t hash = std::hash<std::string>()(fname);
+  return &shards_[hash & ((1 << num_shard_bits_) - 1)];
+}
+
+Status FileCache::Lookup(const std::string& fname, Handle** handle) {
+  Shard* shard = GetShard(fname);
+  {
+    MutexLock l(&shard->mu);
+    std::unordered_map<std::string, Handle*>::iterator it =
+      shard->table.find(fname);
+    if (it != shard->table.end()) {
+      Handle* h = it->second;
+      if (h->refs++ == 0) {
+        shard->LRURemove(h);
+      }
+      *handle = h;
+      return Status::OK();
+    }
+  }
+
+  // Take a slot of capacity before opening
+  size_t n = open_.load();
+  while (true) {
+    if (n < capacity_) {
+      if (open_.compare_exchange_weak(n, n + 1)) {
+        break;
+      }
+    } else if (EvictOne(shard)) {
+      n = open_.load();
+    } else {
+      return Status::Incomplete("too many open files", fname);
+    }
+  }
+
+  RandomAccessFile* file;
+  Status s = env_->NewRandomAccessFile(fname, &file, options_);
+  if (!s.ok()) {
+    open_--;
+    return s;
+  }
+
+  MutexLock l(&shard->mu);
+  std::unordered_map<std::string, Handle*>::iterator it =
+    shard->table.find(fname);
+  if (it != shard->table.end()) {
+    // Opened by another thread meanwhile
+    delete file;
+    open_--;
+    Handle* h = it->second;
+    if (h->refs++ == 0) {
+      shard->LRURemove(h);
+    }
+    *handle = h;
+    return Status::OK();
+  }
+  Handle* h = new Handle;
+  h->fname = fname;
+  h->file = file;
+  h->shard = shard;
+  h->refs = 1;
+  h->in_cache = true;
+  h->prev = NULL;
+  h->next = NULL;
+  shard->table[fname] = h;
+  *handle = h;
+  return Status::OK();
+}
+
+RandomAccessFile* FileCache::Value(Handle* handle) {
+  return handle->file;
+}
+
+void FileCache::Release(Handle* handle) {
+  Shard* shard = handle->shard;
+  MutexLock l(&shard->mu);
+  Unref(shard, handle);
+}
+
+// The mutex of shard should be held
+void FileCache::Unref(Shard* shard, Handle* handle) {
+  assert(handle->refs > 0);
+  if (--handle->refs > 0) {
+    return;
+  }
+  if (handle->in_cache) {
+    shard->LRUAppend(handle);
+  } else {
+    delete handle->file;
+    delete handle;
+    open_--;
+  }
+}
+
+bool FileCache::EvictOne(Shard* shard) {
+  int num_shards = 1 << num_shard_bits_;
+  int start = shard - shards_;
+  for (int i = 0; i < num_shards; i++) {
+    Shard* s = &shards_[(start + i) % num_shards];
+    Handle* victim = NULL;
+    {
+      MutexLock l(&s->mu);
+      if (s->lru.next != &s->lru) {
+        victim = s->lru.next;
+        s->LRURemove(victim);
+        s->table.erase(victim->fname);
+      }
+    }
+    if (victim != NULL) {
+      delete victim->file;
+      delete victim;
+      open_--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void FileCache::Evict(const std::string& fname) {
+  Shard* shard = GetShard(fname);
+  MutexLock l(&shard->mu);
+  std::unordered_map<std::string, Handle*>::iterator it =
+    shard->table.find(fname);
+  if (it == shard->table.end()) {
+    return;
+  }
+  Handle* h = it->second;
+  shard->table.erase(it);
+  h->in_cache = false;
+  if (h->refs == 0) {
+    shard->LRURemove(h);
+    delete h->file;
+    delete h;
+    open_--;
+  }
+}
+
+size_t FileCache::TotalOpen() const {
+  return open_.load();
+}
+
+}  // namespace slash
@@ -0,0 +1,478 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "slash/include/io_engine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <deque>
+
+#include "slash/include/xdebug.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define SLASH_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef SLASH_HAVE_IO_URING
+// Not defined by old C libraries, the numbers are the same on all
+// architectures using the generic syscall table
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+#endif
+
+namespace slash {
+
+static Status IOError(const std::string& context, int err_number) {
+  return Status::IOError(context, strerror(err_number));
+}
+
+// Consume the pending notifications, a completion after it signals again
+static void DrainEventfd(int fd) {
+  uint64_t value;
+  while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR) {
+  }
+}
+
+IOEngine::~IOEngine() {
+}
+
+Status IOEngine::Execute(IORequest* req) {
+  if (inflight() != 0) {
+    return Status::InvalidArgument("io engine is busy");
+  }
+  Status s = Prepare(req);
+  int n;
+  if (s.ok()) {
+    s = Submit(&n);
+  }
+  IORequest* done;
+  if (s.ok()) {
+    s = Reap(&done, 1, 1, &n);
+  }
+  if (s.ok() && req->result < 0) {
+    s = IOError("io engine", -req->result);
+  }
+  return s;
+}
+
+#ifdef SLASH_HAVE_IO_URING
+
+class UringEngine : public IOEngine {
+ public:
+  UringEngine()
+    : ring_fd_(-1),
+      event_fd_(-1),
+      sq_ptr_(MAP_FAILED),
+      sq_size_(0),
+      cq_ptr_(MAP_FAILED),
+      cq_size_(0),
+      sqes_(reinterpret_cast<struct io_uring_sqe*>(MAP_FAILED)),
+      sqes_size_(0),
+      to_submit_(0),
+      inflight_(0),
+      buffers_registered_(false) {
+  }
+
+  virtual ~UringEngine() {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+      munmap(cq_ptr_, cq_size_);
+    }
+    if (sq_ptr_ != MAP_FAILED) {
+      munmap(sq_ptr_, sq_size_);
+    }
+    if (ring_fd_ >= 0) {
+      close(ring_fd_);
+    }
+    if (event_fd_ >= 0) {
+      close(event_fd_);
+    }
+  }
+
+  Status Init(uint32_t queue_depth) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd_ = syscall(__NR_io_uring_setup, queue_depth, &p);
+    if (ring_fd_ < 0) {
+      return IOError("io_uring_setup", errno);
+    }
+    // IORING_OP_READ, IORING_OP_WRITE and IORING_OP_FALLOCATE come
+    // together with this feature in linux 5.6
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+      return Status::NotSupported("io_uring", "kernel is too old");
+    }
+
+    sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+    sq_ptr_ = mmap(NULL, sq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+      return IOError("mmap sq ring", errno);
+    }
+    if (single_mmap) {
+      cq_ptr_ = sq_ptr_;
+    } else {
+      cq_ptr_ = mmap(NULL, cq_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+      if (cq_ptr_ == MAP_FAILED) {
+        return IOError("mmap cq ring", errno);
+      }
+    }
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = reinterpret_cast<struct io_uring_sqe*>(
+        mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED) {
+      return IOError("mmap sqes", errno);
+    }
+
+    char* sq = static_cast<char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sq_entries_ = p.sq_entries;
+    char* cq = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    event_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd_ < 0) {
+      return IOError("eventfd", errno);
+    }
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_EVENTFD,
+                &event_fd_, 1) < 0) {
+      return IOError("io_uring_register eventfd", errno);
+    }
+    return Status::OK();
+  }
+
+  virtual bool IsUring() const override {
+    return true;
+  }
+
+  virtual int eventfd() const override {
+    return event_fd_;
+  }
+
+  virtual Status RegisterBuffers(
+      const std::vector<struct iovec>& buffers) override {
+    if (buffers_registered_) {
+      syscall(__NR_io_uring_register, ring_fd_, IORING_UNREGISTER_BUFFERS,
+              NULL, 0);
+      buffers_registered_ = false;
+    }
+    if (buffers.empty()) {
+      return Status::OK();
+    }
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS,
+                buffers.data(), buffers.size()) < 0) {
+      return IOError("io_uring_register buffers", errno);
+    }
+    buffers_registered_ = true;
+    return Status::OK();
+  }
+
+  virtual Status Prepare(IORequest* req) override {
+    unsigned tail = *sq_tail_;
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    // Bound the requests in flight too, so the completion queue,
+    // which is twice the size, never overflows
+    if (tail - head >= sq_entries_ || inflight_ >= sq_entries_) {
+      return Status::Incomplete("io_uring queue is full");
+    }
+    unsigned index = tail & sq_mask_;
+    struct io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = req->fd;
+    sqe->off = req->offset;
+    switch (req->op) {
+      case IORequest::kRead:
+      case IORequest::kWrite:
+        if (req->buf_index >= 0) {
+          sqe->opcode = req->op == IORequest::kRead ? IORING_OP_READ_FIXED
+                                                    : IORING_OP_WRITE_FIXED;
+          sqe->buf_index = req->buf_index;
+        } else {
+          sqe->opcode = req->op == IORequest::kRead ? IORING_OP_READ
+                                                    : IORING_OP_WRITE;
+        }
+        sqe->addr = reinterpret_cast<uintptr_t>(req->buf);
+        sqe->len = req->len;
+        break;
+      case IORequest::kFsync:
+      case IORequest::kFdatasync:
+        sqe->opcode = IORING_OP_FSYNC;
+        if (req->op == IORequest::kFdatasync) {
+          sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+        break;
+      case IORequest::kFallocate:
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->addr = req->len;
+        sqe->len = req->mode;
+        break;
+      default:
+        return Status::InvalidArgument("unknown io request");
+    }
+    sqe->user_data = reinterpret_cast<uintptr_t>(req);
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    to_submit_++;
+    inflight_++;
+    return Status::OK();
+  }
+
+  virtual Status Submit(int* submitted) override {
+    *submitted = 0;
+    while (to_submit_ > 0) {
+      int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit_, 0, 0,
+                        NULL, 0);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // EAGAIN or EBUSY, the rest is submitted by the next Submit or Reap
+        if (*submitted > 0 && (errno == EAGAIN || errno == EBUSY)) {
+          break;
+        }
+        return IOError("io_uring_enter", errno);
+      }
+      to_submit_ -= ret;
+      *submitted += ret;
+    }
+    return Status::OK();
+  }
+
+  virtual Status Reap(IORequest** done, int max, int min_complete,
+                      int* count) override {
+    *count = 0;
+    DrainEventfd(event_fd_);
+    while (*count < max) {
+      unsigned head = *cq_head_;
+      unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      while (head != tail && *count < max) {
+        struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+        IORequest* req = reinterpret_cast<IORequest*>(
+            static_cast<uintptr_t>(cqe->user_data));
+        req->result = cqe->res;
+        done[(*count)++] = req;
+        head++;
+        inflight_--;
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+      if (*count >= min_complete || inflight_ == 0) {
+        break;
+      }
+
+      int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit_,
+                        min_complete - *count, IORING_ENTER_GETEVENTS,
+                        NULL, 0);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return IOError("io_uring_enter", errno);
+      }
+      to_submit_ -= ret;
+    }
+    return Status::OK();
+  }
+
+  virtual uint32_t inflight() const override {
+    return inflight_;
+  }
+
+ private:
+  int ring_fd_;
+  int event_fd_;
+
+  void* sq_ptr_;
+  size_t sq_size_;
+  void* cq_ptr_;
+  size_t cq_size_;
+  struct io_uring_sqe* sqes_;
+  size_t sqes_size_;
+
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned* sq_array_;
+  unsigned sq_entries_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  struct io_uring_cqe* cqes_;
+
+  unsigned to_submit_;
+  uint32_t inflight_;
+  bool buffers_registered_;
+};
+
+#endif  // SLASH_HAVE_IO_URING
+
+// Run the requests synchronously on Submit, for the kernels without
+// io_uring or where it is disabled
+class SyncEngine : public IOEngine {
+ public:
+  explicit SyncEngine(uint32_t queue_depth)
+    : queue_depth_(queue_depth),
+      event_fd_(-1) {
+  }
+
+  virtual ~SyncEngine() {
+    if (event_fd_ >= 0) {
+      close(event_fd_);
+    }
+  }
+
+  Status Init() {
+    event_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd_ < 0) {
+      return IOError("eventfd", errno);
+    }
+    return Status::OK();
+  }
+
+  virtual bool IsUring() const override {
+    return false;
+  }
+
+  virtual int eventfd() const override {
+    return event_fd_;
+  }
+
+  virtual Status RegisterBuffers(
+      const std::vector<struct iovec>& buffers) override {
+    return Status::OK();
+  }
+
+  virtual Status Prepare(IORequest* req) override {
+    if (inflight() >= queue_depth_) {
+      return Status::Incomplete("io queue is full");
+    }
+    prepared_.push_back(req);
+    return Status::OK();
+  }
+
+  virtual Status Submit(int* submitted) override {
+    *submitted = prepared_.size();
+    while (!prepared_.empty()) {
+      IORequest* req = prepared_.front();
+      prepared_.pop_front();
+      Run(req);
+      completed_.push_back(req);
+    }
+    if (*submitted > 0) {
+      uint64_t value = *submitted;
+      while (write(event_fd_, &value, sizeof(value)) < 0 && errno == EINTR) {
+      }
+    }
+    return Status::OK();
+  }
+
+  virtual Status Reap(IORequest** done, int max, int min_complete,
+                      int* count) override {
+    DrainEventfd(event_fd_);
+    *count = 0;
+    while (*count < max && !completed_.empty()) {
+      done[(*count)++] = completed_.front();
+      completed_.pop_front();
+    }
+    return Status::OK();
+  }
+
+  virtual uint32_t inflight() const override {
+    return prepared_.size() + completed_.size();
+  }
+
+ private:
+  static void Run(IORequest* req) {
+    ssize_t ret;
+    do {
+      switch (req->op) {
+        case IORequest::kRead:
+          ret = pread(req->fd, req->buf, req->len, req->offset);
+          break;
+        case IORequest::kWrite:
+          ret = pwrite(req->fd, req->buf, req->len, req->offset);
+          break;
+        case IORequest::kFsync:
+          ret = fsync(req->fd);
+          break;
+        case IORequest::kFdatasync:
+          ret = fdatasync(req->fd);
+          break;
+        case IORequest::kFallocate:
+          ret = fallocate(req->fd, req->mode, req->offset, req->len);
+          break;
+        default:
+          ret = -1;
+          errno = EINVAL;
+      }
+    } while (ret < 0 && errno == EINTR);
+    req->result = ret < 0 ? -errno : ret;
+  }
+
+  uint32_t queue_depth_;
+  int event_fd_;
+  std::deque<IORequest*> prepared_;
+  std::deque<IORequest*> completed_;
+};
+
+Status IOEngine::Open(uint32_t queue_depth, IOEngine** engine,
+                      bool force_fallback) {
+  *engine = NULL;
+  if (queue_depth == 0) {
+    return Status::InvalidArgument("queue depth should be positive");
+  }
+#ifdef SLASH_HAVE_IO_URING
+  if (!force_fallback) {
+    UringEngine* uring = new UringEngine;
+    Status s = uring->Init(queue_depth);
+    if (s.ok()) {
+      *engine = uring;
+      return s;
+    }
+    log_info("io_uring is unavailable, %s", s.ToString().c_str());
+    delete uring;
+  }
+#endif
+  SyncEngine* sync = new SyncEngine(queue_depth);
+  Status s = sync->Init();
+  if (s.ok()) {
+    *engine = sync;
+  } else {
+    delete sync;
+  }
+  return s;
+}
+
+}  // namespace slash
@@ -0,0 +1,154 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "slash/include/io_stats.h"
+
+#include <string.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <sstream>
+
+#include "slash/include/env.h"
+
+namespace slash {
+
+#ifndef SLASH_NIOSTATS
+__thread IOStatsLevel iostats_level = kIOStatsDisable;
+#endif
+
+static __thread IOStatsContext iostats_context;
+
+struct AtomicFileTypeIOStats {
+  std::atomic<uint64_t> bytes_read;
+  std::atomic<uint64_t> bytes_written;
+  std::atomic<uint64_t> syscalls;
+  std::atomic<uint64_t> nanos;
+};
+
+static AtomicFileTypeIOStats file_type_stats[kIOFileTypeCount];
+
+IOFileType GetIOFileType(const std::string& fname) {
+  size_t pos = fname.rfind('/');
+  std::string name = pos == std::string::npos ? fname : fname.substr(pos + 1);
+  if (name.compare(0, 6, "binlog") == 0) {
+    return kIOFileBinlog;
+  }
+  if (name == "manifest") {
+    return kIOFileManifest;
+  }
+  if (name.size() >= 5 && name.compare(name.size() - 5, 5, ".conf") == 0) {
+    return kIOFileConf;
+  }
+  return kIOFileOther;
+}
+
+const char* IOFileTypeName(IOFileType type) {
+  switch (type) {
+    case kIOFileBinlog:
+      return "binlog";
+    case kIOFileManifest:
+      return "manifest";
+    case kIOFileConf:
+      return "conf";
+    default:
+      return "other";
+  }
+}
+
+void IOStatsContext::Reset() {
+  memset(this, 0, sizeof(*this));
+}
+
+std::string IOStatsContext::ToString() const {
+  std::ostringstream ss;
+  ss << "bytes_read = " << bytes_read
+     << ", bytes_written = " << bytes_written
+     << ", syscalls = " << syscalls
+     << ", pread_nanos = " << pread_nanos
+     << ", pwrite_nanos = " << pwrite_nanos
+     << ", readahead_nanos = " << readahead_nanos
+     << ", msync_nanos = " << msync_nanos
+     << ", fdatasync_nanos = " << fdatasync_nanos
+     << ", range_sync_nanos = " << range_sync_nanos
+     << ", fallocate_nanos = " << fallocate_nanos
+     << ", mmap_nanos = " << mmap_nanos
+     << ", mmap_count = " << mmap_count
+     << ", munmap_count = " << munmap_count
+     << ", page_faults = " << page_faults;
+  return ss.str();
+}
+
+void SetIOStatsLevel(IOStatsLevel level) {
+#ifndef SLASH_NIOSTATS
+  iostats_level = level;
+#endif
+}
+
+IOStatsContext* GetIOStatsContext() {
+  return &iostats_context;
+}
+
+void GetFileTypeIOStats(IOFileType type, FileTypeIOStats* stats) {
+  AtomicFileTypeIOStats& s = file_type_stats[type];
+  stats->bytes_read = s.bytes_read.load(std::memory_order_relaxed);
+  stats->bytes_written = s.bytes_written.load(std::memory_order_relaxed);
+  stats->syscalls = s.syscalls.load(std::memory_order_relaxed);
+  stats->nanos = s.nanos.load(std::memory_order_relaxed);
+}
+
+void ResetFileTypeIOStats() {
+  for (int i = 0; i < kIOFileTypeCount; i++) {
+    file_type_stats[i].bytes_read.store(0, std::memory_order_relaxed);
+    file_type_stats[i].bytes_written.store(0, std::memory_order_relaxed);
+    file_type_stats[i].syscalls.store(0, std::memory_order_relaxed);
+    file_type_stats[i].nanos.store(0, std::memory_order_relaxed);
+  }
+}
+
+void RecordIOStatsBytes(IOFileType type, uint64_t read, uint64_t written) {
+  iostats_context.bytes_read += read;
+  iostats_context.bytes_written += written;
+  file_type_stats[type].bytes_read.fetch_add(read, std::memory_order_relaxed);
+  file_type_stats[type].bytes_written.fetch_add(written,
+                                                std::memory_order_relaxed);
+}
+
+uint64_t IOStatsRecorder::Now() {
+  return NowNanos();
+}
+
+void IOStatsRecorder::Record() {
+  uint64_t nanos = 0;
+  if (start_ != 0) {
+    nanos = Now() - start_;
+    iostats_context.*nanos_ += nanos;
+  }
+  iostats_context.bytes_read += read_;
+  iostats_context.bytes_written += written_;
+  iostats_context.syscalls++;
+
+  AtomicFileTypeIOStats& s = file_type_stats[type_];
+  if (read_ != 0) {
+    s.bytes_read.fetch_add(read_, std::memory_order_relaxed);
+  }
+  if (written_ != 0) {
+    s.bytes_written.fetch_add(written_, std::memory_order_relaxed);
+  }
+  s.syscalls.fetch_add(1, std::memory_order_relaxed);
+  if (nanos != 0) {
+    s.nanos.fetch_add(nanos, std::memory_order_relaxed);
+  }
+}
+
+uint64_t IOStatsFaultCounter::Faults() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_THREAD, &usage) != 0) {
+    return 0;
+  }
+  return usage.ru_minflt + usage.ru_majflt;
+}
+
+}  // namespace slash
@@ -0,0 +1,466 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "slash/include/env.h"
+#include "slash/include/slash_mutex.h"
+
+namespace slash {
+
+namespace {
+
+// Size of the data returned by RWFile::GetData, the same as MmapRWFile
+const size_t kMemRWFileSize = 65536;
+
+class FileState {
+ public:
+  FileState() : refs_(0) { }
+
+  void Ref() {
+    MutexLock l(&refs_mutex_);
+    ++refs_;
+  }
+
+  void Unref() {
+    bool do_delete = false;
+    {
+      MutexLock l(&refs_mutex_);
+      --refs_;
+      assert(refs_ >= 0);
+      if (refs_ <= 0) {
+        do_delete = true;
+      }
+    }
+    if (do_delete) {
+      delete this;
+    }
+  }
+
+  uint64_t Size() {
+    MutexLock l(&mutex_);
+    return data_.size();
+  }
+
+  void Truncate(uint64_t size) {
+    MutexLock l(&mutex_);
+    data_.resize(size, '\0');
+  }
+
+  Status Read(uint64_t offset, size_t n, Slice* result, char* scratch) {
+    MutexLock l(&mutex_);
+    if (offset > data_.size()) {
+      *result = Slice(scratch, 0);
+      return Status::OK();
+    }
+    size_t avail = data_.size() - offset;
+    if (n > avail) {
+      n = avail;
+    }
+    memcpy(scratch, data_.data() + offset, n);
+    *result = Slice(scratch, n);
+    return Status::OK();
+  }
+
+  void Append(const Slice& data) {
+    MutexLock l(&mutex_);
+    data_.append(data.data(), data.size());
+  }
+
+  void Write(uint64_t offset, const Slice& data) {
+    MutexLock l(&mutex_);
+    if (offset + data.size() > data_.size()) {
+      data_.resize(offset + data.size(), '\0');
+    }
+    memcpy(&data_[offset], data.data(), data.size());
+  }
+
+  // The returned buffer is stable as long as the file is not resized
+  // beyond capacity
+  char* Data(size_t min_size, size_t capacity) {
+    MutexLock l(&mutex_);
+    data_.reserve(capacity);
+    if (data_.size() < min_size) {
+      data_.resize(min_size, '\0');
+    }
+    return &data_[0];
+  }
+
+ private:
+  // Private since only Unref() should be used to delete it
+  ~FileState() { }
+
+  Mutex refs_mutex_;
+  int refs_;  // Protected by refs_mutex_
+
+  Mutex mutex_;
+  std::string data_;
+
+  // No copying allowed
+  FileState(const FileState&);
+  void operator=(const FileState&);
+};
+
+class MemSequentialFile : public SequentialFile {
+ public:
+  MemSequentialFile(const std::string& fname, FileState* file)
+    : filename_(fname), file_(file), pos_(0) {
+    file_->Ref();
+  }
+
+  virtual ~MemSequentialFile() {
+    file_->Unref();
+  }
+
+  virtual Status Read(size_t n, Slice* result, char* scratch) override {
+    Status s = file_->Read(pos_, n, result, scratch);
+    if (s.ok()) {
+      pos_ += result->size();
+      if (result->size() < n) {
+        s = Status::EndFile(filename_, "end file");
+      }
+    }
+    return s;
+  }
+
+  virtual Status Skip(uint64_t n) override {
+    pos_ += n;
+    return Status::OK();
+  }
+
+  virtual char *ReadLine(char* buf, int n) override {
+    if (n <= 0) {
+      return NULL;
+    }
+    int len = 0;
+    Slice result;
+    char c;
+    while (len < n - 1) {
+      if (!file_->Read(pos_, 1, &result, &c).ok() || result.size() == 0) {
+        break;
+      }
+      pos_++;
+      buf[len++] = c;
+      if (c == '\n') {
+        break;
+      }
+    }
+    if (len == 0) {
+      return NULL;
+    }
+    buf[len] = '\0';
+    return buf;
+  }
+
+ private:
+  std::string filename_;
+  FileState* file_;
+  uint64_t pos_;
+};
+
+class MemWritableFile : public WritableFile {
+ public:
+  explicit MemWritableFile(FileState* file)
+    : file_(file) {
+    file_->Ref();
+  }
+
+  virtual ~MemWritableFile() {
+    file_->Unref();
+  }
+
+  virtual Status Append(const Slice& data) override {
+    file_->Append(data);
+    return Status::OK();
+  }
+
+  virtual Status Close() override { return Status::OK(); }
+  virtual Status Flush() override { return Status::OK(); }
+  virtual Status Sync() override { return Status::OK(); }
+
+  virtual Status Trim(uint64_t offset) override {
+    file_->Truncate(offset);
+    return Status::OK();
+  }
+
+  virtual uint64_t Filesize() override {
+    return file_->Size();
+  }
+
+ private:
+  FileState* file_;
+};
+
+class MemRWFile : public RWFile {
+ public:
+  MemRWFile(FileState* file, uint64_t reserved_size)
+    : file_(file) {
+    file_->Ref();
+    reserved_ = std::max<uint64_t>(reserved_size, kMemRWFileSize);
+    reserved_ = std::max(reserved_, file_->Size());
+    data_ = file_->Data(kMemRWFileSize, reserved_);
+  }
+
+  virtual ~MemRWFile() {
+    file_->Unref();
+  }
+
+  virtual char* GetData() override { return data_; }
+
+  virtual uint64_t Size() override {
+    return file_->Size();
+  }
+
+  virtual Status Resize(uint64_t size) override {
+    if (size > reserved_) {
+      return Status::InvalidArgument("exceeds the reserved size");
+    }
+    file_->Truncate(size);
+    return Status::OK();
+  }
+
+  virtual Status Sync(uint64_t offset, uint64_t len) override {
+    return Status::OK();
+  }
+
+ private:
+  FileState* file_;
+  char* data_;
+  uint64_t reserved_;
+};
+
+class MemRandomRWFile : public RandomRWFile {
+ public:
+  explicit MemRandomRWFile(FileState* file)
+    : file_(file) {
+    file_->Ref();
+  }
+
+  virtual ~MemRandomRWFile() {
+    file_->Unref();
+  }
+
+  virtual Status Write(uint64_t offset, const Slice& data) override {
+    file_->Write(offset, data);
+    return Status::OK();
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const override {
+    return file_->Read(offset, n, result, scratch);
+  }
+
+  virtual Status Close() override { return Status::OK(); }
+  virtual Status Sync() override { return Status::OK(); }
+
+ private:
+  FileState* file_;
+};
+
+class MemRandomAccessFile : public RandomAccessFile {
+ public:
+  explicit MemRandomAccessFile(FileState* file)
+    : file_(file) {
+    file_->Ref();
+  }
+
+  virtual ~MemRandomAccessFile() {
+    file_->Unref();
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const override {
+    return file_->Read(offset, n, result, scratch);
+  }
+
+ private:
+  FileState* file_;
+};
+
+class MemEnv : public Env {
+ public:
+  MemEnv() { }
+
+  virtual ~MemEnv() {
+    for (FileSystem::iterator i = files_.begin(); i != files_.end(); ++i) {
+      i->second->Unref();
+    }
+  }
+
+  virtual Status NewSequentialFile(const std::string& fname,
+                                   SequentialFile** result,
+                                   const EnvOptions& options) override {
+    MutexLock l(&mutex_);
+    FileSystem::iterator it = files_.find(fname);
+    if (it == files_.end()) {
+      *result = NULL;
+      return Status::IOError(fname, "File not found");
+    }
+    *result = new MemSequentialFile(fname, it->second);
+    return Status::OK();
+  }
+
+  virtual Status NewWritableFile(const std::string& fname,
+                                 WritableFile** result,
+                                 const EnvOptions& options) override {
+    MutexLock l(&mutex_);
+    FileState* file = CreateFile(fname);
+    file->Truncate(0);
+    *result = new MemWritableFile(file);
+    return Status::OK();
+  }
+
+  virtual Status NewRWFile(const std::string& fname, RWFile** result,
+                           const EnvOptions& options) override {
+    MutexLock l(&mutex_);
+    *result = new MemRWFile(CreateFile(fname), options.rw_file_reserved_size);
+    return Status::OK();
+  }
+
+  virtual Status AppendWritableFile(const std::string& fname,
+                                    WritableFile** result,
+                                    uint64_t write_len,
+                                    const EnvOptions& options) override {
+    MutexLock l(&mutex_);
+    FileSystem::iterator it = files_.find(fname);
+    if (it == files_.end()) {
+      *result = NULL;
+      return Status::IOError(fname, "File not found");
+    }
+    // Continue writing at write_len, the same as PosixMmapFile
+    it->second->Truncate(write_len);
+    *result = new MemWritableFile(it->second);
+    return Status::OK();
+  }
+
+  virtual Status NewRandomRWFile(const std::string& fname,
+                                 RandomRWFile** result) override {
+    MutexLock l(&mutex_);
+    *result = new MemRandomRWFile(CreateFile(fname));
+    return Status::OK();
+  }
+
+  virtual Status NewRandomAccessFile(const std::string& fname,
+                                     RandomAccessFile** result,
+                                     const EnvOptions& options) override {
+    MutexLock l(&mutex_);
+    FileSystem::iterator it = files_.find(fname);
+    if (it == files_.end()) {
+      *result = NULL;
+      return Status::IOError(fname, "File not found");
+    }
+    *result = new MemRandomAccessFile(it->second);
+    return Status::OK();
+  }
+
+  virtual bool FileExists(const std::string& path) override {
+    MutexLock l(&mutex_);
+    std::string name = Normalize(path);
+    return files_.find(name) != files_.end() || dirs_.find(name) != dirs_.end();
+  }
+
+  virtual int GetChildren(const std::string& dir,
+                          std::vector<std::string>& result) override {
+    MutexLock l(&mutex_);
+    result.clear();
+    std::string prefix = Normalize(dir) + "/";
+    for (FileSystem::iterator i = files_.begin(); i != files_.end(); ++i) {
+      const std::string& fname = i->first;
+      if (fname.compare(0, prefix.size(), prefix) == 0
+          && fname.find('/', prefix.size()) == std::string::npos) {
+        result.push_back(fname.substr(prefix.size()));
+      }
+    }
+    return 0;
+  }
+
+  virtual Status DeleteFile(const std::string& fname) override {
+    MutexLock l(&mutex_);
+    FileSystem::iterator it = files_.find(fname);
+    if (it == files_.end()) {
+      return Status::IOError(fname, "File not found");
+    }
+    it->second->Unref();
+    files_.erase(it);
+    return Status::OK();
+  }
+
+  virtual int RenameFile(const std::string& oldname,
+                         const std::string& newname) override {
+    MutexLock l(&mutex_);
+    FileSystem::iterator it = files_.find(oldname);
+    if (it == files_.end()) {
+      errno = ENOENT;
+      return -1;
+    }
+    FileState* file = it->second;
+    files_.erase(it);
+    FileSystem::iterator old = files_.find(newname);
+    if (old != files_.end()) {
+      old->second->Unref();
+      files_.erase(old);
+    }
+    files_[newname] = file;
+    return 0;
+  }
+
+  virtual int CreateDir(const std::string& path) override {
+    MutexLock l(&mutex_);
+    if (!dirs_.insert(Normalize(path)).second) {
+      errno = EEXIST;
+      return -1;
+    }
+    return 0;
+  }
+
+  virtual uint64_t NowMicros() override {
+    return slash::NowMicros();
+  }
+
+ private:
+  typedef std::map<std::string, FileState*> FileSystem;
+
+  static std::string Normalize(const std::string& path) {
+    std::string name(path);
+    while (name.size() > 1 && name.back() == '/') {
+      name.pop_back();
+    }
+    return name;
+  }
+
+  // mutex_ should be held
+  FileState* CreateFile(const std::string& fname) {
+    FileSystem::iterator it = files_.find(fname);
+    if (it != files_.end()) {
+      return it->second;
+    }
+    FileState* file = new FileState();
+    file->Ref();
+    files_[fname] = file;
+    return file;
+  }
+
+  Mutex mutex_;
+  FileSystem files_;
+  std::set<std::string> dirs_;
+};
+
+}  // namespace
+
+Env* NewMemEnv() {
+  return new MemEnv;
+}
+
+}  // namespace slash
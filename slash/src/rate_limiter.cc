@@ -0,0 +1,194 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "slash/include/rate_limiter.h"
+
+#include <algorithm>
+
+namespace slash {
+
+// Refills between two auto tunings
+const int64_t kTuneRefills = 100;
+// Auto tuned rate is within [max / kTuneRange, max]
+const int64_t kTuneRange = 20;
+
+struct RateLimiter::Req {
+  int64_t bytes;   // Bytes not granted yet
+  bool granted;
+
+  explicit Req(int64_t b) : bytes(b), granted(false) { }
+};
+
+RateLimiter::RateLimiter(int64_t bytes_per_second, int64_t refill_period_us,
+                         int32_t fairness, bool auto_tuned)
+  : cv_(&mu_),
+    refill_period_us_(std::max<int64_t>(refill_period_us, 1000)),
+    fairness_(std::max<int32_t>(fairness, 1)),
+    auto_tuned_(auto_tuned),
+    max_bytes_per_second_(std::max<int64_t>(bytes_per_second, 1)),
+    bytes_per_second_(max_bytes_per_second_),
+    available_bytes_(0),
+    next_refill_us_(MonotonicMicros()),
+    refills_(0),
+    waiters_(0),
+    stop_(false),
+    drained_refills_(0),
+    tune_refills_(0) {
+  for (int i = 0; i < kIOPriorityTotal; i++) {
+    total_bytes_[i] = 0;
+    total_requests_[i] = 0;
+  }
+}
+
+RateLimiter::~RateLimiter() {
+  // Let the waiters go, then wait until none of them touches mu_ and cv_
+  MutexLock l(&mu_);
+  stop_ = true;
+  for (int i = 0; i < kIOPriorityTotal; i++) {
+    for (size_t j = 0; j < queues_[i].size(); j++) {
+      queues_[i][j]->granted = true;
+    }
+    queues_[i].clear();
+  }
+  cv_.SignalAll();
+  while (waiters_ > 0) {
+    cv_.Wait();
+  }
+}
+
+void RateLimiter::SetBytesPerSecond(int64_t bytes_per_second) {
+  MutexLock l(&mu_);
+  max_bytes_per_second_ = std::max<int64_t>(bytes_per_second, 1);
+  bytes_per_second_ = max_bytes_per_second_;
+}
+
+int64_t RateLimiter::GetBytesPerSecond() {
+  MutexLock l(&mu_);
+  return bytes_per_second_;
+}
+
+int64_t RateLimiter::GetSingleBurstBytes() {
+  MutexLock l(&mu_);
+  return RefillBytes();
+}
+
+int64_t RateLimiter::GetTotalBytesThrough(IOPriority priority) {
+  MutexLock l(&mu_);
+  if (priority == kIOPriorityTotal) {
+    return total_bytes_[kIOPriorityLow] + total_bytes_[kIOPriorityHigh];
+  }
+  return total_bytes_[priority];
+}
+
+int64_t RateLimiter::GetTotalRequests(IOPriority priority) {
+  MutexLock l(&mu_);
+  if (priority == kIOPriorityTotal) {
+    return total_requests_[kIOPriorityLow] + total_requests_[kIOPriorityHigh];
+  }
+  return total_requests_[priority];
+}
+
+int64_t RateLimiter::RefillBytes() const {
+  return std::max<int64_t>(bytes_per_second_ * refill_period_us_ / 1000000, 1);
+}
+
+void RateLimiter::Request(int64_t bytes, IOPriority priority) {
+  if (bytes <= 0) {
+    return;
+  }
+  if (priority < kIOPriorityLow || priority >= kIOPriorityTotal) {
+    priority = kIOPriorityLow;
+  }
+  MutexLock l(&mu_);
+  total_requests_[priority]++;
+  total_bytes_[priority] += bytes;
+  if (MonotonicMicros() >= next_refill_us_) {
+    Refill(MonotonicMicros());
+  }
+
+  // Nobody waits, take the tokens left
+  if (queues_[kIOPriorityLow].empty() && queues_[kIOPriorityHigh].empty()
+      && available_bytes_ >= bytes) {
+    available_bytes_ -= bytes;
+    return;
+  }
+
+  Req req(bytes);
+  queues_[priority].push_back(&req);
+  waiters_++;
+  while (!req.granted) {
+    uint64_t now = MonotonicMicros();
+    if (now >= next_refill_us_) {
+      Refill(now);
+      continue;
+    }
+    uint64_t wait_ms = (next_refill_us_ - now + 999) / 1000;
+    cv_.TimedWait(static_cast<uint32_t>(wait_ms));
+  }
+  waiters_--;
+  if (stop_ && waiters_ == 0) {
+    cv_.SignalAll();
+  }
+}
+
+void RateLimiter::Refill(uint64_t now) {
+  refills_++;
+  // Periods passed without any request count as not drained
+  int64_t periods = 1 + (now - next_refill_us_) / refill_period_us_;
+  next_refill_us_ = now + refill_period_us_;
+  int64_t refill = RefillBytes();
+  // Tokens are not saved up beyond one refill
+  available_bytes_ = std::min(available_bytes_ + refill, refill);
+
+  IOPriority order[kIOPriorityTotal] = { kIOPriorityHigh, kIOPriorityLow };
+  if (refills_ % fairness_ == 0) {
+    std::swap(order[0], order[1]);
+  }
+  for (int i = 0; i < kIOPriorityTotal && available_bytes_ > 0; i++) {
+    std::deque<Req*>& queue = queues_[order[i]];
+    while (!queue.empty() && available_bytes_ > 0) {
+      Req* req = queue.front();
+      if (req->bytes > available_bytes_) {
+        // Granted partly, the rest waits for next refills
+        req->bytes -= available_bytes_;
+        available_bytes_ = 0;
+        break;
+      }
+      available_bytes_ -= req->bytes;
+      req->bytes = 0;
+      req->granted = true;
+      queue.pop_front();
+    }
+  }
+
+  if (auto_tuned_) {
+    if (!queues_[kIOPriorityLow].empty() || !queues_[kIOPriorityHigh].empty()) {
+      drained_refills_++;
+    }
+    tune_refills_ += periods;
+    if (tune_refills_ >= kTuneRefills) {
+      Tune();
+    }
+  }
+  cv_.SignalAll();
+}
+
+// Raise the rate by 5% if the tokens ran out in most refills, and lower it
+// if they were mostly left over
+void RateLimiter::Tune() {
+  int64_t drained_percent = drained_refills_ * 100 / tune_refills_;
+  int64_t min_rate = std::max<int64_t>(max_bytes_per_second_ / kTuneRange, 1);
+  if (drained_percent > 90) {
+    bytes_per_second_ = std::min(max_bytes_per_second_,
+                                 bytes_per_second_ + bytes_per_second_ / 20 + 1);
+  } else if (drained_percent < 50) {
+    bytes_per_second_ = std::max(min_rate,
+                                 bytes_per_second_ - bytes_per_second_ / 20);
+  }
+  drained_refills_ = 0;
+  tune_refills_ = 0;
+}
+
+}  // namespace slash
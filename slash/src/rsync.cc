@@ -1,8 +1,10 @@
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 #include <string>
 
 #include "slash/include/env.h"
+#include "slash/include/rate_limiter.h"
 #include "slash/include/rsync.h"
 #include "slash/include/xdebug.h"
 
@@ -12,6 +14,18 @@ static bool CleanRsyncInfo(const std::string& path) {
   return slash::DeleteDirIfExist(path + kRsyncSubDir);
 }
 
+// Bandwidth limit in KB/s of rsync, 0 means no limit
+static int RsyncBwlimit(const RsyncRemote& remote, RateLimiter* rate_limiter) {
+  int kbps = remote.kbps > 0 ? remote.kbps : 0;
+  if (rate_limiter != NULL) {
+    int64_t limit = std::max<int64_t>(rate_limiter->GetBytesPerSecond() / 1024, 1);
+    if (kbps == 0 || limit < kbps) {
+      kbps = static_cast<int>(limit);
+    }
+  }
+  return kbps;
+}
+
 int StartRsync(const std::string& raw_path, const std::string& module, const std::string& ip, const int port) {
   // Sanity check  
   if (raw_path.empty() || module.empty()) {
@@ -90,9 +104,10 @@ int StopRsync(const std::string& raw_path) {
   return ret;
 }
 
-int RsyncSendFile(const std::string& local_file_path, const std::string& remote_file_path, const RsyncRemote& remote) {
+int RsyncSendFile(const std::string& local_file_path, const std::string& remote_file_path,
+    const RsyncRemote& remote, RateLimiter* rate_limiter) {
   std::stringstream ss;
-  ss << """rsync -avP --bwlimit=" << remote.kbps
+  ss << """rsync -avP --bwlimit=" << RsyncBwlimit(remote, rate_limiter)
     << " --port=" << remote.port
     << " " << local_file_path
     << " " << remote.host
@@ -107,7 +122,8 @@ int RsyncSendFile(const std::string& local_file_path, const std::string& remote_
   return ret;
 }
 
-int RsyncSendClearTarget(const std::string& local_dir_path, const std::string& remote_dir_path, const RsyncRemote& remote) {
+int RsyncSendClearTarget(const std::string& local_dir_path, const std::string& remote_dir_path,
+    const RsyncRemote& remote, RateLimiter* rate_limiter) {
   if (local_dir_path.empty() || remote_dir_path.empty()) {
     return -2;
   }
@@ -119,7 +135,12 @@ int RsyncSendClearTarget(const std::string& local_dir_path, const std::string& r
     remote_dir.append("/");
   }
   std::stringstream ss;
-  ss << "rsync -avP --delete --port=" << remote.port
+  ss << "rsync -avP --delete";
+  int kbps = RsyncBwlimit(remote, rate_limiter);
+  if (kbps > 0) {
+    ss << " --bwlimit=" << kbps;
+  }
+  ss << " --port=" << remote.port
     << " " << local_dir
     << " " << remote.host
     << "::" << remote.module << "/" << remote_dir;
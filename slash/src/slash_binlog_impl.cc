@@ -6,10 +6,14 @@
 #include "slash/src/slash_binlog_impl.h"
 
 #include <stddef.h>
+#include <stdlib.h>
 #include <string>
 #include <unistd.h>
-#include <sys/time.h>
 #include <assert.h>
+#include <unordered_map>
+
+#include "slash/include/delete_scheduler.h"
+#include "slash/include/rate_limiter.h"
 
 namespace slash {
 
@@ -54,11 +58,131 @@ Status Version::Init() {
   }
 }
 
+// Consumers
+// Publish the position of slot p with one aligned 8-byte store
+static void StorePosition(char* p, uint32_t filenum, uint64_t offset) {
+  assert(offset <= 0xffffffffULL);
+  uint64_t position = (static_cast<uint64_t>(filenum) << 32)
+    | (offset & 0xffffffffULL);
+  __atomic_store_n(reinterpret_cast<uint64_t*>(p + kConsumerNameSize),
+                   position, __ATOMIC_RELEASE);
+}
+
+static void LoadPosition(const char* p, uint32_t* filenum, uint64_t* offset) {
+  uint64_t position = __atomic_load_n(
+      reinterpret_cast<const uint64_t*>(p + kConsumerNameSize),
+      __ATOMIC_ACQUIRE);
+  *filenum = static_cast<uint32_t>(position >> 32);
+  *offset = position & 0xffffffffULL;
+}
+
+Consumers::Consumers(RWFile *save)
+  : save_(save),
+    in_use_(kMaxConsumers, false) {
+  assert(save_ != NULL);
+}
+
+Consumers::~Consumers() {
+}
+
+Status Consumers::Init() {
+  if (save_->GetData() == NULL) {
+    return Status::Corruption("consumers init error");
+  }
+  return Status::OK();
+}
+
+// mu_ should be held
+int Consumers::FindSlot(const std::string& name) {
+  for (int i = 0; i < kMaxConsumers; i++) {
+    const char* p = SlotData(i);
+    if (strncmp(p, name.c_str(), kConsumerNameSize) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+Status Consumers::Acquire(const std::string& name, int* slot,
+                          uint32_t* filenum, uint64_t* offset) {
+  if (name.empty() || name.size() >= kConsumerNameSize) {
+    return Status::InvalidArgument("consumer name", name);
+  }
+  MutexLock l(&mu_);
+  int i = FindSlot(name);
+  if (i < 0) {
+    // Take the first empty slot
+    i = FindSlot("");
+    if (i < 0) {
+      return Status::Incomplete("too many consumers");
+    }
+    // The name is written last, it makes the slot valid
+    char* p = SlotData(i);
+    memset(p, 0, kConsumerSlotSize);
+    StorePosition(p, *filenum, *offset);
+    memcpy(p, name.data(), name.size());
+  } else if (in_use_[i]) {
+    return Status::Incomplete("consumer in use", name);
+  }
+  LoadPosition(SlotData(i), filenum, offset);
+  in_use_[i] = true;
+  *slot = i;
+  return Status::OK();
+}
+
+void Consumers::Release(int slot) {
+  MutexLock l(&mu_);
+  in_use_[slot] = false;
+}
+
+Status Consumers::Remove(const std::string& name) {
+  if (name.empty() || name.size() >= kConsumerNameSize) {
+    return Status::InvalidArgument("consumer name", name);
+  }
+  MutexLock l(&mu_);
+  int i = FindSlot(name);
+  if (i < 0) {
+    return Status::NotFound("consumer", name);
+  }
+  if (in_use_[i]) {
+    return Status::Incomplete("consumer in use", name);
+  }
+  memset(SlotData(i), 0, kConsumerSlotSize);
+  return Status::OK();
+}
+
+void Consumers::Save(int slot, uint32_t filenum, uint64_t offset) {
+  MutexLock l(&mu_);
+  StorePosition(SlotData(slot), filenum, offset);
+}
+
+Status Consumers::GetMin(uint32_t* filenum, uint64_t* offset) {
+  MutexLock l(&mu_);
+  bool found = false;
+  for (int i = 0; i < kMaxConsumers; i++) {
+    const char* p = SlotData(i);
+    if (p[0] == '\0') {
+      continue;
+    }
+    uint32_t cur_filenum;
+    uint64_t cur_offset;
+    LoadPosition(p, &cur_filenum, &cur_offset);
+    if (!found || cur_filenum < *filenum
+        || (cur_filenum == *filenum && cur_offset < *offset)) {
+      *filenum = cur_filenum;
+      *offset = cur_offset;
+      found = true;
+    }
+  }
+  return found ? Status::OK() : Status::NotFound("no consumer");
+}
+
 // Binlog
-Status Binlog::Open(const std::string& path, Binlog** logptr) {
+Status Binlog::Open(const std::string& path, Binlog** logptr, Env* env,
+                    RateLimiter* rate_limiter) {
   *logptr = NULL;
 
-  BinlogImpl *impl = new BinlogImpl(path, kBinlogSize);
+  BinlogImpl *impl = new BinlogImpl(env, path, kBinlogSize, rate_limiter);
   Status s = impl->Recover();
   if (s.ok()) {
     *logptr = impl;
@@ -68,27 +192,41 @@ Status Binlog::Open(const std::string& path, Binlog** logptr) {
   return s;
 }
 
-BinlogImpl::BinlogImpl(const std::string& path, const int file_size)
-  : exit_all_consume_(false),
+BinlogImpl::BinlogImpl(Env* env, const std::string& path, const int file_size,
+                       RateLimiter* rate_limiter)
+  : env_(env),
+    rate_limiter_(rate_limiter),
+    exit_all_consume_(false),
     path_(path),
     file_size_(file_size),
     version_(NULL),
     queue_(NULL),
-    versionfile_(NULL) {
+    versionfile_(NULL),
+    watcher_(NULL),
+    consumers_(NULL),
+    consumerfile_(NULL) {
   if (path_.back() != '/') {
     path_.push_back('/');
   }
+  reader_options_.rate_limiter = rate_limiter_;
+  reader_options_.rate_limiter_priority = kIOPriorityLow;
 }
 
 Status BinlogImpl::Recover() {
-  CreateDir(path_);
+  env_->CreateDir(path_);
+
+  watcher_ = new DirWatcher(path_, env_);
+  Status s = watcher_->Start();
+  if (!s.ok()) {
+    return s;
+  }
 
   std::string manifest = path_ + kManifest;
   bool exist_flag = false;
-  if (FileExists(manifest)) {
+  if (env_->FileExists(manifest)) {
     exist_flag = true;
   }
-  Status s = NewRWFile(manifest, &versionfile_);
+  s = env_->NewRWFile(manifest, &versionfile_);
   if (!s.ok()) {
     return s;
   }
@@ -96,10 +234,20 @@ Status BinlogImpl::Recover() {
   version_->Init();
   version_->StableSave();
 
+  s = env_->NewRWFile(path_ + kConsumer, &consumerfile_);
+  if (!s.ok()) {
+    return s;
+  }
+  consumers_ = new Consumers(consumerfile_);
+  s = consumers_->Init();
+  if (!s.ok()) {
+    return s;
+  }
+
   pro_num_ = version_->pro_num_;
   std::string profile = NewFileName(path_ + kBinlogPrefix, pro_num_);
   if (exist_flag) {
-    s = AppendWritableFile(profile, &queue_, version_->pro_offset_);
+    s = env_->AppendWritableFile(profile, &queue_, version_->pro_offset_);
     if (!s.ok()) {
       return s;
     }
@@ -110,7 +258,7 @@ Status BinlogImpl::Recover() {
     //mem->RecoverFromFile(profile);
     //memtables_[pro_num_] = mem;
   } else {
-    s = NewWritableFile(profile, &queue_);
+    s = env_->NewWritableFile(profile, &queue_);
     if (!s.ok()) {
       return s;
     }
@@ -128,6 +276,9 @@ BinlogImpl::~BinlogImpl() {
   delete version_;
   delete versionfile_;
   delete queue_;
+  delete watcher_;
+  delete consumers_;
+  delete consumerfile_;
 }
 
 void BinlogImpl::InitOffset() {
@@ -155,7 +306,7 @@ Status BinlogImpl::Append(const std::string &item) {
 
     pro_num_++;
     std::string profile = NewFileName(path_ + kBinlogPrefix, pro_num_);
-    NewWritableFile(profile, &queue_);
+    env_->NewWritableFile(profile, &queue_);
 
     {
       WriteLock(&version_->rwlock_);
@@ -166,8 +317,8 @@ Status BinlogImpl::Append(const std::string &item) {
     }
   }
 
-  int pro_offset;
-  s = Produce(Slice(item.data(), item.size()), &pro_offset);
+  int pro_offset = version_->pro_offset_;
+  s = Produce(queue_, &block_offset_, Slice(item.data(), item.size()), &pro_offset);
   if (s.ok()) {
     WriteLock(&version_->rwlock_);
     version_->pro_offset_ = pro_offset;
@@ -177,17 +328,16 @@ Status BinlogImpl::Append(const std::string &item) {
   return s;
 }
 
-Status BinlogImpl::EmitPhysicalRecord(RecordType t, const char *ptr, size_t n, int *temp_pro_offset) {
+Status BinlogImpl::EmitPhysicalRecord(WritableFile *file, int *block_offset,
+                                      RecordType t, const char *ptr, size_t n,
+                                      int *temp_pro_offset) {
   Status s;
   assert(n <= 0xffffff);
-  assert(block_offset_ + kHeaderSize + n <= kBlockSize);
+  assert(*block_offset + kHeaderSize + n <= kBlockSize);
 
   char buf[kHeaderSize];
 
-  uint64_t now;
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  now = tv.tv_sec;
+  uint64_t now = NowCoarseSeconds();
   buf[0] = static_cast<char>(n & 0xff);
   buf[1] = static_cast<char>((n & 0xff00) >> 8);
   buf[2] = static_cast<char>(n >> 16);
@@ -197,39 +347,39 @@ Status BinlogImpl::EmitPhysicalRecord(RecordType t, const char *ptr, size_t n, i
   buf[6] = static_cast<char>((now & 0xff000000) >> 24);
   buf[7] = static_cast<char>(t);
 
-  s = queue_->Append(Slice(buf, kHeaderSize));
+  s = file->Append(Slice(buf, kHeaderSize));
   if (s.ok()) {
-    s = queue_->Append(Slice(ptr, n));
+    s = file->Append(Slice(ptr, n));
     if (s.ok()) {
-      s = queue_->Flush();
+      s = file->Flush();
     }
   }
-  block_offset_ += static_cast<int>(kHeaderSize + n);
+  *block_offset += static_cast<int>(kHeaderSize + n);
 
   *temp_pro_offset += kHeaderSize + n;
   return s;
 }
 
-Status BinlogImpl::Produce(const Slice &item, int *temp_pro_offset) {
+Status BinlogImpl::Produce(WritableFile *file, int *block_offset,
+                           const Slice &item, int *temp_pro_offset) {
   Status s;
   const char *ptr = item.data();
   size_t left = item.size();
   bool begin = true;
 
-  *temp_pro_offset = version_->pro_offset_;
   do {
-    const int leftover = static_cast<int>(kBlockSize) - block_offset_;
+    const int leftover = static_cast<int>(kBlockSize) - *block_offset;
     assert(leftover >= 0);
     if (static_cast<size_t>(leftover) < kHeaderSize) {
       if (leftover > 0) {
-        queue_->Append(Slice("\x00\x00\x00\x00\x00\x00\x00", leftover));
+        file->Append(Slice("\x00\x00\x00\x00\x00\x00\x00", leftover));
         *temp_pro_offset += leftover;
         //version_->StableSave();
       }
-      block_offset_ = 0;
+      *block_offset = 0;
     }
 
-    const size_t avail = kBlockSize - block_offset_ - kHeaderSize;
+    const size_t avail = kBlockSize - *block_offset - kHeaderSize;
     const size_t fragment_length = (left < avail) ? left : avail;
     RecordType type;
     const bool end = (left == fragment_length);
@@ -243,7 +393,8 @@ Status BinlogImpl::Produce(const Slice &item, int *temp_pro_offset) {
       type = kMiddleType;
     }
 
-    s = EmitPhysicalRecord(type, ptr, fragment_length, temp_pro_offset);
+    s = EmitPhysicalRecord(file, block_offset, type, ptr, fragment_length,
+                           temp_pro_offset);
     ptr += fragment_length;
     left -= fragment_length;
     begin = false;
@@ -252,7 +403,8 @@ Status BinlogImpl::Produce(const Slice &item, int *temp_pro_offset) {
   return s;
 }
  
-Status BinlogImpl::AppendBlank(WritableFile *file, uint64_t len) {
+Status BinlogImpl::AppendBlank(WritableFile *file, uint64_t len,
+                               RateLimiter* rate_limiter) {
   if (len < kHeaderSize) {
     return Status::OK();
   }
@@ -261,6 +413,9 @@ Status BinlogImpl::AppendBlank(WritableFile *file, uint64_t len) {
 
   std::string blank(kBlockSize, ' ');
   for (; pos + kBlockSize < len; pos += kBlockSize) {
+    if (rate_limiter != NULL) {
+      rate_limiter->Request(blank.size(), kIOPriorityLow);
+    }
     file->Append(Slice(blank.data(), blank.size()));
   }
 
@@ -273,11 +428,11 @@ Status BinlogImpl::AppendBlank(WritableFile *file, uint64_t len) {
     n = (uint32_t) ((len % kBlockSize) - kHeaderSize);
   }
 
+  if (rate_limiter != NULL) {
+    rate_limiter->Request(kHeaderSize + n, kIOPriorityLow);
+  }
   char buf[kBlockSize];
-  uint64_t now;
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  now = tv.tv_sec;
+  uint64_t now = NowCoarseSeconds();
   buf[0] = static_cast<char>(n & 0xff);
   buf[1] = static_cast<char>((n & 0xff00) >> 8);
   buf[2] = static_cast<char>(n >> 16);
@@ -308,17 +463,17 @@ Status BinlogImpl::SetProducerStatus(uint32_t pro_num, uint64_t pro_offset) {
   delete queue_;
 
   std::string init_profile = NewFileName(path_ + kBinlogPrefix, 0);
-  if (FileExists(init_profile)) {
-    DeleteFile(init_profile);
+  if (env_->FileExists(init_profile)) {
+    env_->DeleteFile(init_profile);
   }
 
   std::string profile = NewFileName(path_ + kBinlogPrefix, pro_num);
-  if (FileExists(profile)) {
-    DeleteFile(profile);
+  if (env_->FileExists(profile)) {
+    env_->DeleteFile(profile);
   }
 
-  NewWritableFile(profile, &queue_);
-  BinlogImpl::AppendBlank(queue_, pro_offset);
+  env_->NewWritableFile(profile, &queue_);
+  BinlogImpl::AppendBlank(queue_, pro_offset, rate_limiter_);
 
   pro_num_ = pro_num;
 
@@ -333,44 +488,275 @@ Status BinlogImpl::SetProducerStatus(uint32_t pro_num, uint64_t pro_offset) {
   return Status::OK();
 }
 
-BinlogReader* BinlogImpl::NewBinlogReader(uint32_t filenum, uint64_t offset) {
+bool BinlogImpl::ValidSyncPoint(uint32_t filenum, uint64_t offset) {
   // Check sync point
   uint32_t cur_filenum = 0;
   uint64_t cur_offset = 0;
   GetProducerStatus(&cur_filenum, &cur_offset);
   if (cur_filenum < filenum || (cur_filenum == filenum && cur_offset < offset)) {
-    return NULL;
+    return false;
   }
 
   std::string confile = NewFileName(path_ + kBinlogPrefix, filenum);
-  if (!slash::FileExists(confile)) {
+  if (!env_->FileExists(confile)) {
     // Not found binlog specified by filenum
+    return false;
+  }
+  return true;
+}
+
+BinlogReader* BinlogImpl::NewBinlogReader(uint32_t filenum, uint64_t offset) {
+  if (!ValidSyncPoint(filenum, offset)) {
     return NULL;
   }
 
-  BinlogReaderImpl* reader = new BinlogReaderImpl(this, path_, filenum, offset); 
+  BinlogReaderImpl* reader = new BinlogReaderImpl(this, env_, reader_options_,
+                                                  path_, filenum, offset);
+  reader->watcher_ = watcher_;
   Status s = reader->Trim();
   if (!s.ok()) {
     log_info("Trim offset failed: %s", s.ToString().c_str());
+    delete reader;
+    return NULL;
+  }
+
+  return reader;
+}
+
+BinlogReader* BinlogImpl::OpenConsumer(const std::string& name) {
+  uint32_t filenum = 0;
+  uint64_t offset = 0;
+  GetProducerStatus(&filenum, &offset);
+  int slot;
+  Status s = consumers_->Acquire(name, &slot, &filenum, &offset);
+  if (!s.ok()) {
+    log_info("Open consumer failed: %s", s.ToString().c_str());
+    return NULL;
+  }
+  if (!ValidSyncPoint(filenum, offset)) {
+    consumers_->Release(slot);
     return NULL;
   }
 
+  BinlogConsumerImpl* reader = new BinlogConsumerImpl(this, env_,
+                                                      reader_options_, path_,
+                                                      filenum, offset,
+                                                      consumers_, slot);
+  reader->watcher_ = watcher_;
+  s = reader->Trim();
+  if (!s.ok()) {
+    log_info("Trim offset failed: %s", s.ToString().c_str());
+    delete reader;
+    return NULL;
+  }
   return reader;
 }
 
-BinlogReaderImpl::BinlogReaderImpl(Binlog* log, const std::string &path, uint32_t filenum, uint64_t offset)
+Status BinlogImpl::RemoveConsumer(const std::string& name) {
+  return consumers_->Remove(name);
+}
+
+Status BinlogImpl::GetMinConsumerStatus(uint32_t* filenum, uint64_t* offset) {
+  return consumers_->GetMin(filenum, offset);
+}
+
+Status BinlogImpl::PurgeLogs(uint32_t filenum, DeleteScheduler* scheduler) {
+  uint32_t cur_filenum = 0;
+  uint64_t cur_offset = 0;
+  GetProducerStatus(&cur_filenum, &cur_offset);
+  if (filenum > cur_filenum) {
+    return Status::InvalidArgument("can not purge the binlog being written");
+  }
+  uint32_t min_filenum = 0;
+  uint64_t min_offset = 0;
+  if (GetMinConsumerStatus(&min_filenum, &min_offset).ok()
+      && filenum > min_filenum) {
+    return Status::InvalidArgument("binlog is still needed by consumers");
+  }
+  if (env_ != Env::Default()) {
+    scheduler = NULL;
+  }
+
+  std::vector<std::string> children;
+  env_->GetChildren(path_, children);
+  Status s;
+  for (size_t i = 0; i < children.size(); i++) {
+    const std::string& name = children[i];
+    if (name.compare(0, kBinlogPrefix.size(), kBinlogPrefix) != 0
+        || name.size() == kBinlogPrefix.size()
+        || name.find_first_not_of("0123456789", kBinlogPrefix.size())
+          != std::string::npos) {
+      continue;
+    }
+    uint32_t num = strtoul(name.c_str() + kBinlogPrefix.size(), NULL, 10);
+    if (num >= filenum) {
+      continue;
+    }
+    // Not truncated, the readers which are not named consumers may still
+    // have the file open
+    Status ds = scheduler != NULL ? scheduler->Delete(path_ + name, false)
+                                  : env_->DeleteFile(path_ + name);
+    if (!ds.ok() && s.ok()) {
+      s = ds;
+    }
+  }
+  return s;
+}
+
+Status BinlogImpl::Compact(uint32_t begin, uint32_t end, const KeyOf& key_of) {
+  uint32_t cur_filenum = 0;
+  uint64_t cur_offset = 0;
+  GetProducerStatus(&cur_filenum, &cur_offset);
+  if (begin > end || end >= cur_filenum) {
+    return Status::InvalidArgument("compact range should be closed binlog");
+  }
+  return CompactBinlog(path_, begin, end, key_of, env_);
+}
+
+BinlogReader* BinlogImpl::NewCompactedReader(uint32_t end) {
+  std::string segment = NewFileName(path_ + kCompactPrefix, end);
+  if (!env_->FileExists(segment)) {
+    return NULL;
+  }
+
+  BinlogReaderImpl* reader = new BinlogReaderImpl(this, env_, reader_options_,
+                                                  path_, segment, end + 1);
+  if (!reader->Valid()) {
+    delete reader;
+    return NULL;
+  }
+  reader->watcher_ = watcher_;
+  return reader;
+}
+
+// Scan the records of binlog files [begin, end] in order
+static Status ScanBinlog(Env* env, const std::string& path,
+                         uint32_t begin, uint32_t end,
+                         const std::function<void(const std::string&)>& func) {
+  Status s;
+  std::string record;
+  for (uint32_t filenum = begin; filenum <= end; filenum++) {
+    BinlogReaderImpl reader(NULL, env, EnvOptions(), path, filenum, 0);
+    if (!reader.Valid()) {
+      return Status::NotFound(NewFileName(path + kBinlogPrefix, filenum));
+    }
+    while (true) {
+      s = reader.ReadNext(record);
+      if (!s.ok()) {
+        break;
+      }
+      func(record);
+    }
+    if (!s.IsEndFile()) {
+      return s;
+    }
+  }
+  return Status::OK();
+}
+
+Status CompactBinlog(const std::string& raw_path, uint32_t begin, uint32_t end,
+                     const KeyOf& key_of, Env* env) {
+  std::string path(raw_path);
+  if (path.back() != '/') {
+    path.push_back('/');
+  }
+
+  // First pass, find the sequence of the last record of every key
+  std::unordered_map<std::string, uint64_t> last_seq;
+  uint64_t seq = 0;
+  std::string key;
+  Status s = ScanBinlog(env, path, begin, end, [&](const std::string& record) {
+    if (key_of(Slice(record), &key)) {
+      last_seq[key] = seq;
+    }
+    seq++;
+  });
+  if (!s.ok()) {
+    return s;
+  }
+
+  // Second pass, write the surviving records into the segment
+  std::string segment = NewFileName(path + kCompactPrefix, end);
+  std::string tmp_segment = segment + ".tmp";
+  WritableFile *file;
+  s = env->NewWritableFile(tmp_segment, &file);
+  if (!s.ok()) {
+    return s;
+  }
+  int block_offset = 0;
+  int written = 0;
+  Status ws;
+  seq = 0;
+  s = ScanBinlog(env, path, begin, end, [&](const std::string& record) {
+    if (ws.ok() && (!key_of(Slice(record), &key) || last_seq[key] == seq)) {
+      ws = BinlogImpl::Produce(file, &block_offset, Slice(record), &written);
+    }
+    seq++;
+  });
+  if (s.ok()) {
+    s = ws;
+  }
+  if (s.ok()) {
+    s = file->Sync();
+  }
+  delete file;
+  if (!s.ok()) {
+    env->DeleteFile(tmp_segment);
+    return s;
+  }
+  if (env->RenameFile(tmp_segment, segment) != 0) {
+    return Status::IOError(segment, strerror(errno));
+  }
+  return Status::OK();
+}
+
+BinlogReaderImpl::BinlogReaderImpl(Binlog* log, Env* env,
+                                   const EnvOptions& options,
+                                   const std::string &path,
+                                   uint32_t filenum, uint64_t offset)
   : log_(log),
+    env_(env),
+    options_(options),
     path_(path),
     filenum_(filenum),
     offset_(offset),
     should_exit_(false),
+    replaying_compacted_(false),
     initial_offset_(0),
     last_record_offset_(offset_ % kBlockSize),
     end_of_buffer_offset_(kBlockSize),
     queue_(NULL),
-    backing_store_(new char[kBlockSize]) {
+    backing_store_(new char[kBlockSize]),
+    stable_offset_(0),
+    skipped_blocks_(0),
+    watcher_(NULL) {
   std::string confile = NewFileName(path_ + kBinlogPrefix, filenum_);
-  if (!NewSequentialFile(confile, &queue_).ok()) {
+  if (!env_->NewSequentialFile(confile, &queue_, options_).ok()) {
+    log_info("Reader new sequtialfile failed");
+  }
+}
+
+BinlogReaderImpl::BinlogReaderImpl(Binlog* log, Env* env,
+                                   const EnvOptions& options,
+                                   const std::string &path,
+                                   const std::string& segment, uint32_t filenum)
+  : log_(log),
+    env_(env),
+    options_(options),
+    path_(path),
+    filenum_(filenum),
+    offset_(0),
+    should_exit_(false),
+    replaying_compacted_(true),
+    initial_offset_(0),
+    last_record_offset_(0),
+    end_of_buffer_offset_(kBlockSize),
+    queue_(NULL),
+    backing_store_(new char[kBlockSize]),
+    stable_offset_(0),
+    skipped_blocks_(0),
+    watcher_(NULL) {
+  if (!env_->NewSequentialFile(segment, &queue_, options_).ok()) {
     log_info("Reader new sequtialfile failed");
   }
 }
@@ -456,6 +842,17 @@ unsigned int BinlogReaderImpl::ReadPhysicalRecord(Slice *result) {
     offset_ += zero_space;
     last_record_offset_ = 0;
   }
+  if (block_filter_ && offset_ % kBlockSize == 0
+      && block_filter_(filenum_, offset_ / kBlockSize)) {
+    s = queue_->Skip(kBlockSize);
+    if (!s.ok()) {
+      return kBadRecord;
+    }
+    offset_ += kBlockSize;
+    last_record_offset_ = 0;
+    skipped_blocks_++;
+    return kSkippedBlock;
+  }
   buffer_.clear();
   s = queue_->Read(kHeaderSize, &buffer_, backing_store_);
   if (s.IsEndFile()) {
@@ -493,6 +890,10 @@ Status BinlogReaderImpl::Consume(std::string &scratch) {
   }
 
   Slice fragment;
+  // Middle or last fragments without the first one, e.g. behind a skipped
+  // block, are dropped. NotFound is returned then, so that the caller
+  // checks the producer offset again before reading on.
+  bool in_record = false;
   while (true) {
     const unsigned int record_type = ReadPhysicalRecord(&fragment);
 
@@ -503,16 +904,26 @@ Status BinlogReaderImpl::Consume(std::string &scratch) {
         break;
       case kFirstType:
         scratch.assign(fragment.data(), fragment.size());
+        in_record = true;
         s = Status::NotFound("Middle Status");
         break;
       case kMiddleType:
+        if (!in_record) {
+          return Status::NotFound("Orphan fragment");
+        }
         scratch.append(fragment.data(), fragment.size());
         s = Status::NotFound("Middle Status");
         break;
       case kLastType:
+        if (!in_record) {
+          return Status::NotFound("Orphan fragment");
+        }
         scratch.append(fragment.data(), fragment.size());
         s = Status::OK();
         break;
+      case kSkippedBlock:
+        scratch.clear();
+        return Status::NotFound("Skipped block");
       case kEof:
         return Status::EndFile("Eof");
       case kBadRecord:
@@ -531,6 +942,15 @@ Status BinlogReaderImpl::Consume(std::string &scratch) {
   return Status::OK();
 }
 
+Status BinlogReaderImpl::ReadNext(std::string &scratch) {
+  Status s;
+  do {
+    scratch.clear();
+    s = Consume(scratch);
+  } while (s.IsNotFound());
+  return s;
+}
+
 // Get a whole message; 
 // the status will be OK, IOError or Corruption;
 Status BinlogReaderImpl::ReadRecord(std::string &scratch) {
@@ -541,29 +961,45 @@ Status BinlogReaderImpl::ReadRecord(std::string &scratch) {
 
   while (!should_exit_) {
     log_->GetProducerStatus(&pro_num, &pro_offset);
-    if (filenum_ == pro_num && offset_ == pro_offset) {
+    if (!replaying_compacted_ && filenum_ == pro_num && offset_ == pro_offset) {
       usleep(10000);
       continue;
     }
+    if (!replaying_compacted_ && offset_ >= stable_offset_) {
+      // Read what the producer has written so far, a finished file is
+      // stable to its end
+      queue_->DropBuffer();
+      stable_offset_ = (filenum_ == pro_num) ? pro_offset : UINT64_MAX;
+    }
 
     s = Consume(scratch);
     if (s.IsEndFile()) {
-      std::string confile = NewFileName(path_ + kBinlogPrefix, filenum_ + 1);
-
-      // Roll to next File
-      if (FileExists(confile)) {
+      // The binlog after compacted segment is filenum_ itself
+      uint32_t next = replaying_compacted_ ? filenum_ : filenum_ + 1;
+      std::string confile = NewFileName(path_ + kBinlogPrefix, next);
+
+      // Roll to next File, wake up as soon as it is created
+      bool exist = (watcher_ != NULL)
+        ? watcher_->WaitForFile(NewFileName(kBinlogPrefix, next), kRollWaitTimeout)
+        : env_->FileExists(confile);
+      if (exist) {
         delete queue_;
         queue_ = NULL;
-        NewSequentialFile(confile, &(queue_));
+        env_->NewSequentialFile(confile, &(queue_), options_);
 
-        filenum_++;
+        filenum_ = next;
+        replaying_compacted_ = false;
         offset_ = 0;
         initial_offset_ = 0;
+        stable_offset_ = 0;
         end_of_buffer_offset_ = kBlockSize;
         last_record_offset_ = offset_ % kBlockSize;
-      } else {
+      } else if (watcher_ == NULL) {
         usleep(10000);
       }
+    } else if (s.IsNotFound()) {
+      // Skipped some data, check the producer offset again
+      scratch.clear();
     } else {
       break;
     }
@@ -575,4 +1011,36 @@ Status BinlogReaderImpl::ReadRecord(std::string &scratch) {
   return s;
 }
 
+BinlogConsumerImpl::BinlogConsumerImpl(Binlog* log, Env* env,
+                                       const EnvOptions& options,
+                                       const std::string& path,
+                                       uint32_t filenum, uint64_t offset,
+                                       Consumers* consumers, int slot)
+  : BinlogReaderImpl(log, env, options, path, filenum, offset),
+    consumers_(consumers),
+    slot_(slot),
+    unsaved_records_(0),
+    last_save_micros_(NowCoarseMicros()) {
+}
+
+BinlogConsumerImpl::~BinlogConsumerImpl() {
+  consumers_->Save(slot_, filenum(), offset());
+  consumers_->Release(slot_);
+}
+
+Status BinlogConsumerImpl::ReadRecord(std::string &record) {
+  Status s = BinlogReaderImpl::ReadRecord(record);
+  if (s.ok()) {
+    // Save position in batch
+    uint64_t now = NowCoarseMicros();
+    if (++unsaved_records_ >= kConsumerSaveRecords
+        || now - last_save_micros_ >= kConsumerSaveMicros) {
+      consumers_->Save(slot_, filenum(), offset());
+      unsaved_records_ = 0;
+      last_save_micros_ = now;
+    }
+  }
+  return s;
+}
+
 }   // namespace slash
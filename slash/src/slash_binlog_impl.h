@@ -9,6 +9,8 @@
 #include <atomic>
 #include <stddef.h>
 #include <string>
+#include <vector>
+#include <functional>
 #include <assert.h>
 
 #include "slash/include/env.h"
@@ -19,17 +21,35 @@
 namespace slash {
 
 class Version;
+class Consumers;
 class BinlogReader;
 
 // SyncPoint is a file number and an offset;
 
 const std::string kBinlogPrefix = "binlog";
 const std::string kManifest = "manifest";
+const std::string kCompactPrefix = "compact";
+const std::string kConsumer = "consumer";
 const int kBinlogSize = 128;
 //const int kBinlogSize = (100 << 20);
 const int kBlockSize = (64 << 10);
 // Header is Type(1 byte), length (3 bytes), time (4 bytes)
 const size_t kHeaderSize = 1 + 3 + 4;
+// Max time a reader waits for the next binlog file at once, millisecond
+const uint32_t kRollWaitTimeout = 1000;
+
+// Consumer slot is name (48 bytes), position (8 bytes) and 8 bytes
+// reserved, 1024 slots fit in the consumer file. The position is filenum
+// in the high 32 bits and offset in the low 32 bits, stored at once so
+// that a crash or writeback never pairs a filenum with another offset
+const size_t kConsumerSlotSize = 64;
+const size_t kConsumerNameSize = 48;
+const int kMaxConsumers = 1024;
+// Consumer position is saved every 1000 records or 100ms
+const int kConsumerSaveRecords = 1000;
+const uint64_t kConsumerSaveMicros = 100000;
+
+std::string NewFileName(const std::string name, const uint32_t current);
 
 enum RecordType {
   kZeroType = 0,
@@ -39,12 +59,14 @@ enum RecordType {
   kLastType = 4,
   kEof = 5,
   kBadRecord = 6,
-  kOldRecord = 7
+  kOldRecord = 7,
+  kSkippedBlock = 8
 };
 
 class BinlogImpl : public Binlog {
  public:
-  BinlogImpl(const std::string& path, const int file_size = (100 < 20));
+  BinlogImpl(Env* env, const std::string& path, const int file_size = (100 < 20),
+             RateLimiter* rate_limiter = NULL);
   virtual ~BinlogImpl();
 
   //
@@ -57,14 +79,31 @@ class BinlogImpl : public Binlog {
   virtual Status GetProducerStatus(uint32_t* filenum, uint64_t* offset);
   virtual Status SetProducerStatus(uint32_t filenum, uint64_t pro_offset);
 
+  virtual Status Compact(uint32_t begin, uint32_t end, const KeyOf& key_of);
+  virtual BinlogReader* NewCompactedReader(uint32_t end);
+
+  virtual BinlogReader* OpenConsumer(const std::string& name);
+  virtual Status RemoveConsumer(const std::string& name);
+  virtual Status GetMinConsumerStatus(uint32_t* filenum, uint64_t* offset);
+
+  virtual Status PurgeLogs(uint32_t filenum, DeleteScheduler* scheduler);
+
+  // Frame item into physical records and append them to file,
+  // block_offset is the write position within the current block.
+  static Status Produce(WritableFile *file, int *block_offset,
+                        const Slice &item, int *temp_pro_offset);
+
  private:
   friend class Binlog;
+  friend class PartitionBinlogImpl;
 
   //
   // More specify API, used by Pika
   //
   Status Recover();
-  static Status AppendBlank(WritableFile *file, uint64_t len);
+  // The blank is requested from rate_limiter if it is not NULL
+  static Status AppendBlank(WritableFile *file, uint64_t len,
+                            RateLimiter* rate_limiter = NULL);
   WritableFile *queue() { return queue_; }
   uint64_t file_size() {
     return file_size_;
@@ -74,12 +113,17 @@ class BinlogImpl : public Binlog {
   void Unlock()       { mutex_.Unlock(); }
 
   void InitOffset();
-  Status EmitPhysicalRecord(RecordType t, const char *ptr, size_t n, int *temp_pro_offset);
-
-  // Produce
-  Status Produce(const Slice &item, int *pro_offset);
+  // Whether filenum and offset is a position readers could start from
+  bool ValidSyncPoint(uint32_t filenum, uint64_t offset);
+  static Status EmitPhysicalRecord(WritableFile *file, int *block_offset,
+                                   RecordType t, const char *ptr, size_t n,
+                                   int *temp_pro_offset);
 
  private:
+  Env* env_;
+  RateLimiter* rate_limiter_;
+  // Options of the files opened by readers
+  EnvOptions reader_options_;
   Mutex mutex_;
   bool exit_all_consume_;
   std::string path_;
@@ -90,6 +134,11 @@ class BinlogImpl : public Binlog {
   Version* version_;
   WritableFile *queue_;
   RWFile *versionfile_;
+  // Shared by readers to wait for the next binlog file
+  DirWatcher *watcher_;
+
+  Consumers* consumers_;
+  RWFile *consumerfile_;
 
   int block_offset_;
   char* pool_;
@@ -139,14 +188,68 @@ class Version {
   void operator=(const Version&);
 };
 
+// Consumers keeps the saved positions of named consumers in a mmapped file
+class Consumers {
+ public:
+  Consumers(RWFile *save);
+  ~Consumers();
+
+  Status Init();
+
+  // Find or allocate the slot of name, which is marked in use until Release
+  Status Acquire(const std::string& name, int* slot,
+                 uint32_t* filenum, uint64_t* offset);
+  void Release(int slot);
+  Status Remove(const std::string& name);
+
+  void Save(int slot, uint32_t filenum, uint64_t offset);
+  Status GetMin(uint32_t* filenum, uint64_t* offset);
+
+ private:
+  char* SlotData(int slot) {
+    return save_->GetData() + slot * kConsumerSlotSize;
+  }
+  int FindSlot(const std::string& name);
+
+  Mutex mu_;
+  RWFile *save_;
+  std::vector<bool> in_use_;
+
+  // No copying allowed;
+  Consumers(const Consumers&);
+  void operator=(const Consumers&);
+};
+
 class BinlogReaderImpl : public BinlogReader {
  public:
-  BinlogReaderImpl(Binlog* log, const std::string& path, uint32_t filenum, uint64_t offset);
+  BinlogReaderImpl(Binlog* log, Env* env, const EnvOptions& options,
+                   const std::string& path, uint32_t filenum, uint64_t offset);
+  // Replay the compacted segment file first, then the binlog filenum from 0
+  BinlogReaderImpl(Binlog* log, Env* env, const EnvOptions& options,
+                   const std::string& path, const std::string& segment,
+                   uint32_t filenum);
   ~BinlogReaderImpl();
 
   //bool ReadRecord(Slice* record, std::string* scratch);
   virtual Status ReadRecord(std::string &record);
 
+  // Read the next record of current file without waiting for the producer,
+  // return EndFile at the end of the file.
+  Status ReadNext(std::string &record);
+  bool Valid() const { return queue_ != NULL; }
+
+  // Called at the beginning of every block, the whole block is skipped
+  // if it returns true. Only complete blocks should be skipped.
+  void SetBlockFilter(const std::function<bool(uint32_t filenum, uint64_t block)>& filter) {
+    block_filter_ = filter;
+  }
+  // Number of the blocks skipped by the filter
+  uint64_t skipped_blocks() const { return skipped_blocks_; }
+
+ protected:
+  uint32_t filenum() const { return filenum_; }
+  uint64_t offset() const { return offset_; }
+
  private:
   friend class BinlogImpl;
 
@@ -160,10 +263,14 @@ class BinlogReaderImpl : public BinlogReader {
   uint64_t GetNext(Status &result);
 
   Binlog* log_;
+  Env* env_;
+  EnvOptions options_;
   std::string path_;
   uint32_t filenum_;
   uint64_t offset_;
   std::atomic<bool> should_exit_;
+  // Still replaying the compacted segment, filenum_ is the next binlog
+  bool replaying_compacted_;
 
   // not used
   uint64_t initial_offset_;
@@ -173,12 +280,40 @@ class BinlogReaderImpl : public BinlogReader {
   SequentialFile* queue_;
   char* const backing_store_;
   Slice buffer_;
+  // The data buffered by queue_ is as written up to this offset, beyond it
+  // could be the zeros preallocated by the writer and filled in since
+  uint64_t stable_offset_;
+
+  std::function<bool(uint32_t filenum, uint64_t block)> block_filter_;
+  uint64_t skipped_blocks_;
+  DirWatcher* watcher_;
 
   // No copying allowed;
   BinlogReaderImpl(const BinlogReaderImpl&);
   void operator=(const BinlogReaderImpl&);
 };
 
+// BinlogConsumerImpl saves its position to the slot of Consumers
+class BinlogConsumerImpl : public BinlogReaderImpl {
+ public:
+  BinlogConsumerImpl(Binlog* log, Env* env, const EnvOptions& options,
+                     const std::string& path, uint32_t filenum,
+                     uint64_t offset, Consumers* consumers, int slot);
+  ~BinlogConsumerImpl();
+
+  virtual Status ReadRecord(std::string &record);
+
+ private:
+  Consumers* consumers_;
+  int slot_;
+  int unsaved_records_;
+  uint64_t last_save_micros_;
+
+  // No copying allowed;
+  BinlogConsumerImpl(const BinlogConsumerImpl&);
+  void operator=(const BinlogConsumerImpl&);
+};
+
 }   // namespace slash
 
 
@@ -3,7 +3,7 @@
 #include <cstdlib>
 #include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
 
 namespace slash {
 
@@ -68,7 +68,14 @@ void RWMutex::ReadUnlock() {
 
 CondVar::CondVar(Mutex* mu)
   : mu_(mu) {
-    PthreadCall("init cv", pthread_cond_init(&cv_, NULL));
+    // Timed on CLOCK_MONOTONIC, so a wait is not stretched or cut short
+    // when the wall clock is adjusted
+    pthread_condattr_t attr;
+    PthreadCall("init cv attr", pthread_condattr_init(&attr));
+    PthreadCall("set cv clock",
+                pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+    PthreadCall("init cv", pthread_cond_init(&cv_, &attr));
+    PthreadCall("destroy cv attr", pthread_condattr_destroy(&attr));
   }
 
 CondVar::~CondVar() { 
@@ -83,15 +90,14 @@ void CondVar::Wait() {
 bool CondVar::TimedWait(uint32_t timeout) {
   /*
    * pthread_cond_timedwait api use absolute API
-   * so we need gettimeofday + timeout
+   * so we need CLOCK_MONOTONIC now + timeout
    */
-  struct timeval now;
-  gettimeofday(&now, NULL);
   struct timespec tsp;
+  clock_gettime(CLOCK_MONOTONIC, &tsp);
 
-  int64_t usec = now.tv_usec + timeout * 1000LL;
-  tsp.tv_sec = now.tv_sec + usec / 1000000;
-  tsp.tv_nsec = (usec % 1000000) * 1000;
+  int64_t nsec = tsp.tv_nsec + timeout * 1000000LL;
+  tsp.tv_sec += nsec / 1000000000;
+  tsp.tv_nsec = nsec % 1000000000;
 
   return PthreadTimeoutCall("timewait",
       pthread_cond_timedwait(&cv_, &mu_->mu_, &tsp));
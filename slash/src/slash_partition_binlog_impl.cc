@@ -0,0 +1,218 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "slash/src/slash_partition_binlog_impl.h"
+
+#include <string.h>
+
+#include "slash/include/slash_coding.h"
+
+namespace slash {
+
+static void MarkPartition(char* bitmap, uint32_t partition) {
+  uint32_t bit = partition % (kPartitionBitmapSize * 8);
+  bitmap[bit / 8] |= static_cast<char>(1 << (bit % 8));
+}
+
+// PartitionBinlog
+Status PartitionBinlog::Open(const std::string& path, PartitionBinlog** logptr,
+                             Env* env) {
+  *logptr = NULL;
+
+  PartitionBinlogImpl *impl = new PartitionBinlogImpl(env, path);
+  Status s = impl->Recover();
+  if (s.ok()) {
+    *logptr = impl;
+  } else {
+    delete impl;
+  }
+  return s;
+}
+
+PartitionBinlogImpl::PartitionBinlogImpl(Env* env, const std::string& path)
+  : env_(env),
+    path_(path),
+    binlog_(NULL),
+    filenum_(0),
+    block_(0),
+    summary_(NULL) {
+  if (path_.back() != '/') {
+    path_.push_back('/');
+  }
+  memset(bitmap_, 0, kPartitionBitmapSize);
+}
+
+PartitionBinlogImpl::~PartitionBinlogImpl() {
+  delete summary_;
+  delete binlog_;
+}
+
+Status PartitionBinlogImpl::Recover() {
+  binlog_ = new BinlogImpl(env_, path_, kBinlogSize);
+  Status s = binlog_->Recover();
+  if (!s.ok()) {
+    return s;
+  }
+
+  uint64_t offset;
+  binlog_->GetProducerStatus(&filenum_, &offset);
+  block_ = offset / kBlockSize;
+  // Partitions in the current block before restart are unknown,
+  // mark it as containing every partition
+  memset(bitmap_, 0xff, kPartitionBitmapSize);
+  return OpenSummary(filenum_);
+}
+
+Status PartitionBinlogImpl::OpenSummary(uint32_t filenum) {
+  delete summary_;
+  summary_ = NULL;
+  std::string summary = NewFileName(path_ + kPartitionSummaryPrefix, filenum);
+  return env_->NewRandomRWFile(summary, &summary_);
+}
+
+Status PartitionBinlogImpl::FinishBlock(uint64_t next_block) {
+  char buf[kPartitionSummarySize];
+  EncodeFixed32(buf, kPartitionSummaryMagic);
+  memcpy(buf + 4, bitmap_, kPartitionBitmapSize);
+  Status s = summary_->Write(block_ * kPartitionSummarySize,
+                             Slice(buf, kPartitionSummarySize));
+  block_ = next_block;
+  memset(bitmap_, 0, kPartitionBitmapSize);
+  return s;
+}
+
+Status PartitionBinlogImpl::GetProducerStatus(uint32_t* filenum, uint64_t* pro_offset) {
+  return binlog_->GetProducerStatus(filenum, pro_offset);
+}
+
+Status PartitionBinlogImpl::Append(uint32_t partition, const std::string &item) {
+  MutexLock l(&mutex_);
+
+  std::string record;
+  PutVarint32(&record, partition);
+  record.append(item);
+
+  uint32_t filenum;
+  uint64_t start, end;
+  binlog_->GetProducerStatus(&filenum, &start);
+  Status s = binlog_->Append(record);
+  if (!s.ok()) {
+    return s;
+  }
+  binlog_->GetProducerStatus(&filenum, &end);
+
+  if (filenum != filenum_) {
+    // Rolled to a new binlog, the last block of the previous one is complete
+    s = FinishBlock(0);
+    if (s.ok()) {
+      s = OpenSummary(filenum);
+    }
+    if (!s.ok()) {
+      return s;
+    }
+    filenum_ = filenum;
+    start = 0;
+  }
+
+  // Mark every block the record lies in
+  uint64_t first = start / kBlockSize;
+  uint64_t last = end > 0 ? (end - 1) / kBlockSize : 0;
+  for (uint64_t block = first; block <= last; block++) {
+    if (block > block_) {
+      s = FinishBlock(block);
+      if (!s.ok()) {
+        return s;
+      }
+    }
+    MarkPartition(bitmap_, partition);
+  }
+  return Status::OK();
+}
+
+PartitionBinlogReader* PartitionBinlogImpl::NewPartitionReader(
+    uint32_t filenum, uint64_t offset, const std::vector<uint32_t>& partitions) {
+  BinlogReader* reader = binlog_->NewBinlogReader(filenum, offset);
+  if (reader == NULL) {
+    return NULL;
+  }
+  return new PartitionBinlogReaderImpl(
+      env_, path_, static_cast<BinlogReaderImpl*>(reader), partitions);
+}
+
+PartitionBinlogReaderImpl::PartitionBinlogReaderImpl(
+    Env* env, const std::string& path, BinlogReaderImpl* reader,
+    const std::vector<uint32_t>& partitions)
+  : env_(env),
+    path_(path),
+    reader_(reader),
+    partitions_(partitions),
+    summary_filenum_(0),
+    summary_(NULL) {
+  memset(bitmap_, 0, kPartitionBitmapSize);
+  for (size_t i = 0; i < partitions_.size(); i++) {
+    MarkPartition(bitmap_, partitions_[i]);
+  }
+  reader_->SetBlockFilter([this](uint32_t filenum, uint64_t block) {
+    return SkipBlock(filenum, block);
+  });
+}
+
+PartitionBinlogReaderImpl::~PartitionBinlogReaderImpl() {
+  delete summary_;
+  delete reader_;
+}
+
+bool PartitionBinlogReaderImpl::SkipBlock(uint32_t filenum, uint64_t block) {
+  if (summary_ == NULL || summary_filenum_ != filenum) {
+    delete summary_;
+    summary_ = NULL;
+    std::string summary = NewFileName(path_ + kPartitionSummaryPrefix, filenum);
+    if (!env_->FileExists(summary)
+        || !env_->NewRandomRWFile(summary, &summary_).ok()) {
+      return false;
+    }
+    summary_filenum_ = filenum;
+  }
+
+  char buf[kPartitionSummarySize];
+  Slice result;
+  Status s = summary_->Read(block * kPartitionSummarySize,
+                            kPartitionSummarySize, &result, buf);
+  if (!s.ok() || result.size() != kPartitionSummarySize
+      || DecodeFixed32(result.data()) != kPartitionSummaryMagic) {
+    // Block not complete yet
+    return false;
+  }
+  const char* bitmap = result.data() + 4;
+  for (size_t i = 0; i < kPartitionBitmapSize; i++) {
+    if (bitmap[i] & bitmap_[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Status PartitionBinlogReaderImpl::ReadRecord(uint32_t* partition, std::string &record) {
+  Status s;
+  while (true) {
+    s = reader_->ReadRecord(record);
+    if (!s.ok()) {
+      return s;
+    }
+    const char* p = GetVarint32Ptr(record.data(), record.data() + record.size(),
+                                   partition);
+    if (p == NULL) {
+      return Status::Corruption("partition record");
+    }
+    for (size_t i = 0; i < partitions_.size(); i++) {
+      if (partitions_[i] == *partition) {
+        record.erase(0, p - record.data());
+        return Status::OK();
+      }
+    }
+  }
+}
+
+}   // namespace slash
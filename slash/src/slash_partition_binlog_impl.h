@@ -0,0 +1,97 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef SLASH_PARTITION_BINLOG_IMPL_H_
+#define SLASH_PARTITION_BINLOG_IMPL_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "slash/include/env.h"
+#include "slash/include/slash_binlog.h"
+#include "slash/include/slash_mutex.h"
+#include "slash/src/slash_binlog_impl.h"
+
+namespace slash {
+
+// Every binlogN has a summary file partition_summaryN, which holds one entry
+// per complete block of binlogN:
+//   magic (4 bytes), partition bitmap (32 bytes)
+// Partition p is marked by bit (p % 256) of the bitmap.
+const std::string kPartitionSummaryPrefix = "partition_summary";
+const uint32_t kPartitionSummaryMagic = 0x70617274;
+const size_t kPartitionBitmapSize = 32;
+const size_t kPartitionSummarySize = 4 + kPartitionBitmapSize;
+
+class PartitionBinlogImpl : public PartitionBinlog {
+ public:
+  PartitionBinlogImpl(Env* env, const std::string& path);
+  virtual ~PartitionBinlogImpl();
+
+  virtual Status Append(uint32_t partition, const std::string &item);
+  virtual PartitionBinlogReader* NewPartitionReader(
+      uint32_t filenum, uint64_t offset,
+      const std::vector<uint32_t>& partitions);
+
+  virtual Status GetProducerStatus(uint32_t* filenum, uint64_t* pro_offset);
+
+ private:
+  friend class PartitionBinlog;
+
+  Status Recover();
+  // Persist the bitmap of current block, then move to the block
+  Status FinishBlock(uint64_t next_block);
+  Status OpenSummary(uint32_t filenum);
+
+  Env* env_;
+  Mutex mutex_;
+  std::string path_;
+  BinlogImpl* binlog_;
+
+  // Summary of the block being written
+  uint32_t filenum_;
+  uint64_t block_;
+  char bitmap_[kPartitionBitmapSize];
+  RandomRWFile* summary_;
+
+  // No copying allowed
+  PartitionBinlogImpl(const PartitionBinlogImpl&);
+  void operator=(const PartitionBinlogImpl&);
+};
+
+class PartitionBinlogReaderImpl : public PartitionBinlogReader {
+ public:
+  PartitionBinlogReaderImpl(Env* env, const std::string& path,
+                            BinlogReaderImpl* reader,
+                            const std::vector<uint32_t>& partitions);
+  virtual ~PartitionBinlogReaderImpl();
+
+  virtual Status ReadRecord(uint32_t* partition, std::string &record);
+
+  // Number of the blocks skipped by the partition summary
+  uint64_t skipped_blocks() const { return reader_->skipped_blocks(); }
+
+ private:
+  bool SkipBlock(uint32_t filenum, uint64_t block);
+
+  Env* env_;
+  std::string path_;
+  BinlogReaderImpl* reader_;
+  char bitmap_[kPartitionBitmapSize];
+  std::vector<uint32_t> partitions_;
+
+  // Summary of the binlog file being read
+  uint32_t summary_filenum_;
+  RandomRWFile* summary_;
+
+  // No copying allowed;
+  PartitionBinlogReaderImpl(const PartitionBinlogReaderImpl&);
+  void operator=(const PartitionBinlogReaderImpl&);
+};
+
+}   // namespace slash
+
+#endif  // SLASH_PARTITION_BINLOG_IMPL_H_
@@ -3,12 +3,18 @@
 // LICENSE file in the root directory of this source tree. An additional grant
 // of patent rights can be found in the PATENTS file in the same directory.
 #include <iostream>
+#include <vector>
+#include <unordered_set>
 
+#include "slash/include/delete_scheduler.h"
 #include "slash/include/env.h"
+#include "slash/include/rate_limiter.h"
+#include "slash/include/slash_coding.h"
 #include "slash/include/testutil.h"
 #include "slash/include/slash_testharness.h"
 #include "slash/include/slash_binlog.h"
 #include "slash/src/slash_binlog_impl.h"
+#include "slash/src/slash_partition_binlog_impl.h"
 
 namespace slash {
 
@@ -54,6 +60,30 @@ TEST(BinlogTest, ReadWrite) {
   ASSERT_EQ(item, item3);
 }
 
+TEST(BinlogTest, TailLiveFile) {
+  // The reader follows the writer on the file being appended, the data
+  // read ahead of the producer must not be cached
+  std::string item;
+  reader_ = log_->NewBinlogReader(0, 0);
+  ASSERT_TRUE(reader_);
+  for (int i = 0; i < 10; i++) {
+    std::string record = test_item_ + std::to_string(i);
+    ASSERT_OK(log_->Append(record));
+    ASSERT_OK(reader_->ReadRecord(item));
+    ASSERT_EQ(item, record);
+  }
+  // Records appended while the reader is still behind the producer
+  ASSERT_OK(log_->Append("a"));
+  ASSERT_OK(log_->Append("b"));
+  ASSERT_OK(reader_->ReadRecord(item));
+  ASSERT_EQ(item, "a");
+  ASSERT_OK(log_->Append("c"));
+  ASSERT_OK(reader_->ReadRecord(item));
+  ASSERT_EQ(item, "b");
+  ASSERT_OK(reader_->ReadRecord(item));
+  ASSERT_EQ(item, "c");
+}
+
 TEST(BinlogTest, OffsetTest) {
   std::string second_block_item = "sbi";
   uint64_t offset = 0;
@@ -91,4 +121,289 @@ TEST(BinlogTest, ProducerStatusOp) {
   ASSERT_EQ(pro_offset, 8790);
 }
 
+TEST(BinlogTest, CompactedReplay) {
+  // Items are "key:value", remember the binlog file each item landed in
+  std::vector<std::pair<uint32_t, std::string> > items;
+  uint32_t filenum = 0;
+  uint64_t pro_offset = 0;
+  for (int i = 0; i < 60; i++) {
+    std::string item = "k" + std::to_string(i % 7) + ":" + std::to_string(i);
+    ASSERT_OK(log_->Append(item));
+    log_->GetProducerStatus(&filenum, &pro_offset);
+    items.push_back(std::make_pair(filenum, item));
+  }
+  ASSERT_GT(filenum, 1u);
+  uint32_t end = filenum - 1;
+
+  KeyOf key_of = [](const Slice& record, std::string* key) {
+    const char* sep = static_cast<const char*>(memchr(record.data(), ':', record.size()));
+    if (sep == NULL) {
+      return false;
+    }
+    key->assign(record.data(), sep - record.data());
+    return true;
+  };
+  ASSERT_TRUE(!log_->Compact(0, filenum, key_of).ok());
+  ASSERT_OK(log_->Compact(0, end, key_of));
+
+  // Expect the last item of every key within [0, end], then the live items
+  std::vector<std::string> expect;
+  std::unordered_set<std::string> seen;
+  for (int i = items.size() - 1; i >= 0; i--) {
+    if (items[i].first > end) {
+      expect.insert(expect.begin(), items[i].second);
+    } else if (seen.insert(items[i].second.substr(0, 2)).second) {
+      expect.insert(expect.begin(), items[i].second);
+    }
+  }
+  ASSERT_LT(expect.size(), items.size());
+
+  reader_ = log_->NewCompactedReader(end);
+  ASSERT_TRUE(reader_);
+  std::string item;
+  for (size_t i = 0; i < expect.size(); i++) {
+    ASSERT_OK(reader_->ReadRecord(item));
+    ASSERT_EQ(item, expect[i]);
+  }
+}
+
+TEST(BinlogTest, ConsumerResume) {
+  uint32_t filenum;
+  uint64_t offset;
+  ASSERT_TRUE(log_->GetMinConsumerStatus(&filenum, &offset).IsNotFound());
+
+  // New consumer starts from the producer position
+  reader_ = log_->OpenConsumer("replica1");
+  ASSERT_TRUE(reader_);
+  ASSERT_TRUE(log_->OpenConsumer("replica1") == NULL);
+  for (int i = 0; i < 5; i++) {
+    ASSERT_OK(log_->Append(test_item_ + std::to_string(i)));
+  }
+
+  std::string item;
+  ASSERT_OK(reader_->ReadRecord(item));
+  ASSERT_EQ(item, test_item_ + "0");
+  ASSERT_OK(reader_->ReadRecord(item));
+  ASSERT_EQ(item, test_item_ + "1");
+  delete reader_;
+
+  ASSERT_OK(log_->GetMinConsumerStatus(&filenum, &offset));
+  ASSERT_TRUE(filenum > 0 || offset > 0);
+
+  reader_ = log_->OpenConsumer("replica1");
+  ASSERT_TRUE(reader_);
+  ASSERT_OK(reader_->ReadRecord(item));
+  ASSERT_EQ(item, test_item_ + "2");
+
+  ASSERT_TRUE(!log_->RemoveConsumer("replica1").ok());
+  delete reader_;
+  reader_ = NULL;
+  ASSERT_OK(log_->RemoveConsumer("replica1"));
+  ASSERT_TRUE(log_->GetMinConsumerStatus(&filenum, &offset).IsNotFound());
+}
+
+TEST(BinlogTest, ConsumerSlot) {
+  // The position is a single 8-byte word of the slot
+  std::string fname = tmpdir_ + "/consumer_slot";
+  RWFile* file;
+  ASSERT_OK(Env::Default()->NewRWFile(fname, &file));
+  Consumers consumers(file);
+  ASSERT_OK(consumers.Init());
+  int slot;
+  uint32_t filenum = 3;
+  uint64_t offset = 100;
+  ASSERT_OK(consumers.Acquire("replica1", &slot, &filenum, &offset));
+  consumers.Save(slot, 7, 0xfffffff0ULL);
+  uint64_t position;
+  memcpy(&position, file->GetData() + slot * kConsumerSlotSize
+         + kConsumerNameSize, sizeof(position));
+  ASSERT_EQ(position, (7ULL << 32) | 0xfffffff0ULL);
+  ASSERT_OK(consumers.GetMin(&filenum, &offset));
+  ASSERT_EQ(filenum, 7u);
+  ASSERT_EQ(offset, 0xfffffff0ULL);
+  consumers.Release(slot);
+  ASSERT_OK(consumers.Acquire("replica1", &slot, &filenum, &offset));
+  ASSERT_EQ(filenum, 7u);
+  ASSERT_EQ(offset, 0xfffffff0ULL);
+  delete file;
+}
+
+TEST(BinlogTest, MemEnvReadWrite) {
+  Env* env = NewMemEnv();
+  Binlog* log;
+  ASSERT_OK(Binlog::Open("/mem/binlog", &log, env));
+  for (int i = 0; i < 100; i++) {
+    ASSERT_OK(log->Append(test_item_ + std::to_string(i)));
+  }
+  ASSERT_TRUE(!FileExists("/mem/binlog"));
+
+  BinlogReader* reader = log->NewBinlogReader(0, 0);
+  ASSERT_TRUE(reader);
+  std::string item;
+  for (int i = 0; i < 100; i++) {
+    ASSERT_OK(reader->ReadRecord(item));
+    ASSERT_EQ(item, test_item_ + std::to_string(i));
+  }
+  delete reader;
+  delete log;
+  delete env;
+}
+
+TEST(BinlogTest, RateLimited) {
+  std::string dir = tmpdir_ + "/limited";
+  RateLimiter limiter(1 << 30);
+  Binlog* log;
+  ASSERT_OK(Binlog::Open(dir, &log, Env::Default(), &limiter));
+  ASSERT_OK(log->Append(test_item_));
+  // Append is not throttled
+  ASSERT_EQ(limiter.GetTotalBytesThrough(kIOPriorityTotal), 0);
+
+  BinlogReader* reader = log->NewBinlogReader(0, 0);
+  ASSERT_TRUE(reader);
+  std::string item;
+  ASSERT_OK(reader->ReadRecord(item));
+  ASSERT_EQ(item, test_item_);
+  int64_t read = limiter.GetTotalBytesThrough(kIOPriorityLow);
+  ASSERT_GE(read, static_cast<int64_t>(test_item_.size()));
+  delete reader;
+
+  // The filler of the blank written up to the producer offset
+  ASSERT_OK(log->SetProducerStatus(1, 2 * kBlockSize + 100));
+  ASSERT_EQ(limiter.GetTotalBytesThrough(kIOPriorityLow),
+            read + 2 * kBlockSize + 100);
+  ASSERT_EQ(limiter.GetTotalBytesThrough(kIOPriorityHigh), 0);
+  delete log;
+}
+
+TEST(BinlogTest, PurgeLogs) {
+  for (int i = 0; i < 200; i++) {
+    ASSERT_OK(log_->Append(test_item_ + std::to_string(i)));
+  }
+  uint32_t filenum;
+  uint64_t offset;
+  ASSERT_OK(log_->GetProducerStatus(&filenum, &offset));
+  ASSERT_GT(filenum, 3u);
+  ASSERT_TRUE(log_->PurgeLogs(filenum + 1).IsInvalidArgument());
+
+  ASSERT_OK(log_->PurgeLogs(2));
+  ASSERT_TRUE(!FileExists(NewFileName(tmpdir_ + "/" + kBinlogPrefix, 1)));
+  ASSERT_TRUE(FileExists(NewFileName(tmpdir_ + "/" + kBinlogPrefix, 2)));
+
+  DeleteScheduler scheduler(tmpdir_ + "/trash", 0);
+  ASSERT_OK(scheduler.Start());
+  ASSERT_OK(log_->PurgeLogs(filenum, &scheduler));
+  scheduler.WaitForEmptyTrash();
+  for (uint32_t i = 0; i < filenum; i++) {
+    ASSERT_TRUE(!FileExists(NewFileName(tmpdir_ + "/" + kBinlogPrefix, i)));
+  }
+  std::vector<std::string> trash;
+  ASSERT_EQ(0, GetChildren(tmpdir_ + "/trash", trash));
+  ASSERT_EQ(trash.size(), 0u);
+
+  // Readers from the purged files fail, the current one still works
+  reader_ = log_->NewBinlogReader(filenum, 0);
+  ASSERT_TRUE(reader_);
+  std::string item;
+  ASSERT_OK(log_->Append("after purge"));
+  ASSERT_OK(reader_->ReadRecord(item));
+}
+
+static std::string ReadAll(const std::string& fname) {
+  std::string data;
+  SequentialFile* file;
+  if (!NewSequentialFile(fname, &file).ok()) {
+    return data;
+  }
+  char scratch[4096];
+  Slice result;
+  Status s;
+  do {
+    s = file->Read(sizeof(scratch), &result, scratch);
+    data.append(result.data(), result.size());
+  } while (s.ok() && result.size() > 0);
+  delete file;
+  return data;
+}
+
+class PartitionBinlogTest {
+ public:
+  PartitionBinlogTest()
+    : log_(NULL),
+      reader_(NULL) {
+    GetTestDirectory(&tmpdir_);
+    tmpdir_ += "/partition";
+    DeleteDirIfExist(tmpdir_);
+    CreatePath(tmpdir_);
+    ASSERT_OK(PartitionBinlog::Open(tmpdir_, &log_));
+  }
+  ~PartitionBinlogTest() {
+    delete reader_;
+    delete log_;
+    DeleteDirIfExist(tmpdir_);
+  }
+ protected:
+  PartitionBinlog *log_;
+  PartitionBinlogReader *reader_;
+  std::string tmpdir_;
+};
+
+TEST(PartitionBinlogTest, PartitionRead) {
+  // Large items of partition 1 span whole blocks, which should be skipped
+  std::vector<std::pair<uint32_t, std::string> > items;
+  for (int i = 0; i < 20; i++) {
+    uint32_t partition = i % 3;
+    std::string item = std::to_string(i) + ":";
+    item.append(partition == 1 ? 3 * kBlockSize : 100, 'a' + partition);
+    ASSERT_OK(log_->Append(partition, item));
+    items.push_back(std::make_pair(partition, item));
+  }
+
+  std::vector<uint32_t> subscribed = {0, 2};
+  reader_ = log_->NewPartitionReader(0, 0, subscribed);
+  ASSERT_TRUE(reader_);
+  uint32_t partition;
+  std::string item;
+  for (size_t i = 0; i < items.size(); i++) {
+    if (items[i].first == 1) {
+      continue;
+    }
+    ASSERT_OK(reader_->ReadRecord(&partition, item));
+    ASSERT_EQ(partition, items[i].first);
+    ASSERT_EQ(item, items[i].second);
+  }
+
+  // Read past the blocks of the last item
+  ASSERT_OK(log_->Append(0, "end"));
+  ASSERT_OK(reader_->ReadRecord(&partition, item));
+  ASSERT_EQ(item, "end");
+
+  // The blocks of partition 1 only are marked so in the summaries, and
+  // these are the blocks the reader skipped
+  uint32_t filenum;
+  uint64_t offset;
+  ASSERT_OK(log_->GetProducerStatus(&filenum, &offset));
+  std::string only1(kPartitionBitmapSize, '\0');
+  only1[0] = 1 << 1;
+  uint64_t blocks = 0;
+  uint64_t partition1_blocks = 0;
+  for (uint32_t n = 0; n <= filenum; n++) {
+    std::string summary = ReadAll(
+        NewFileName(tmpdir_ + "/" + kPartitionSummaryPrefix, n));
+    ASSERT_EQ(summary.size() % kPartitionSummarySize, 0u);
+    for (size_t pos = 0; pos < summary.size();
+         pos += kPartitionSummarySize) {
+      ASSERT_EQ(DecodeFixed32(summary.data() + pos), kPartitionSummaryMagic);
+      std::string bitmap(summary.data() + pos + 4, kPartitionBitmapSize);
+      if (bitmap == only1) {
+        partition1_blocks++;
+      }
+      blocks++;
+    }
+  }
+  ASSERT_GT(partition1_blocks, 0u);
+  ASSERT_LT(partition1_blocks, blocks);
+  ASSERT_EQ(static_cast<PartitionBinlogReaderImpl*>(reader_)->skipped_blocks(),
+            partition1_blocks);
+}
+
 }  // namespace slash
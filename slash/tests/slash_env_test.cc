@@ -7,7 +7,21 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "slash/include/async_io.h"
+#include "slash/include/cond_lock.h"
+#include "slash/include/delete_scheduler.h"
 #include "slash/include/env.h"
+#include "slash/include/fault_injection_env.h"
+#include "slash/include/file_cache.h"
+#include "slash/include/io_engine.h"
+#include "slash/include/io_stats.h"
+#include "slash/include/rate_limiter.h"
+#include "slash/include/slash_mutex.h"
 #include "slash/include/testutil.h"
 #include "slash/include/slash_testharness.h"
 
@@ -30,4 +44,1461 @@ TEST(EnvTest, FileOps) {
   ASSERT_NE(0, SetMaxFileDescriptorNum(2147483647));
 }
 
+static void* CreateLater(void* arg) {
+  SleepForMicroseconds(50000);
+  WritableFile* file;
+  if (NewWritableFile(*reinterpret_cast<std::string*>(arg), &file).ok()) {
+    delete file;
+  }
+  return NULL;
+}
+
+TEST(EnvTest, DirWatcher) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+
+  DirWatcher watcher(tmp_dir);
+  ASSERT_OK(watcher.Start());
+  ASSERT_TRUE(!watcher.WaitForFile("watched", 10));
+
+  std::string fname = tmp_dir + "/watched";
+  pthread_t tid;
+  pthread_create(&tid, NULL, &CreateLater, &fname);
+  uint64_t start = NowMicros();
+  ASSERT_TRUE(watcher.WaitForFile("watched", 5000));
+  ASSERT_LT(NowMicros() - start, 5000000ULL);
+  pthread_join(tid, NULL);
+
+  uint64_t gen = watcher.generation();
+  ASSERT_OK(DeleteFile(fname));
+  ASSERT_TRUE(watcher.WaitForChange(gen, 5000));
+  DeleteDirIfExist(tmp_dir);
+}
+
+TEST(EnvTest, MemEnv) {
+  Env* env = NewMemEnv();
+  ASSERT_EQ(0, env->CreateDir("/mem/dir"));
+  ASSERT_TRUE(env->FileExists("/mem/dir/"));
+  ASSERT_TRUE(!env->FileExists("/mem/dir/file"));
+
+  WritableFile* writable;
+  ASSERT_OK(env->NewWritableFile("/mem/dir/file", &writable));
+  ASSERT_OK(writable->Append("hello\n"));
+  ASSERT_OK(writable->Append("world"));
+  ASSERT_EQ(writable->Filesize(), 11u);
+  delete writable;
+  ASSERT_TRUE(!FileExists("/mem/dir/file"));
+
+  std::vector<std::string> children;
+  ASSERT_EQ(0, env->GetChildren("/mem/dir", children));
+  ASSERT_EQ(children.size(), 1u);
+  ASSERT_EQ(children[0], "file");
+
+  SequentialFile* sequential;
+  char buf[16];
+  ASSERT_OK(env->NewSequentialFile("/mem/dir/file", &sequential));
+  ASSERT_EQ(std::string(sequential->ReadLine(buf, sizeof(buf))), "hello\n");
+  Slice result;
+  ASSERT_TRUE(sequential->Read(sizeof(buf), &result, buf).IsEndFile());
+  ASSERT_EQ(result.ToString(), "world");
+  delete sequential;
+
+  ASSERT_OK(env->AppendWritableFile("/mem/dir/file", &writable, 5));
+  ASSERT_OK(writable->Append("!"));
+  delete writable;
+  RandomRWFile* random;
+  ASSERT_OK(env->NewRandomRWFile("/mem/dir/file", &random));
+  ASSERT_OK(random->Read(0, sizeof(buf), &result, buf));
+  ASSERT_EQ(result.ToString(), "hello!");
+  delete random;
+
+  ASSERT_EQ(0, env->RenameFile("/mem/dir/file", "/mem/dir/file2"));
+  ASSERT_TRUE(env->FileExists("/mem/dir/file2"));
+  ASSERT_OK(env->DeleteFile("/mem/dir/file2"));
+  ASSERT_TRUE(!env->FileExists("/mem/dir/file2"));
+  delete env;
+}
+
+TEST(EnvTest, BufferedWritableFile) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  std::string fname = tmp_dir + "/buffered";
+
+  EnvOptions options;
+  options.use_mmap_writes = false;
+  options.writable_file_buffer_size = 16;
+  WritableFile* writable;
+  ASSERT_OK(NewWritableFile(fname, &writable, options));
+  ASSERT_OK(writable->Append("0123456789"));
+  // Fill up the buffer, then bypass it
+  ASSERT_OK(writable->Append("abcdefghij"));
+  ASSERT_OK(writable->Append(std::string(40, 'x')));
+  ASSERT_EQ(writable->Filesize(), 60u);
+  ASSERT_OK(writable->Sync());
+  ASSERT_OK(writable->Trim(20));
+  ASSERT_OK(writable->Append("tail"));
+  ASSERT_OK(writable->Close());
+  delete writable;
+
+  // Continue at write_len and drop the rest on close
+  ASSERT_OK(AppendWritableFile(fname, &writable, 10, options));
+  ASSERT_OK(writable->Append("ABC"));
+  delete writable;
+
+  SequentialFile* sequential;
+  char buf[64];
+  Slice result;
+  ASSERT_OK(NewSequentialFile(fname, &sequential));
+  sequential->Read(sizeof(buf), &result, buf);
+  ASSERT_EQ(result.ToString(), "0123456789ABC");
+  delete sequential;
+  DeleteDirIfExist(tmp_dir);
+}
+
+static void TestDirectIO(const std::string& dir) {
+  ASSERT_EQ(0, CreatePath(dir));
+  std::string fname = dir + "/direct";
+
+  EnvOptions options;
+  options.use_direct_writes = true;
+  options.use_direct_reads = true;
+  options.direct_io_buffer_size = 8192;
+  std::string expected;
+  WritableFile* writable;
+  ASSERT_OK(NewWritableFile(fname, &writable, options));
+  for (int i = 0; i < 1000; i++) {
+    std::string line = "line" + std::to_string(i) + "\n";
+    ASSERT_OK(writable->Append(line));
+    expected.append(line);
+    if (i % 100 == 0) {
+      ASSERT_OK(writable->Flush());
+    }
+  }
+  ASSERT_EQ(writable->Filesize(), expected.size());
+  ASSERT_OK(writable->Sync());
+  delete writable;
+
+  // Continue at an unaligned offset, the padding is truncated on close
+  expected.resize(5000);
+  ASSERT_OK(AppendWritableFile(fname, &writable, expected.size(), options));
+  ASSERT_OK(writable->Append("tail"));
+  expected.append("tail");
+  ASSERT_OK(writable->Close());
+  delete writable;
+
+  // Read it back with page cache and O_DIRECT
+  SequentialFile* sequential;
+  std::string scratch(expected.size() + 10, '\0');
+  Slice result;
+  ASSERT_OK(NewSequentialFile(fname, &sequential));
+  ASSERT_TRUE(sequential->Read(scratch.size(), &result, &scratch[0]).IsEndFile());
+  ASSERT_EQ(result.ToString(), expected);
+  delete sequential;
+
+  char line[32];
+  ASSERT_OK(NewSequentialFile(fname, &sequential, options));
+  ASSERT_EQ(std::string(sequential->ReadLine(line, sizeof(line))), "line0\n");
+  ASSERT_OK(sequential->Skip(4990 - 6));
+  ASSERT_OK(sequential->Read(10, &result, &scratch[0]));
+  ASSERT_EQ(result.ToString(), expected.substr(4990, 10));
+  ASSERT_TRUE(sequential->Read(10, &result, &scratch[0]).IsEndFile());
+  ASSERT_EQ(result.ToString(), "tail");
+  delete sequential;
+  DeleteDirIfExist(dir);
+}
+
+TEST(EnvTest, DirectIO) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  TestDirectIO(tmp_dir);
+  // tmpfs rejects O_DIRECT before linux 6.6
+  if (IsDir("/dev/shm") == 0) {
+    TestDirectIO("/dev/shm/slash_direct_test");
+  }
+}
+
+static void TestIOEngine(const std::string& dir, bool force_fallback) {
+  ASSERT_EQ(0, CreatePath(dir));
+  std::string fname = dir + "/engine";
+
+  IOEngine* engine;
+  ASSERT_OK(IOEngine::Open(8, &engine, force_fallback));
+  if (force_fallback) {
+    ASSERT_TRUE(!engine->IsUring());
+  }
+  RandomRWFile* file;
+  ASSERT_OK(NewRandomRWFile(fname, &file));
+
+  // A batch of writes from registered buffers
+  const int kBlocks = 8;
+  const size_t kBlockSize = 4096;
+  std::vector<std::string> blocks(kBlocks);
+  std::vector<struct iovec> iov(kBlocks);
+  IORequest reqs[kBlocks];
+  for (int i = 0; i < kBlocks; i++) {
+    blocks[i].assign(kBlockSize, 'a' + i);
+    iov[i].iov_base = &blocks[i][0];
+    iov[i].iov_len = kBlockSize;
+    ASSERT_OK(file->PrepareWrite(i * kBlockSize, blocks[i], &reqs[i]));
+    reqs[i].buf_index = i;
+    reqs[i].user_data = &blocks[i];
+  }
+  ASSERT_OK(engine->RegisterBuffers(iov));
+  for (int i = 0; i < kBlocks; i++) {
+    ASSERT_OK(engine->Prepare(&reqs[i]));
+  }
+  IORequest full;
+  ASSERT_TRUE(engine->Prepare(&full).IsIncomplete());
+  int n;
+  ASSERT_OK(engine->Submit(&n));
+  ASSERT_EQ(n, kBlocks);
+
+  struct pollfd pfd;
+  pfd.fd = engine->eventfd();
+  pfd.events = POLLIN;
+  ASSERT_EQ(1, poll(&pfd, 1, 5000));
+  IORequest* done[kBlocks];
+  int reaped = 0;
+  while (reaped < kBlocks) {
+    ASSERT_OK(engine->Reap(done + reaped, kBlocks - reaped, 1, &n));
+    reaped += n;
+  }
+  for (int i = 0; i < kBlocks; i++) {
+    ASSERT_EQ(done[i]->result, static_cast<ssize_t>(kBlockSize));
+  }
+  ASSERT_EQ(engine->inflight(), 0u);
+  ASSERT_OK(engine->RegisterBuffers(std::vector<struct iovec>()));
+
+  IORequest req;
+  ASSERT_OK(file->PrepareSync(&req));
+  ASSERT_OK(engine->Execute(&req));
+  req = IORequest();
+  req.op = IORequest::kFallocate;
+  req.fd = reqs[0].fd;
+  req.offset = kBlocks * kBlockSize;
+  req.len = kBlockSize;
+  ASSERT_OK(engine->Execute(&req));
+
+  char buf[kBlockSize];
+  req = IORequest();
+  ASSERT_OK(file->PrepareRead(3 * kBlockSize, kBlockSize, buf, &req));
+  ASSERT_OK(engine->Execute(&req));
+  ASSERT_EQ(std::string(buf, req.result), blocks[3]);
+  req = IORequest();
+  ASSERT_OK(file->PrepareRead(kBlocks * kBlockSize, kBlockSize, buf, &req));
+  ASSERT_OK(engine->Execute(&req));
+  ASSERT_EQ(std::string(buf, req.result), std::string(kBlockSize, '\0'));
+  delete file;
+  delete engine;
+  DeleteDirIfExist(dir);
+}
+
+TEST(EnvTest, IOEngine) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  TestIOEngine(tmp_dir, false);
+  TestIOEngine(tmp_dir, true);
+}
+
+TEST(EnvTest, AsyncWritableFile) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  std::string fname = tmp_dir + "/async";
+
+  EnvOptions options;
+  options.use_async_writes = true;
+  options.writable_file_buffer_size = 100;
+  options.async_write_depth = 3;
+  std::string expected;
+  WritableFile* writable;
+  ASSERT_OK(NewWritableFile(fname, &writable, options));
+  for (int i = 0; i < 1000; i++) {
+    std::string record = "record" + std::to_string(i);
+    ASSERT_OK(writable->Append(record));
+    expected.append(record);
+  }
+  ASSERT_EQ(writable->Filesize(), expected.size());
+  ASSERT_OK(writable->Sync());
+  delete writable;
+
+  ASSERT_OK(AppendWritableFile(fname, &writable, 10, options));
+  ASSERT_OK(writable->Append("tail"));
+  delete writable;
+  expected.resize(10);
+  expected.append("tail");
+
+  SequentialFile* sequential;
+  char buf[64];
+  Slice result;
+  ASSERT_OK(NewSequentialFile(fname, &sequential));
+  sequential->Read(sizeof(buf), &result, buf);
+  ASSERT_EQ(result.ToString(), expected);
+  delete sequential;
+  DeleteDirIfExist(tmp_dir);
+}
+
+static void TestRandomAccessFile(const std::string& fname,
+                                 const EnvOptions& options) {
+  RandomAccessFile* file;
+  ASSERT_OK(NewRandomAccessFile(fname, &file, options));
+  char scratch[16];
+  Slice result;
+  ASSERT_OK(file->Read(10, 5, &result, scratch));
+  ASSERT_EQ(result.ToString(), "01234");
+  if (options.use_mmap_reads) {
+    // Zero copy
+    ASSERT_TRUE(result.data() != scratch);
+  }
+  ASSERT_OK(file->Read(9995, 10, &result, scratch));
+  ASSERT_EQ(result.ToString(), "56789");
+  ASSERT_OK(file->Read(20000, 10, &result, scratch));
+  ASSERT_EQ(result.size(), 0u);
+
+  // Unsorted, adjacent, overlapped and far away ranges
+  const uint64_t offsets[] = { 300, 100, 110, 105, 9000, 9998, 30000 };
+  const size_t kNum = sizeof(offsets) / sizeof(offsets[0]);
+  ReadRequest reqs[kNum];
+  char bufs[kNum][10];
+  for (size_t i = 0; i < kNum; i++) {
+    reqs[i].offset = offsets[i];
+    reqs[i].len = 10;
+    reqs[i].scratch = bufs[i];
+  }
+  ASSERT_OK(file->MultiRead(reqs, kNum));
+  for (size_t i = 0; i < kNum; i++) {
+    ASSERT_OK(reqs[i].status);
+    std::string expected;
+    for (uint64_t off = offsets[i]; off < offsets[i] + 10 && off < 10000; off++) {
+      expected.push_back('0' + off % 10);
+    }
+    ASSERT_EQ(reqs[i].result.ToString(), expected);
+  }
+  delete file;
+}
+
+TEST(EnvTest, RandomAccessFile) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  std::string fname = tmp_dir + "/random_access";
+  WritableFile* writable;
+  ASSERT_OK(NewWritableFile(fname, &writable));
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_OK(writable->Append(std::string(1, '0' + i % 10)));
+  }
+  delete writable;
+
+  EnvOptions options;
+  TestRandomAccessFile(fname, options);
+  options.access_pattern = EnvOptions::kRandom;
+  TestRandomAccessFile(fname, options);
+  options.use_mmap_reads = true;
+  TestRandomAccessFile(fname, options);
+  options.populate_mmap_reads = true;
+  options.access_pattern = EnvOptions::kWillNeed;
+  TestRandomAccessFile(fname, options);
+
+  RandomAccessFile* file;
+  ASSERT_TRUE(!NewRandomAccessFile(tmp_dir + "/missing", &file).ok());
+  DeleteDirIfExist(tmp_dir);
+}
+
+static void WriteFile(const std::string& fname, size_t size) {
+  WritableFile* writable;
+  ASSERT_OK(NewWritableFile(fname, &writable));
+  ASSERT_OK(writable->Append(std::string(size, 'x')));
+  delete writable;
+}
+
+TEST(EnvTest, DirWalk) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  std::string root = tmp_dir + "/root";
+  std::string outside = tmp_dir + "/outside";
+  ASSERT_EQ(0, CreatePath(outside));
+  WriteFile(outside + "/kept", 10);
+
+  // 8 directories of 2 levels, each with 3 files
+  uint64_t files_size = 0;
+  for (int i = 0; i < 8; i++) {
+    std::string dir = root + "/d" + std::to_string(i) + "/sub";
+    ASSERT_EQ(0, CreatePath(dir));
+    for (int j = 0; j < 3; j++) {
+      WriteFile(dir + "/f" + std::to_string(j), 100 + j);
+      files_size += 100 + j;
+    }
+  }
+  ASSERT_EQ(0, symlink(outside.c_str(), (root + "/link").c_str()));
+  ASSERT_EQ(0, IsDir(root + "/link"));
+  ASSERT_EQ(1, IsDir(outside + "/kept"));
+
+  std::vector<std::string> files;
+  ASSERT_TRUE(GetDescendant(root, files));
+  ASSERT_EQ(files.size(), 8u * 3 + 1);
+
+  // Directory sizes are counted as well
+  uint64_t size = Du(root);
+  ASSERT_GT(size, files_size + 10);
+
+  DuCache cache(root);
+  ASSERT_EQ(cache.Du(), size);
+  WriteFile(root + "/d3/sub/new", 1000);
+  ASSERT_EQ(cache.Du(), Du(root));
+  ASSERT_EQ(cache.Du(), size + 1000);
+  ASSERT_EQ(0, DeleteDir(root + "/d5"));
+  ASSERT_EQ(cache.Du(), Du(root));
+  ASSERT_EQ(cache.Du(), Du(root));
+
+  // Files grown in place are seen after Invalidate
+  WriteFile(root + "/d3/sub/new", 3000);
+  cache.Invalidate("d3/sub");
+  ASSERT_EQ(cache.Du(), Du(root));
+
+  // Symbolic links are removed but not followed
+  ASSERT_EQ(0, DeleteDir(root));
+  ASSERT_TRUE(!FileExists(root));
+  ASSERT_TRUE(FileExists(outside + "/kept"));
+  ASSERT_EQ(-1, DeleteDir(root));
+  ASSERT_TRUE(!GetDescendant(root, files));
+  DeleteDirIfExist(tmp_dir);
+}
+
+TEST(EnvTest, DeleteScheduler) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  std::string trash_dir = tmp_dir + "/trash";
+  ASSERT_EQ(0, CreatePath(trash_dir));
+  // Left in trash before restart
+  WriteFile(trash_dir + "/old.0.trash", 100);
+  WriteFile(tmp_dir + "/file", 1000);
+  ASSERT_EQ(0, CreatePath(tmp_dir + "/dir/sub"));
+  WriteFile(tmp_dir + "/dir/sub/file", 1000);
+  WriteFile(tmp_dir + "/kept", 10);
+  ASSERT_EQ(0, symlink((tmp_dir + "/kept").c_str(),
+                       (tmp_dir + "/dir/link").c_str()));
+
+  // 1000 bytes per 100ms
+  DeleteScheduler scheduler(trash_dir, 10000);
+  ASSERT_OK(scheduler.Start());
+  uint64_t start = NowMicros();
+  ASSERT_OK(scheduler.Delete(tmp_dir + "/file"));
+  ASSERT_TRUE(!FileExists(tmp_dir + "/file"));
+  ASSERT_TRUE(DeleteDirIfExist(tmp_dir + "/dir", &scheduler));
+  ASSERT_TRUE(!FileExists(tmp_dir + "/dir"));
+  ASSERT_TRUE(scheduler.Delete(tmp_dir + "/missing").IsNotFound());
+  scheduler.WaitForEmptyTrash();
+  ASSERT_GT(NowMicros() - start, 150000u);
+
+  std::vector<std::string> trash;
+  ASSERT_EQ(0, GetChildren(trash_dir, trash));
+  ASSERT_EQ(trash.size(), 0u);
+  ASSERT_TRUE(FileExists(tmp_dir + "/kept"));
+
+  // A file open while deleted without truncation keeps its data
+  std::string open_file = tmp_dir + "/open";
+  int fd = open(open_file.c_str(), O_RDWR | O_CREAT, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(0, ftruncate(fd, 3 * (64 << 20)));
+  ASSERT_EQ(1, pwrite(fd, "x", 1, 0));
+  ASSERT_OK(scheduler.Delete(open_file, false));
+  scheduler.WaitForEmptyTrash();
+  ASSERT_TRUE(!FileExists(open_file));
+  struct stat st;
+  ASSERT_EQ(0, fstat(fd, &st));
+  ASSERT_EQ(st.st_size, 3 * (64 << 20));
+  char c = 0;
+  ASSERT_EQ(1, pread(fd, &c, 1, 0));
+  ASSERT_EQ(c, 'x');
+  close(fd);
+  DeleteDirIfExist(tmp_dir);
+}
+
+struct RateLimiterArg {
+  RateLimiter* limiter;
+  IOPriority priority;
+  uint64_t finish;
+};
+
+static void* RequestLater(void* arg) {
+  RateLimiterArg* a = reinterpret_cast<RateLimiterArg*>(arg);
+  a->limiter->Request(50000, a->priority);
+  a->finish = NowMicros();
+  return NULL;
+}
+
+TEST(EnvTest, RateLimiter) {
+  // 10000 bytes per 10ms
+  RateLimiter limiter(1000000, 10000);
+  ASSERT_EQ(limiter.GetSingleBurstBytes(), 10000);
+  uint64_t start = NowMicros();
+  limiter.Request(200000, kIOPriorityLow);
+  ASSERT_GT(NowMicros() - start, 150000u);
+  ASSERT_EQ(limiter.GetTotalBytesThrough(kIOPriorityLow), 200000);
+  ASSERT_EQ(limiter.GetTotalRequests(kIOPriorityLow), 1);
+
+  // High priority is served first while both wait
+  RateLimiterArg low = { &limiter, kIOPriorityLow, 0 };
+  RateLimiterArg high = { &limiter, kIOPriorityHigh, 0 };
+  pthread_t low_tid, high_tid;
+  limiter.Request(10000, kIOPriorityLow);
+  ASSERT_EQ(0, pthread_create(&low_tid, NULL, RequestLater, &low));
+  SleepForMicroseconds(2000);
+  ASSERT_EQ(0, pthread_create(&high_tid, NULL, RequestLater, &high));
+  pthread_join(low_tid, NULL);
+  pthread_join(high_tid, NULL);
+  ASSERT_LT(high.finish, low.finish);
+  ASSERT_EQ(limiter.GetTotalBytesThrough(kIOPriorityHigh), 50000);
+  ASSERT_EQ(limiter.GetTotalBytesThrough(kIOPriorityTotal), 310000);
+
+  // Auto tuning lowers the rate when idle
+  RateLimiter tuned(1000000, 1000, 10, true);
+  for (int i = 0; i < 200; i++) {
+    tuned.Request(1, kIOPriorityHigh);
+    SleepForMicroseconds(1000);
+  }
+  ASSERT_LT(tuned.GetBytesPerSecond(), 1000000);
+  ASSERT_GE(tuned.GetBytesPerSecond(), 1000000 / 20);
+
+  // Deleting the limiter lets the waiters go and waits for them to return
+  RateLimiter* slow = new RateLimiter(1000, 10000);
+  RateLimiterArg waiter = { slow, kIOPriorityLow, 0 };
+  pthread_t waiter_tid;
+  ASSERT_EQ(0, pthread_create(&waiter_tid, NULL, RequestLater, &waiter));
+  SleepForMicroseconds(20000);
+  start = NowMicros();
+  delete slow;
+  ASSERT_LT(NowMicros() - start, 5000000ULL);
+  pthread_join(waiter_tid, NULL);
+  ASSERT_GT(waiter.finish, 0ULL);
+}
+
+TEST(EnvTest, RateLimitedFile) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  std::string fname = tmp_dir + "/file";
+
+  RateLimiter limiter(1000000, 10000);
+  EnvOptions options;
+  options.use_mmap_writes = false;
+  options.rate_limiter = &limiter;
+  options.rate_limiter_priority = kIOPriorityHigh;
+  WritableFile* writable;
+  ASSERT_OK(NewWritableFile(fname, &writable, options));
+  std::string data(1000, 'x');
+  for (int i = 0; i < 100; i++) {
+    ASSERT_OK(writable->Append(data));
+  }
+  ASSERT_OK(writable->Close());
+  delete writable;
+  ASSERT_EQ(limiter.GetTotalBytesThrough(kIOPriorityHigh), 100000);
+  ASSERT_EQ(limiter.GetTotalRequests(kIOPriorityHigh), 100);
+
+  options.rate_limiter_priority = kIOPriorityLow;
+  SequentialFile* sequential;
+  ASSERT_OK(NewSequentialFile(fname, &sequential, options));
+  char scratch[4096];
+  Slice result;
+  Status s = sequential->Read(sizeof(scratch), &result, scratch);
+  while (s.ok()) {
+    s = sequential->Read(sizeof(scratch), &result, scratch);
+  }
+  ASSERT_TRUE(s.IsEndFile());
+  delete sequential;
+  ASSERT_EQ(limiter.GetTotalBytesThrough(kIOPriorityLow), 100000);
+  DeleteDirIfExist(tmp_dir);
+}
+
+#ifndef SLASH_NIOSTATS
+TEST(EnvTest, IOStats) {
+  ASSERT_TRUE(GetIOFileType("/data/log/binlog12") == kIOFileBinlog);
+  ASSERT_TRUE(GetIOFileType("manifest") == kIOFileManifest);
+  ASSERT_TRUE(GetIOFileType("/data/slash.conf") == kIOFileConf);
+  ASSERT_TRUE(GetIOFileType("/data/binlog/file") == kIOFileOther);
+
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  IOStatsContext* ctx = GetIOStatsContext();
+  ctx->Reset();
+  ResetFileTypeIOStats();
+
+  // Nothing is recorded by default
+  WritableFile* writable;
+  ASSERT_OK(NewWritableFile(tmp_dir + "/binlog0", &writable));
+  ASSERT_OK(writable->Append(std::string(10000, 'x')));
+  ASSERT_OK(writable->Sync());
+  ASSERT_OK(writable->Close());
+  delete writable;
+  ASSERT_EQ(ctx->bytes_written, 0u);
+  ASSERT_EQ(ctx->syscalls, 0u);
+
+  SetIOStatsLevel(kIOStatsEnableAll);
+  ASSERT_OK(NewWritableFile(tmp_dir + "/binlog0", &writable));
+  ASSERT_OK(writable->Append(std::string(10000, 'x')));
+  ASSERT_OK(writable->Sync());
+  ASSERT_OK(writable->Close());
+  delete writable;
+  ASSERT_EQ(ctx->bytes_written, 10000u);
+  ASSERT_GT(ctx->mmap_nanos, 0u);
+  ASSERT_GT(ctx->fallocate_nanos, 0u);
+  ASSERT_GT(ctx->msync_nanos, 0u);
+  ASSERT_GT(ctx->page_faults, 0u);
+
+  EnvOptions options;
+  options.use_mmap_writes = false;
+  ASSERT_OK(NewWritableFile(tmp_dir + "/slash.conf", &writable, options));
+  ASSERT_OK(writable->Append(std::string(5000, 'x')));
+  ASSERT_OK(writable->Sync());
+  ASSERT_OK(writable->Close());
+  delete writable;
+  ASSERT_EQ(ctx->bytes_written, 15000u);
+  ASSERT_GT(ctx->pwrite_nanos, 0u);
+  ASSERT_GT(ctx->fdatasync_nanos, 0u);
+
+  RandomAccessFile* file;
+  ASSERT_OK(NewRandomAccessFile(tmp_dir + "/slash.conf", &file));
+  char scratch[1000];
+  Slice result;
+  ASSERT_OK(file->Read(100, sizeof(scratch), &result, scratch));
+  delete file;
+  ASSERT_EQ(ctx->bytes_read, 1000u);
+  ASSERT_GT(ctx->pread_nanos, 0u);
+
+  FileTypeIOStats stats;
+  GetFileTypeIOStats(kIOFileBinlog, &stats);
+  ASSERT_EQ(stats.bytes_written, 10000u);
+  ASSERT_EQ(stats.bytes_read, 0u);
+  GetFileTypeIOStats(kIOFileConf, &stats);
+  ASSERT_EQ(stats.bytes_written, 5000u);
+  ASSERT_EQ(stats.bytes_read, 1000u);
+  ASSERT_GE(stats.syscalls, 3u);
+  GetFileTypeIOStats(kIOFileManifest, &stats);
+  ASSERT_EQ(stats.syscalls, 0u);
+
+  // Counted per thread
+  uint64_t syscalls = ctx->syscalls;
+  ASSERT_GT(syscalls, 0u);
+  SetIOStatsLevel(kIOStatsDisable);
+  ctx->Reset();
+  ASSERT_EQ(ctx->syscalls, 0u);
+  DeleteDirIfExist(tmp_dir);
+}
+#endif
+
+#ifndef SLASH_NIOSTATS
+static uint64_t RangeSyncNanos(const std::string& fname, bool mmap,
+                               uint64_t bytes_per_sync) {
+  EnvOptions options;
+  options.use_mmap_writes = mmap;
+  options.bytes_per_sync = bytes_per_sync;
+  IOStatsContext* ctx = GetIOStatsContext();
+  ctx->Reset();
+  SetIOStatsLevel(kIOStatsEnableTime);
+  WritableFile* file;
+  ASSERT_OK(NewWritableFile(fname, &file, options));
+  Status s;
+  std::string record(1000, 'x');
+  for (int i = 0; s.ok() && i < 1000; i++) {
+    s = file->Append(record);
+    if (s.ok()) {
+      s = file->Flush();
+    }
+  }
+  if (s.ok()) {
+    s = file->Sync();
+  }
+  ASSERT_OK(s);
+  ASSERT_OK(file->Close());
+  delete file;
+  SetIOStatsLevel(kIOStatsDisable);
+  return ctx->range_sync_nanos;
+}
+
+TEST(EnvTest, RangeSync) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  ASSERT_EQ(RangeSyncNanos(tmp_dir + "/mmap", true, 0), 0u);
+  ASSERT_GT(RangeSyncNanos(tmp_dir + "/mmap", true, 64 * 1024), 0u);
+  ASSERT_EQ(RangeSyncNanos(tmp_dir + "/buffered", false, 0), 0u);
+  ASSERT_GT(RangeSyncNanos(tmp_dir + "/buffered", false, 64 * 1024), 0u);
+
+  // The data is intact after appending to an existing file
+  EnvOptions options;
+  options.bytes_per_sync = 4096;
+  WritableFile* file;
+  ASSERT_OK(AppendWritableFile(tmp_dir + "/mmap", &file, 1000000, options));
+  ASSERT_OK(file->Append(std::string(100000, 'y')));
+  ASSERT_OK(file->Close());
+  delete file;
+  RandomAccessFile* readable;
+  ASSERT_OK(NewRandomAccessFile(tmp_dir + "/mmap", &readable));
+  std::string data(2000000, '\0');
+  Slice result;
+  ASSERT_OK(readable->Read(0, data.size(), &result, &data[0]));
+  delete readable;
+  ASSERT_EQ(result.size(), 1100000u);
+  data.resize(result.size());
+  ASSERT_EQ(data.find('y'), 1000000u);
+  ASSERT_EQ(data.find('x'), 0u);
+  DeleteDirIfExist(tmp_dir);
+}
+#endif
+
+// Write 4MB in records of 1000 bytes, return the number of munmap
+static uint64_t WriteMmapFile(const std::string& fname,
+                              const EnvOptions& options) {
+  IOStatsContext* ctx = GetIOStatsContext();
+  ctx->Reset();
+  SetIOStatsLevel(kIOStatsEnableCount);
+  WritableFile* file;
+  ASSERT_OK(NewWritableFile(fname, &file, options));
+  std::string record(1000, 'x');
+  for (int i = 0; i < 4 * 1024; i++) {
+    record[0] = 'a' + i % 26;
+    ASSERT_OK(file->Append(record));
+  }
+  ASSERT_OK(file->Sync());
+  ASSERT_OK(file->Close());
+  delete file;
+  SetIOStatsLevel(kIOStatsDisable);
+
+  RandomAccessFile* readable;
+  ASSERT_OK(NewRandomAccessFile(fname, &readable));
+  std::string data(5 * 1024 * 1000, '\0');
+  Slice result;
+  ASSERT_OK(readable->Read(0, data.size(), &result, &data[0]));
+  delete readable;
+  ASSERT_EQ(result.size(), 4u * 1024 * 1000);
+  for (int i = 0; i < 4 * 1024; i++) {
+    ASSERT_EQ(data[i * 1000], 'a' + i % 26);
+  }
+  return ctx->munmap_count;
+}
+
+TEST(EnvTest, MmapRegionSize) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  std::string fname = tmp_dir + "/file";
+
+  EnvOptions options;
+  options.mmap_initial_size = 64 * 1024;
+  options.mmap_max_size = 64 * 1024;
+  uint64_t fixed = WriteMmapFile(fname, options);
+  ASSERT_GE(fixed, 4u * 1000 / 64);
+
+  // 64K, 128K ... 1M, 1M, 1M, 1M
+  options.mmap_max_size = 1024 * 1024;
+  uint64_t growing = WriteMmapFile(fname, options);
+  ASSERT_LT(growing, fixed);
+  ASSERT_LE(growing, 9u);
+
+  options.mmap_prefault = EnvOptions::kMmapPrefaultPopulate;
+  WriteMmapFile(fname, options);
+  options.mmap_prefault = EnvOptions::kMmapPrefaultBackground;
+  WriteMmapFile(fname, options);
+  options.mmap_huge_pages = true;
+  WriteMmapFile(fname, options);
+  // Appending to the file written
+  WritableFile* file;
+  ASSERT_OK(AppendWritableFile(fname, &file, 4 * 1024 * 1000, options));
+  ASSERT_OK(file->Append("end"));
+  ASSERT_OK(file->Close());
+  delete file;
+  struct stat st;
+  ASSERT_EQ(0, stat(fname.c_str(), &st));
+  ASSERT_EQ(st.st_size, 4 * 1024 * 1000 + 3);
+  DeleteDirIfExist(tmp_dir);
+}
+
+static void TestRWFile(Env* env, const std::string& fname) {
+  EnvOptions options;
+  options.rw_file_reserved_size = 4 * 1024 * 1024;
+  RWFile* file;
+  ASSERT_OK(env->NewRWFile(fname, &file, options));
+  ASSERT_EQ(file->Size(), 65536u);
+  char* data = file->GetData();
+  uint64_t* counter = reinterpret_cast<uint64_t*>(data + 100);
+  *counter = 42;
+
+  // Pointers stay valid while growing
+  ASSERT_OK(file->Resize(3 * 1024 * 1024 + 10));
+  ASSERT_EQ(file->Size(), 3u * 1024 * 1024 + 10);
+  ASSERT_TRUE(file->GetData() == data);
+  ASSERT_EQ(*counter, 42u);
+  memset(data + 65536, 'x', 3 * 1024 * 1024 + 10 - 65536);
+  ASSERT_OK(file->Sync(0, file->Size()));
+  ASSERT_OK(file->Sync(65536 + 1, 100));
+  ASSERT_TRUE(file->Resize(5 * 1024 * 1024).IsInvalidArgument());
+  ASSERT_EQ(file->Size(), 3u * 1024 * 1024 + 10);
+
+  ASSERT_OK(file->Resize(2 * 1024 * 1024));
+  ASSERT_EQ(file->Size(), 2u * 1024 * 1024);
+  ASSERT_OK(file->Resize(2 * 1024 * 1024 + 5000));
+  ASSERT_EQ(data[2 * 1024 * 1024 - 1], 'x');
+  ASSERT_EQ(data[2 * 1024 * 1024], '\0');
+  delete file;
+
+  // Reopen with the size kept
+  ASSERT_OK(env->NewRWFile(fname, &file, options));
+  ASSERT_EQ(file->Size(), 2u * 1024 * 1024 + 5000);
+  counter = reinterpret_cast<uint64_t*>(file->GetData() + 100);
+  ASSERT_EQ(*counter, 42u);
+  ASSERT_EQ(file->GetData()[2 * 1024 * 1024 - 1], 'x');
+  delete file;
+}
+
+TEST(EnvTest, RWFile) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  TestRWFile(Env::Default(), tmp_dir + "/cursor");
+  Env* mem_env = NewMemEnv();
+  TestRWFile(mem_env, "/cursor");
+  delete mem_env;
+  DeleteDirIfExist(tmp_dir);
+}
+
+struct FileCacheArg {
+  FileCache* cache;
+  std::string dir;
+  int seed;
+  int errors;
+};
+
+static void* LookupFiles(void* arg) {
+  FileCacheArg* a = reinterpret_cast<FileCacheArg*>(arg);
+  unsigned int seed = a->seed;
+  for (int i = 0; i < 2000; i++) {
+    int n = rand_r(&seed) % 10;
+    FileCache::Handle* handle;
+    Status s = a->cache->Lookup(a->dir + "/" + std::to_string(n), &handle);
+    if (s.IsIncomplete()) {
+      continue;
+    }
+    char scratch[16];
+    Slice result;
+    if (s.ok()) {
+      s = a->cache->Value(handle)->Read(0, sizeof(scratch), &result, scratch);
+      a->cache->Release(handle);
+    }
+    if (!s.ok() || result.size() != static_cast<size_t>(n + 1)) {
+      a->errors++;
+    }
+  }
+  return NULL;
+}
+
+TEST(EnvTest, FileCache) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  for (int i = 0; i < 10; i++) {
+    WriteFile(tmp_dir + "/" + std::to_string(i), i + 1);
+  }
+
+  FileCache cache(3, 1);
+  FileCache::Handle* h[4];
+  ASSERT_OK(cache.Lookup(tmp_dir + "/0", &h[0]));
+  ASSERT_OK(cache.Lookup(tmp_dir + "/1", &h[1]));
+  ASSERT_OK(cache.Lookup(tmp_dir + "/2", &h[2]));
+  FileCache::Handle* same;
+  ASSERT_OK(cache.Lookup(tmp_dir + "/0", &same));
+  ASSERT_TRUE(same == h[0]);
+  cache.Release(same);
+  ASSERT_EQ(cache.TotalOpen(), 3u);
+  ASSERT_TRUE(cache.Lookup(tmp_dir + "/3", &h[3]).IsIncomplete());
+  ASSERT_TRUE(!cache.Lookup(tmp_dir + "/missing", &h[3]).ok());
+  ASSERT_EQ(cache.TotalOpen(), 3u);
+
+  // The idle one is closed to make room
+  cache.Release(h[0]);
+  ASSERT_OK(cache.Lookup(tmp_dir + "/3", &h[3]));
+  ASSERT_EQ(cache.TotalOpen(), 3u);
+  ASSERT_TRUE(cache.Lookup(tmp_dir + "/0", &h[0]).IsIncomplete());
+
+  // Evicted while in use, closed on release
+  cache.Evict(tmp_dir + "/1");
+  char scratch[16];
+  Slice result;
+  ASSERT_OK(cache.Value(h[1])->Read(0, sizeof(scratch), &result, scratch));
+  ASSERT_EQ(result.size(), 2u);
+  ASSERT_EQ(cache.TotalOpen(), 3u);
+  cache.Release(h[1]);
+  ASSERT_EQ(cache.TotalOpen(), 2u);
+  cache.Release(h[2]);
+  cache.Release(h[3]);
+  ASSERT_EQ(cache.TotalOpen(), 2u);
+
+  FileCache shared(4, 2);
+  FileCacheArg args[8];
+  pthread_t tids[8];
+  for (int i = 0; i < 8; i++) {
+    args[i].cache = &shared;
+    args[i].dir = tmp_dir;
+    args[i].seed = i;
+    args[i].errors = 0;
+    ASSERT_EQ(0, pthread_create(&tids[i], NULL, LookupFiles, &args[i]));
+  }
+  for (int i = 0; i < 8; i++) {
+    pthread_join(tids[i], NULL);
+    ASSERT_EQ(args[i].errors, 0);
+  }
+  ASSERT_LE(shared.TotalOpen(), 4u);
+  DeleteDirIfExist(tmp_dir);
+}
+
+static std::string ReadAll(const std::string& fname) {
+  SequentialFile* file;
+  ASSERT_OK(NewSequentialFile(fname, &file));
+  std::string data;
+  char scratch[4096];
+  Slice result;
+  Status s;
+  do {
+    s = file->Read(sizeof(scratch), &result, scratch);
+    data.append(result.data(), result.size());
+  } while (s.ok() && result.size() > 0);
+  delete file;
+  return data;
+}
+
+static ino_t Inode(const std::string& fname) {
+  struct stat st;
+  ASSERT_EQ(0, stat(fname.c_str(), &st));
+  return st.st_ino;
+}
+
+TEST(EnvTest, CopyFile) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  std::string src = tmp_dir + "/src";
+  std::string dst = tmp_dir + "/dst";
+  ASSERT_EQ(0, CreatePath(src + "/log/db"));
+  WriteFile(src + "/manifest", 100);
+  WriteFile(src + "/log/write2file1", 3 << 20);
+  WriteFile(src + "/log/write2file2", 4097);
+  WriteFile(src + "/log/db/empty", 0);
+  ASSERT_EQ(0, symlink("manifest", (src + "/link").c_str()));
+
+  CopyMethod method;
+  ASSERT_OK(CopyFile(src + "/manifest", tmp_dir + "/copy",
+                     CopyOptions(), &method));
+  ASSERT_TRUE(method != kCopyLink);
+  ASSERT_EQ(ReadAll(tmp_dir + "/copy"), std::string(100, 'x'));
+  ASSERT_TRUE(Inode(tmp_dir + "/copy") != Inode(src + "/manifest"));
+  ASSERT_TRUE(!CopyFile(src + "/missing", tmp_dir + "/copy").ok());
+
+  // Only the completed binlog is linked
+  CopyOptions options;
+  options.sync = true;
+  options.link_if = [&](const std::string& fname) {
+    return fname == src + "/log/write2file1";
+  };
+  ASSERT_OK(CloneDir(src, dst, options));
+  ASSERT_EQ(ReadAll(dst + "/manifest"), std::string(100, 'x'));
+  ASSERT_TRUE(ReadAll(dst + "/log/write2file1") == std::string(3 << 20, 'x'));
+  ASSERT_EQ(ReadAll(dst + "/log/write2file2"), std::string(4097, 'x'));
+  ASSERT_EQ(ReadAll(dst + "/log/db/empty"), "");
+  ASSERT_EQ(Inode(dst + "/log/write2file1"), Inode(src + "/log/write2file1"));
+  ASSERT_TRUE(Inode(dst + "/log/write2file2")
+              != Inode(src + "/log/write2file2"));
+  char target[64];
+  ssize_t n = readlink((dst + "/link").c_str(), target, sizeof(target));
+  ASSERT_EQ(std::string(target, std::max<ssize_t>(n, 0)), "manifest");
+
+  // Cloning again replaces the copies
+  ASSERT_OK(CloneDir(src, dst));
+  ASSERT_TRUE(ReadAll(dst + "/log/write2file1") == std::string(3 << 20, 'x'));
+  ASSERT_TRUE(ReadAll(src + "/log/write2file1") == std::string(3 << 20, 'x'));
+  ASSERT_TRUE(Inode(dst + "/log/write2file1")
+              != Inode(src + "/log/write2file1"));
+  ASSERT_TRUE(!CopyFile(src + "/manifest", src + "/manifest").ok());
+
+  // Linking to src itself or to a link of it keeps src
+  CopyOptions link_all;
+  link_all.link_if = [](const std::string& fname) { return true; };
+  ASSERT_TRUE(CopyFile(src + "/manifest", src + "/manifest", link_all)
+              .IsInvalidArgument());
+  ASSERT_EQ(ReadAll(src + "/manifest"), std::string(100, 'x'));
+  ASSERT_OK(CopyFile(src + "/manifest", tmp_dir + "/linked", link_all,
+                     &method));
+  ASSERT_TRUE(method == kCopyLink);
+  ASSERT_OK(CopyFile(src + "/manifest", tmp_dir + "/linked", link_all,
+                     &method));
+  ASSERT_OK(CopyFile(src + "/manifest", src + "/manifest", link_all));
+  ASSERT_OK(CopyFile(tmp_dir + "/linked", src + "/manifest", link_all));
+  ASSERT_EQ(ReadAll(src + "/manifest"), std::string(100, 'x'));
+  ASSERT_EQ(Inode(tmp_dir + "/linked"), Inode(src + "/manifest"));
+  ASSERT_TRUE(!CloneDir(tmp_dir + "/missing", dst).ok());
+  DeleteDirIfExist(tmp_dir);
+}
+
+static void TestSequentialFile(const std::string& fname,
+                               const EnvOptions& options) {
+  std::string data;
+  for (int i = 0; data.size() < (1 << 20); i++) {
+    data.append("line" + std::to_string(i) + "\n");
+  }
+  WritableFile* writable;
+  ASSERT_OK(NewWritableFile(fname, &writable));
+  ASSERT_OK(writable->Append(data));
+  ASSERT_OK(writable->Close());
+  delete writable;
+
+  SequentialFile* file;
+  ASSERT_OK(NewSequentialFile(fname, &file, options));
+  char line[64];
+  ASSERT_EQ(std::string(file->ReadLine(line, sizeof(line))), "line0\n");
+  uint64_t pos = 6;
+  std::string scratch(256 << 10, '\0');
+  Slice result;
+  // Small and large reads, skips within and beyond the buffer
+  size_t sizes[] = { 1, 7, 4096, 100, 200 << 10, 3 };
+  uint64_t skips[] = { 0, 10, 0, 5000, 0, 300 << 10 };
+  for (int round = 0; round < 2; round++) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      ASSERT_OK(file->Skip(skips[i]));
+      pos += skips[i];
+      ASSERT_OK(file->Read(sizes[i], &result, &scratch[0]));
+      ASSERT_TRUE(result == Slice(data.data() + pos, sizes[i]));
+      pos += sizes[i];
+    }
+  }
+  Status s = file->Read(scratch.size(), &result, &scratch[0]);
+  ASSERT_TRUE(s.IsEndFile());
+  ASSERT_TRUE(result == Slice(data.data() + pos, data.size() - pos));
+
+  // Appended data is visible after EndFile
+  ASSERT_OK(AppendWritableFile(fname, &writable, data.size()));
+  ASSERT_OK(writable->Append("tail\n"));
+  ASSERT_OK(writable->Close());
+  delete writable;
+  ASSERT_EQ(std::string(file->ReadLine(line, sizeof(line))), "tail\n");
+  ASSERT_TRUE(file->ReadLine(line, sizeof(line)) == NULL);
+  delete file;
+  DeleteFile(fname);
+}
+
+TEST(EnvTest, SequentialFile) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  EnvOptions options;
+  TestSequentialFile(tmp_dir + "/sequential", options);
+  options.sequential_read_buffer_size = 4096;
+  options.readahead_size = 64 << 10;
+  TestSequentialFile(tmp_dir + "/sequential", options);
+  options.background_readahead = true;
+  TestSequentialFile(tmp_dir + "/sequential", options);
+  options.readahead_size = 0;
+  TestSequentialFile(tmp_dir + "/sequential", options);
+  options.use_direct_reads = true;
+  TestSequentialFile(tmp_dir + "/sequential", options);
+}
+
+TEST(EnvTest, SequentialFileZeros) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  std::string fname = tmp_dir + "/zeros";
+  std::string data(1 << 20, '\0');
+  WritableFile* writable;
+  ASSERT_OK(NewWritableFile(fname, &writable));
+  ASSERT_OK(writable->Append(data));
+  ASSERT_OK(writable->Close());
+  delete writable;
+
+  // Zeros are buffered as any other data
+  SequentialFile* file;
+  ASSERT_OK(NewSequentialFile(fname, &file));
+#ifndef SLASH_NIOSTATS
+  IOStatsContext* ctx = GetIOStatsContext();
+  ctx->Reset();
+  SetIOStatsLevel(kIOStatsEnableCount);
+#endif
+  char scratch[8];
+  Slice result;
+  for (size_t pos = 0; pos < data.size(); pos += sizeof(scratch)) {
+    ASSERT_OK(file->Read(sizeof(scratch), &result, scratch));
+    ASSERT_TRUE(result == Slice(data.data() + pos, sizeof(scratch)));
+  }
+  ASSERT_TRUE(file->Read(sizeof(scratch), &result, scratch).IsEndFile());
+#ifndef SLASH_NIOSTATS
+  SetIOStatsLevel(kIOStatsDisable);
+  ASSERT_LT(ctx->syscalls, 100u);
+  ctx->Reset();
+#endif
+
+  // Zeros filled in behind the buffer are read after DropBuffer
+  int fd = open(fname.c_str(), O_WRONLY);
+  ASSERT_GE(fd, 0);
+  delete file;
+  ASSERT_OK(NewSequentialFile(fname, &file));
+  ASSERT_OK(file->Read(sizeof(scratch), &result, scratch));
+  ASSERT_EQ(8, pwrite(fd, "12345678", 8, 8));
+  close(fd);
+  file->DropBuffer();
+  ASSERT_OK(file->Read(sizeof(scratch), &result, scratch));
+  ASSERT_EQ(result.ToString(), "12345678");
+  delete file;
+  DeleteFile(fname);
+}
+
+struct AtomicWriteArg {
+  DirSyncBatcher* batcher;
+  std::string fname;
+  Status s;
+};
+
+static void* WriteAtomically(void* arg) {
+  AtomicWriteArg* a = reinterpret_cast<AtomicWriteArg*>(arg);
+  for (int i = 0; i < 20 && a->s.ok(); i++) {
+    a->s = WriteFileAtomic(a->fname, a->fname + std::to_string(i),
+                           a->batcher);
+  }
+  return NULL;
+}
+
+TEST(EnvTest, WriteFileAtomic) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+
+  std::string fname = tmp_dir + "/atomic";
+  ASSERT_OK(WriteFileAtomic(fname, "old"));
+  ASSERT_OK(WriteFileAtomic(fname, "new"));
+  ASSERT_EQ(ReadAll(fname), "new");
+  ASSERT_TRUE(!FileExists(fname + ".tmp"));
+  ASSERT_TRUE(!WriteFileAtomic(tmp_dir + "/missing/atomic", "x").ok());
+
+  DirSyncBatcher batcher(1000);
+  AtomicWriteArg args[8];
+  pthread_t tids[8];
+  for (int i = 0; i < 8; i++) {
+    args[i].batcher = &batcher;
+    args[i].fname = tmp_dir + "/atomic" + std::to_string(i);
+    ASSERT_EQ(0, pthread_create(&tids[i], NULL, WriteAtomically, &args[i]));
+  }
+  for (int i = 0; i < 8; i++) {
+    pthread_join(tids[i], NULL);
+    ASSERT_OK(args[i].s);
+    ASSERT_EQ(ReadAll(args[i].fname), args[i].fname + "19");
+  }
+  // The renames of the threads share the directory fsync
+  ASSERT_LT(batcher.syncs(), 8u * 20);
+
+  Env* env = NewMemEnv();
+  ASSERT_OK(env->WriteFileAtomic("/mem/atomic", "old"));
+  ASSERT_OK(env->WriteFileAtomic("/mem/atomic", "new"));
+  ASSERT_TRUE(!env->FileExists("/mem/atomic.tmp"));
+  env->DeleteFile("/mem/atomic");
+  delete env;
+  DeleteDirIfExist(tmp_dir);
+}
+
+TEST(EnvTest, AsyncIO) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+
+  AsyncIO io(4, 1);
+  ASSERT_OK(io.Start());
+
+  // Appends of one file keep their order
+  WritableFile* writable;
+  ASSERT_OK(NewWritableFile(tmp_dir + "/async", &writable));
+  std::vector<std::string> records;
+  std::string expected;
+  for (int i = 0; i < 100; i++) {
+    records.push_back(std::to_string(i) + ",");
+    expected += records.back();
+  }
+  std::atomic<int> failed(0);
+  AsyncIO::Callback check = [&](const Status& s) {
+    if (!s.ok()) {
+      failed++;
+    }
+  };
+  for (size_t i = 0; i < records.size(); i++) {
+    io.WriteAsync(writable, records[i], check);
+  }
+  io.SyncAsync(writable, check);
+  io.WaitForIdle();
+  ASSERT_EQ(io.Pending(), 0u);
+  ASSERT_OK(writable->Close());
+  delete writable;
+  ASSERT_EQ(ReadAll(tmp_dir + "/async"), expected);
+
+  RandomAccessFile* file;
+  ASSERT_OK(NewRandomAccessFile(tmp_dir + "/async", &file));
+  char scratch[2][8];
+  std::string results[2];
+  for (int i = 0; i < 2; i++) {
+    io.ReadAsync(file, i * 4, 4, scratch[i],
+                 [&, i](const Status& s, const Slice& result) {
+                   if (!s.ok()) {
+                     failed++;
+                   }
+                   results[i] = result.ToString();
+                 });
+  }
+  io.WaitForIdle();
+  delete file;
+  ASSERT_EQ(results[0], expected.substr(0, 4));
+  ASSERT_EQ(results[1], expected.substr(4, 4));
+
+  // At most one background operation at a time, foreground runs beside
+  std::atomic<int> running(0);
+  std::atomic<int> max_running(0);
+  AsyncIO::Callback slow = [&](const Status& s) {
+    int n = ++running;
+    int max = max_running;
+    while (n > max && !max_running.compare_exchange_weak(max, n)) {
+    }
+    SleepForMicroseconds(10000);
+    running--;
+  };
+  std::atomic<bool> foreground_done(false);
+  for (int i = 0; i < 4; i++) {
+    io.DeleteAsync(tmp_dir + "/missing" + std::to_string(i), slow);
+  }
+  while (running == 0) {
+    SleepForMicroseconds(100);
+  }
+  io.RenameAsync(tmp_dir + "/async", tmp_dir + "/renamed",
+                 [&](const Status& s) {
+                   if (!s.ok()) {
+                     failed++;
+                   }
+                   // Not behind all the slow background deletes
+                   foreground_done = running > 0;
+                 }, kIOPriorityHigh);
+  io.WaitForIdle();
+  ASSERT_EQ(max_running, 1);
+  ASSERT_TRUE(foreground_done);
+  ASSERT_EQ(failed, 0);
+  ASSERT_TRUE(FileExists(tmp_dir + "/renamed"));
+
+  io.DeleteAsync(tmp_dir + "/renamed", check);
+  io.WaitForIdle();
+  ASSERT_TRUE(!FileExists(tmp_dir + "/renamed"));
+  ASSERT_EQ(failed, 0);
+  DeleteDirIfExist(tmp_dir);
+}
+
+static void TestRandomRWFileSpace(const std::string& fname) {
+  RandomRWFile* file;
+  ASSERT_OK(NewRandomRWFile(fname, &file));
+  struct stat st;
+
+  // Allocated blocks beyond the size
+  Status s = file->Allocate(0, 1 << 20);
+  if (s.IsNotSupported()) {
+    fprintf(stderr, "fallocate is not supported under %s\n", fname.c_str());
+    delete file;
+    DeleteFile(fname);
+    return;
+  }
+  ASSERT_OK(s);
+  ASSERT_EQ(0, stat(fname.c_str(), &st));
+  ASSERT_EQ(st.st_size, 0);
+  ASSERT_GE(st.st_blocks * 512, 1 << 20);
+
+  std::string data(256 << 10, 'x');
+  ASSERT_OK(file->Write(0, data));
+  ASSERT_OK(file->RangeSync(0, data.size()));
+  ASSERT_OK(file->Prefetch(0, data.size()));
+
+  ASSERT_OK(file->PunchHole(64 << 10, 64 << 10));
+  ASSERT_EQ(0, stat(fname.c_str(), &st));
+  ASSERT_EQ(static_cast<size_t>(st.st_size), data.size());
+  ASSERT_LE(st.st_blocks * 512, (1 << 20) - (64 << 10));
+  std::string scratch(data.size(), '\0');
+  Slice result;
+  ASSERT_OK(file->Read(0, data.size(), &result, &scratch[0]));
+  ASSERT_EQ(result.size(), data.size());
+  ASSERT_EQ(scratch.compare(0, 64 << 10, data, 0, 64 << 10), 0);
+  ASSERT_EQ(scratch.find_first_not_of('\0', 64 << 10), 128u << 10);
+  ASSERT_EQ(scratch.find_first_not_of('x', 128 << 10), std::string::npos);
+  delete file;
+  DeleteFile(fname);
+}
+
+TEST(EnvTest, RandomRWFileSpace) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  TestRandomRWFileSpace(tmp_dir + "/random_rw");
+  // tmpfs, where the blocks are pages of memory
+  if (IsDir("/dev/shm") == 0) {
+    TestRandomRWFileSpace("/dev/shm/slash_random_rw");
+  }
+
+  Env* env = NewMemEnv();
+  RandomRWFile* file;
+  ASSERT_OK(env->NewRandomRWFile("/mem/random_rw", &file));
+  ASSERT_OK(file->Allocate(0, 4096));
+  ASSERT_OK(file->Prefetch(0, 4096));
+  ASSERT_OK(file->RangeSync(0, 4096));
+  ASSERT_TRUE(file->PunchHole(0, 4096).IsNotSupported());
+  delete file;
+  env->DeleteFile("/mem/random_rw");
+  delete env;
+}
+
+TEST(EnvTest, FaultInjectionEnv) {
+  std::string tmp_dir;
+  GetTestDirectory(&tmp_dir);
+  DeleteDirIfExist(tmp_dir);
+  ASSERT_EQ(0, CreatePath(tmp_dir));
+  FaultInjectionEnv fault;
+  Env* env = &fault;
+
+  // Only the synced data survives
+  WritableFile* writable;
+  ASSERT_OK(env->NewWritableFile(tmp_dir + "/log", &writable));
+  ASSERT_OK(writable->Append("synced,"));
+  ASSERT_OK(writable->Sync());
+  ASSERT_OK(writable->Append("lost"));
+  ASSERT_OK(writable->Flush());
+  delete writable;
+  RWFile* rw;
+  ASSERT_OK(env->NewRWFile(tmp_dir + "/meta", &rw));
+  memcpy(rw->GetData(), "abcd", 4);
+  ASSERT_OK(rw->Sync(0, 2));
+  delete rw;
+  ASSERT_OK(env->NewWritableFile(tmp_dir + "/tmp", &writable));
+  ASSERT_OK(writable->Append("renamed"));
+  ASSERT_OK(fault.SyncAll());
+  delete writable;
+  ASSERT_EQ(0, env->RenameFile(tmp_dir + "/tmp", tmp_dir + "/renamed"));
+
+  uint64_t dropped;
+  ASSERT_OK(fault.DropUnsyncedData(&dropped));
+  ASSERT_EQ(dropped, 6u);
+  ASSERT_EQ(ReadAll(tmp_dir + "/log"), "synced,");
+  ASSERT_EQ(ReadAll(tmp_dir + "/renamed"), "renamed");
+  ASSERT_OK(env->NewRWFile(tmp_dir + "/meta", &rw));
+  ASSERT_EQ(std::string(rw->GetData(), 4), std::string("ab\0\0", 4));
+  delete rw;
+
+  // Reopened, the data before is durable
+  ASSERT_OK(env->AppendWritableFile(tmp_dir + "/log", &writable, 7));
+  ASSERT_OK(writable->Append("more"));
+  fault.SetFailureProbability(FaultInjectionEnv::kFaultSync, 1);
+  ASSERT_TRUE(writable->Sync().IsIOError());
+  ASSERT_TRUE(fault.SyncAll().IsIOError());
+  fault.SetFailureProbability(FaultInjectionEnv::kFaultSync, 0);
+  fault.SetFailureProbability(FaultInjectionEnv::kFaultWrite, 1);
+  ASSERT_TRUE(writable->Append("more").IsIOError());
+  fault.SetFailureProbability(FaultInjectionEnv::kFaultWrite, 0.5);
+  int failed = 0;
+  for (int i = 0; i < 200; i++) {
+    failed += writable->Append("x").ok() ? 0 : 1;
+  }
+  ASSERT_GT(failed, 50);
+  ASSERT_LT(failed, 150);
+  fault.SetFailureProbability(FaultInjectionEnv::kFaultWrite, 0);
+  delete writable;
+  ASSERT_OK(fault.DropUnsyncedData());
+  ASSERT_EQ(ReadAll(tmp_dir + "/log"), "synced,");
+
+  fault.SetLatency(FaultInjectionEnv::kFaultRead, 20000);
+  SequentialFile* sequential;
+  ASSERT_OK(env->NewSequentialFile(tmp_dir + "/log", &sequential));
+  char scratch[16];
+  Slice result;
+  uint64_t start = NowMicros();
+  ASSERT_TRUE(sequential->Read(sizeof(scratch), &result, scratch).IsEndFile());
+  ASSERT_GE(NowMicros() - start, 20000u);
+  ASSERT_EQ(result.ToString(), "synced,");
+  delete sequential;
+  DeleteDirIfExist(tmp_dir);
+}
+
+TEST(EnvTest, CoarseClock) {
+  // The coarse clock lags behind NowMicros by its resolution, one tick.
+  // Ticks run late on a busy or virtualized host, allow a few of them
+  uint64_t tick = 4000;
+#ifdef CLOCK_REALTIME_COARSE
+  struct timespec res;
+  ASSERT_EQ(0, clock_getres(CLOCK_REALTIME_COARSE, &res));
+  tick = res.tv_sec * 1000000 + res.tv_nsec / 1000 + 1;
+#endif
+  uint64_t max_lag = 4 * tick;
+  for (int i = 0; i < 1000; i++) {
+    uint64_t before = NowMicros();
+    uint64_t coarse = NowCoarseMicros();
+    uint64_t after = NowMicros();
+    ASSERT_LE(coarse, after);
+    ASSERT_GE(coarse + max_lag, before);
+
+    uint64_t seconds = NowCoarseSeconds();
+    coarse = NowCoarseMicros();
+    ASSERT_LE(seconds, coarse / 1000000);
+    ASSERT_GE(NowCoarseSeconds(), coarse / 1000000);
+    ASSERT_LE(seconds, NowMicros() / 1000000);
+  }
+}
+
+TEST(EnvTest, MonotonicClock) {
+  uint64_t prev = NowNanos();
+  for (int i = 0; i < 100000; i++) {
+    uint64_t now = NowNanos();
+    ASSERT_GE(now, prev);
+    prev = now;
+  }
+  uint64_t micros = MonotonicMicros();
+  ASSERT_LE(micros, NowNanos() / 1000);
+
+  StopWatch sw;
+  SleepForMicroseconds(20000);
+  uint64_t elapsed = sw.ElapsedMicros();
+  ASSERT_GE(elapsed, 20000u);
+  ASSERT_LT(elapsed, 5000000u);
+  ASSERT_GE(sw.LapNanos(), elapsed * 1000);
+  ASSERT_LT(sw.ElapsedNanos(), 5000000000ULL);
+
+  // The waits time out on CLOCK_MONOTONIC
+  Mutex mu;
+  CondVar cv(&mu);
+  sw.Reset();
+  mu.Lock();
+  ASSERT_TRUE(!cv.TimedWait(30));
+  mu.Unlock();
+  ASSERT_GE(sw.ElapsedMicros(), 30000u);
+  ASSERT_LT(sw.ElapsedMicros(), 5000000u);
+
+  CondLock cl;
+  sw.Reset();
+  cl.Lock();
+  cl.TimedWait(30);
+  cl.Unlock();
+  ASSERT_GE(sw.ElapsedMicros(), 30000u);
+  ASSERT_LT(sw.ElapsedMicros(), 5000000u);
+}
+
 }  // namespace slash